@@ -1,321 +1,1486 @@
 #include "apa.h"
-#include <zlib.h>
+#include "blocking_queue.h"
+#include "index_cache.h"
+#include "scheduler.h"
+#include "stats.h"
 #include <stdexcept>
 #include <cstring>
 #include <cmath>
 #include <map>
 #include <fstream>
 #include <iomanip>
+#include <sstream>
 #include <algorithm>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-void APAMatrix::save(const std::string& filename) const {
-    std::ofstream out(filename);
+void APAMatrix::save(const std::string& filename, const OutputFormat& format) const {
+    writeMatrix(*this, filename, format);
+}
+
+const size_t PARTIAL_HEADER_BYTES = 8 + 12 + 8;
+
+// Magic, shard index and count and width as little-endian int32, the run
+// fingerprint as little-endian uint64, then the matrix rows, row sums and
+// column sums as little-endian floats
+void ApaPartial::save(const std::string& filename, const SliceShard& shard, uint64_t fingerprint) const {
+    std::ofstream out(filename, std::ios::binary);
     if (!out) {
         throw std::runtime_error("Cannot open output file: " + filename);
     }
+    const int width = matrix.width;
+    std::vector<char> bytes(PARTIAL_HEADER_BYTES + 4 * static_cast<size_t>(width) * (width + 2));
+    std::memcpy(bytes.data(), "APAPART2", 8);
+    storeLE32(&bytes[8], static_cast<uint32_t>(shard.index));
+    storeLE32(&bytes[12], static_cast<uint32_t>(shard.count));
+    storeLE32(&bytes[16], static_cast<uint32_t>(width));
+    storeLE64(&bytes[20], fingerprint);
+    char* p = &bytes[PARTIAL_HEADER_BYTES];
+    for (int r = 0; r < width; r++) {
+        for (int c = 0; c < width; c++, p += 4) storeLEFloat(p, matrix.at(r, c));
+    }
+    for (float value : rowSums) { storeLEFloat(p, value); p += 4; }
+    for (float value : colSums) { storeLEFloat(p, value); p += 4; }
+    if (!out.write(bytes.data(), bytes.size())) {
+        throw std::runtime_error("Could not write partial result: " + filename);
+    }
+}
 
-    // Write as space-separated values with high precision
-    out << std::fixed << std::setprecision(6);
-    for (int i = 0; i < width; i++) {
-        for (int j = 0; j < width; j++) {
-            if (j > 0) out << " ";
-            out << matrix[i][j];
+ApaPartial ApaPartial::load(const std::string& filename, SliceShard& shard, uint64_t& fingerprint) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Could not open file: " + filename);
+    }
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (bytes.size() < PARTIAL_HEADER_BYTES || std::memcmp(bytes.data(), "APAPART2", 8) != 0) {
+        throw std::runtime_error("Not a partial APA result: " + filename);
+    }
+    shard.index = static_cast<int32_t>(loadLE32(&bytes[8]));
+    shard.count = static_cast<int32_t>(loadLE32(&bytes[12]));
+    const int width = static_cast<int32_t>(loadLE32(&bytes[16]));
+    fingerprint = loadLE64(&bytes[20]);
+    if (width <= 0 || bytes.size() != PARTIAL_HEADER_BYTES + 4 * static_cast<size_t>(width) * (width + 2)) {
+        throw std::runtime_error("Truncated partial APA result: " + filename);
+    }
+    ApaPartial partial(width);
+    const char* p = &bytes[PARTIAL_HEADER_BYTES];
+    for (int r = 0; r < width; r++) {
+        for (int c = 0; c < width; c++, p += 4) partial.matrix.add(r, c, loadLEFloat(p));
+    }
+    for (float& value : partial.rowSums) { value = loadLEFloat(p); p += 4; }
+    for (float& value : partial.colSums) { value = loadLEFloat(p); p += 4; }
+    return partial;
+}
+
+namespace {
+
+// Kernels for APAMatrix::normalize. Each handles whole padded rows: data
+// has rows of `stride` floats and colSums is padded to stride with zeros.
+typedef void (*NormalizeRowsKernel)(float*, int, int, const float*, const float*);
+
+void normalizeRowsScalar(float* data, int rows, int stride, const float* rowSums, const float* colSums) {
+    for (int r = 0; r < rows; ++r) {
+        float* row = data + static_cast<size_t>(r) * stride;
+        for (int c = 0; c < stride; ++c) {
+            float normVal = rowSums[r] * colSums[c];
+            row[c] = normVal > 0 ? row[c] / normVal : 0.0f;
         }
-        out << "\n";
     }
 }
 
-std::vector<APAMatrix> processSliceFile(
-    const std::string& slice_file,
-    const std::vector<std::vector<BedpeEntry>>& all_bedpe_entries_const,
-    int window_size,
-    bool isInter,
-    long min_genome_dist,
-    long max_genome_dist) {
-    
-    // Make a copy we can modify
-    auto all_bedpe_entries = all_bedpe_entries_const;
-    
-    std::cout << "Opening slice file..." << std::endl;
-    if (window_size <= 0) {
-        throw std::runtime_error("Window size must be positive");
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void normalizeRowsAvx2(float* data, int rows, int stride, const float* rowSums, const float* colSums) {
+    const __m256 zero = _mm256_setzero_ps();
+    for (int r = 0; r < rows; ++r) {
+        float* row = data + static_cast<size_t>(r) * stride;
+        const __m256 rowSum = _mm256_set1_ps(rowSums[r]);
+        for (int c = 0; c < stride; c += 8) {
+            __m256 normVal = _mm256_mul_ps(rowSum, _mm256_load_ps(colSums + c));
+            __m256 positive = _mm256_cmp_ps(normVal, zero, _CMP_GT_OQ);
+            __m256 quotient = _mm256_div_ps(_mm256_load_ps(row + c), normVal);
+            _mm256_store_ps(row + c, _mm256_and_ps(quotient, positive));
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+void normalizeRowsAvx512(float* data, int rows, int stride, const float* rowSums, const float* colSums) {
+    const __m512 zero = _mm512_setzero_ps();
+    for (int r = 0; r < rows; ++r) {
+        float* row = data + static_cast<size_t>(r) * stride;
+        const __m512 rowSum = _mm512_set1_ps(rowSums[r]);
+        for (int c = 0; c < stride; c += 16) {
+            __m512 normVal = _mm512_mul_ps(rowSum, _mm512_load_ps(colSums + c));
+            __mmask16 positive = _mm512_cmp_ps_mask(normVal, zero, _CMP_GT_OQ);
+            _mm512_store_ps(row + c, _mm512_maskz_div_ps(positive, _mm512_load_ps(row + c), normVal));
+        }
+    }
+}
+
+NormalizeRowsKernel selectNormalizeKernel() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return normalizeRowsAvx512;
+    if (__builtin_cpu_supports("avx2")) return normalizeRowsAvx2;
+    return normalizeRowsScalar;
+}
+#else
+// Elsewhere only the scalar kernel
+NormalizeRowsKernel selectNormalizeKernel() {
+    return normalizeRowsScalar;
+}
+#endif
+
+} // namespace
+
+void APAMatrix::normalize(const std::vector<float>& rowSums, const std::vector<float>& colSums) {
+    static const NormalizeRowsKernel kernel = selectNormalizeKernel();
+
+    // Zero column sums over the padding keep the padding at zero
+    std::vector<float, AlignedAllocator<float, 64>> paddedColSums(stride, 0.0f);
+    std::copy(colSums.begin(), colSums.begin() + width, paddedColSums.begin());
+    kernel(data.data(), width, stride, rowSums.data(), paddedColSums.data());
+}
+
+namespace {
+
+// Number of contact records handed to a worker at a time
+const size_t RECORDS_PER_BATCH = 1 << 16;
+
+// Maximum number of batches queued per worker before the reader blocks
+const size_t BATCHES_PER_WORKER = 4;
+
+// Records in each run a sample round of an unindexed slice reads
+const uint64_t SAMPLE_RUN_RECORDS = 4096;
+
+// Bin of a coarser resolution holding a slice bin, rounding towards negative infinity
+inline int32_t mergeBin(int32_t bin, int32_t merge) {
+    return bin >= 0 ? bin / merge : -((-bin + merge - 1) / merge);
+}
+
+// How contacts reach one LoopIndex: slice bins are merged `merge` to one,
+// and (intra) the merged bins must be within the index's distance band
+struct IndexBins {
+    int32_t merge;
+    int32_t min_band_bins;
+    int32_t max_band_bins;
+};
+
+// Read-only state shared by everything that processes contacts
+struct ScanContext {
+    const ChromosomeTable& chromosomes;
+    const RegionsOfInterest& roi;
+    const SharedLoopIndices& all_indices;
+    const std::vector<IndexBins>& index_bins;     // By index
+    const std::vector<int32_t>& coverage_merges;  // Merge factors > 1 that need coverage vectors
+    // Bins to keep coverage for, at the slice resolution and then by coverage_merges
+    const std::vector<std::vector<CoverageVectors::Range>>& coverage_ranges;
+    int32_t resolution;
+    bool isInter;
+    bool sorted;            // The header declares the records sorted, so their order is not checked
+    int32_t min_band_bins;  // Intra distance band (with buffer) in slice bins, the union of all
+    int32_t max_band_bins;  // indices' bands; see distanceBandBins
+    const std::vector<char>& shard_pairs;  // Empty to read every record, else [chr1 * size + chr2]
+    int32_t sample_every;  // > 1: only records whose sampleHash is sample_round modulo this are read
+    int32_t sample_round;
+};
+
+// Number of records decoded and filtered together
+const size_t FILTER_BATCH = 4096;
+
+// A FILTER_BATCH of decoded records as columns
+struct ContactColumns {
+    std::vector<int32_t, AlignedAllocator<int32_t, 64>> chr1;  // Chromosome IDs, -1 if unknown
+    std::vector<int32_t, AlignedAllocator<int32_t, 64>> chr2;
+    std::vector<int32_t, AlignedAllocator<int32_t, 64>> binX;
+    std::vector<int32_t, AlignedAllocator<int32_t, 64>> binY;
+    std::vector<float, AlignedAllocator<float, 64>> value;
+    std::vector<uint32_t> coverage_rows;  // Filter output: rows that count towards coverage
+    std::vector<uint32_t> contact_rows;   // ... and the subset also inside the distance band
+
+    ContactColumns()
+        : chr1(FILTER_BATCH), chr2(FILTER_BATCH), binX(FILTER_BATCH), binY(FILTER_BATCH),
+          value(FILTER_BATCH), coverage_rows(FILTER_BATCH), contact_rows(FILTER_BATCH) {}
+};
+
+// The intra distance test |binX - binY| * resolution within
+// [min_genome_dist - buffer, max_genome_dist + buffer] as an exact range of
+// bin distances, with buffer = 3 * window_size bins
+void distanceBandBins(long min_genome_dist, long max_genome_dist, int32_t resolution, int window_size,
+                      int32_t& min_bins, int32_t& max_bins) {
+    int64_t buffer = static_cast<int64_t>(3 * window_size) * resolution;
+    int64_t low = min_genome_dist - buffer;
+    int64_t high = max_genome_dist + buffer;
+    int64_t low_bins = low >= 0 ? (low + resolution - 1) / resolution : -(-low / resolution);  // Ceiling
+    int64_t high_bins = high >= 0 ? high / resolution : -((-high + resolution - 1) / resolution);  // Floor
+    min_bins = static_cast<int32_t>(std::max<int64_t>(low_bins, 0));
+    max_bins = static_cast<int32_t>(std::min<int64_t>(high_bins, INT32_MAX));
+}
+
+// Filter kernels: append the rows of cols[0, n) that pass the value,
+// chromosome and inter/intra checks to coverage_rows, and those that also
+// pass the intra distance band to contact_rows, setting both counts and
+// the number of rows with a usable value
+typedef void (*FilterKernel)(ContactColumns& cols, size_t n, const ScanContext& ctx,
+                             size_t& num_valid, size_t& num_coverage, size_t& num_contacts);
+
+// Scalar filter of rows [begin, n), appending after the counts given
+void filterRows(ContactColumns& cols, size_t begin, size_t n, const ScanContext& ctx,
+                size_t& num_valid, size_t& num_coverage, size_t& num_contacts) {
+    for (size_t i = begin; i < n; i++) {
+        const float value = cols.value[i];
+        const int32_t chr1 = cols.chr1[i];
+        const int32_t chr2 = cols.chr2[i];
+        // NaN fails both comparisons
+        if (!(value > 0 && value < INFINITY)) continue;
+        num_valid++;
+        if (chr1 < 0 || chr2 < 0 || ctx.isInter == (chr1 == chr2)) continue;
+        cols.coverage_rows[num_coverage++] = static_cast<uint32_t>(i);
+        if (!ctx.isInter) {
+            int32_t bin_distance = std::abs(cols.binX[i] - cols.binY[i]);
+            if (bin_distance < ctx.min_band_bins || bin_distance > ctx.max_band_bins) continue;
+        }
+        cols.contact_rows[num_contacts++] = static_cast<uint32_t>(i);
     }
+}
+
+void filterScalar(ContactColumns& cols, size_t n, const ScanContext& ctx,
+                  size_t& num_valid, size_t& num_coverage, size_t& num_contacts) {
+    num_valid = num_coverage = num_contacts = 0;
+    filterRows(cols, 0, n, ctx, num_valid, num_coverage, num_contacts);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void filterAvx2(ContactColumns& cols, size_t n, const ScanContext& ctx,
+                size_t& num_valid, size_t& num_coverage, size_t& num_contacts) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 infinity = _mm256_set1_ps(INFINITY);
+    const __m256i minus_one = _mm256_set1_epi32(-1);
+    const __m256i below_band = _mm256_set1_epi32(ctx.min_band_bins - 1);
+    const __m256i above_band = _mm256_set1_epi32(ctx.max_band_bins);
+    size_t valid_rows = 0, covered = 0, kept = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 value = _mm256_load_ps(&cols.value[i]);
+        __m256i chr1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(&cols.chr1[i]));
+        __m256i chr2 = _mm256_load_si256(reinterpret_cast<const __m256i*>(&cols.chr2[i]));
+
+        __m256 valid = _mm256_and_ps(_mm256_cmp_ps(value, zero, _CMP_GT_OQ),
+                                     _mm256_cmp_ps(value, infinity, _CMP_LT_OQ));
+        __m256i known = _mm256_and_si256(_mm256_cmpgt_epi32(chr1, minus_one),
+                                         _mm256_cmpgt_epi32(chr2, minus_one));
+        __m256i same = _mm256_cmpeq_epi32(chr1, chr2);
+        valid_rows += __builtin_popcount(_mm256_movemask_ps(valid));
+        __m256i selected = _mm256_and_si256(_mm256_castps_si256(valid), known);
+        selected = ctx.isInter ? _mm256_andnot_si256(same, selected) : _mm256_and_si256(same, selected);
+        unsigned coverage_bits = _mm256_movemask_ps(_mm256_castsi256_ps(selected));
 
-    // Try opening as uncompressed first
-    FILE* raw_file = fopen(slice_file.c_str(), "rb");
-    gzFile gz_file = nullptr;
-    bool is_compressed = false;
+        unsigned contact_bits = coverage_bits;
+        if (!ctx.isInter && coverage_bits) {
+            __m256i binX = _mm256_load_si256(reinterpret_cast<const __m256i*>(&cols.binX[i]));
+            __m256i binY = _mm256_load_si256(reinterpret_cast<const __m256i*>(&cols.binY[i]));
+            __m256i distance = _mm256_abs_epi32(_mm256_sub_epi32(binX, binY));
+            __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(below_band, distance),
+                                              _mm256_cmpgt_epi32(distance, above_band));
+            contact_bits &= ~static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(outside)));
+        }
 
-    if (!raw_file) {
-        // Try opening as compressed
-        gz_file = gzopen(slice_file.c_str(), "rb");
-        if (!gz_file) {
-            throw std::runtime_error("Could not open file: " + slice_file);
+        for (; coverage_bits; coverage_bits &= coverage_bits - 1) {
+            cols.coverage_rows[covered++] = static_cast<uint32_t>(i + __builtin_ctz(coverage_bits));
+        }
+        for (; contact_bits; contact_bits &= contact_bits - 1) {
+            cols.contact_rows[kept++] = static_cast<uint32_t>(i + __builtin_ctz(contact_bits));
         }
-        is_compressed = true;
     }
 
-    std::cout << "File opened..." << std::endl;
+    // Tail of fewer than 8 rows
+    filterRows(cols, i, n, ctx, valid_rows, covered, kept);
+    num_valid = valid_rows;
+    num_coverage = covered;
+    num_contacts = kept;
+}
 
-    try {
-        // Read and verify magic string
-        char magic[8];
-        if (is_compressed) {
-            if (gzread(gz_file, magic, 8) != 8 || strncmp(magic, "HICSLICE", 8) != 0) {
-                throw std::runtime_error("Invalid file format: missing magic string");
-            }
-        } else {
-            if (fread(magic, 1, 8, raw_file) != 8 || strncmp(magic, "HICSLICE", 8) != 0) {
-                throw std::runtime_error("Invalid file format: missing magic string");
-            }
+FilterKernel selectFilterKernel() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return filterAvx2;
+    return filterScalar;
+}
+#else
+// Elsewhere only the scalar filter
+FilterKernel selectFilterKernel() {
+    return filterScalar;
+}
+#endif
+
+// Everything a contact can be added to; one per worker thread
+struct ScanAccumulator {
+    std::vector<APAMatrix> matrices;
+    CoverageVectors coverage;
+    std::vector<CoverageVectors> mergedCoverage;  // By ctx.coverage_merges
+    ScanCounters counters;
+    std::vector<uint64_t> set_mask;  // Scratch space reused across contacts
+    ContactColumns columns;          // Scratch space reused across batches
+
+    // Contacts are assumed sorted by (chr1, chr2, binX) and matched with
+    // per-set sweeps until one arrives out of order; from then on every
+    // contact is looked up in the LoopIndex directly
+    std::vector<LoopSweep> sweeps;
+    bool sweeping;
+    int16_t last_chr1_key;
+    int16_t last_chr2_key;
+    int32_t last_binX;
+
+    explicit ScanAccumulator(const ScanContext& ctx)
+        : coverage(ctx.coverage_ranges[0], ctx.resolution), set_mask((ctx.all_indices.size() + 63) / 64),
+          sweeping(true), last_chr1_key(0), last_chr2_key(0), last_binX(0) {
+        for (size_t c = 0; c < ctx.coverage_merges.size(); c++) {
+            mergedCoverage.push_back(
+                CoverageVectors(ctx.coverage_ranges[c + 1], ctx.resolution * ctx.coverage_merges[c]));
         }
+        matrices.reserve(ctx.all_indices.size());
+        sweeps.reserve(ctx.all_indices.size());
+        for (const auto& index : ctx.all_indices) {
+            matrices.push_back(APAMatrix(index->window * 2 + 1));
+            sweeps.push_back(LoopSweep(*index));
+        }
+    }
 
-        // Read resolution
-        int32_t resolution;
-        if (is_compressed) {
-            if (gzread(gz_file, &resolution, sizeof(int32_t)) != sizeof(int32_t)) {
-                throw std::runtime_error("Failed to read resolution");
+    // Drop out of sweep mode at the first contact that breaks the order
+    void checkOrder(const ContactRecord& record) {
+        if (record.chr1Key == last_chr1_key && record.chr2Key == last_chr2_key &&
+            record.binX < last_binX) {
+            sweeping = false;
+        }
+        last_chr1_key = record.chr1Key;
+        last_chr2_key = record.chr2Key;
+        last_binX = record.binX;
+    }
+
+    void merge(const ScanAccumulator& other) {
+        for (size_t i = 0; i < matrices.size(); i++) {
+            matrices[i].merge(other.matrices[i]);
+        }
+        coverage.merge(other.coverage);
+        for (size_t i = 0; i < mergedCoverage.size(); i++) {
+            mergedCoverage[i].merge(other.mergedCoverage[i]);
+        }
+        counters.add(other.counters);
+    }
+};
+
+// Add a contact that passed the filters to the APA matrices of every loop whose window holds it
+void matchContact(int32_t chr1, int32_t chr2, int32_t binX, int32_t binY, float value,
+                  const ScanContext& ctx, ScanAccumulator& acc) {
+    // Find the BEDPE sets whose windows contain the contact
+    if (!ctx.roi.matchingSets(chr1, chr2, binX, binY, acc.set_mask.data())) {
+        acc.counters.roi_rejected++;
+        return;
+    }
+    acc.counters.matched++;
+
+    // Process for each matching BEDPE set
+    for (size_t word = 0; word < acc.set_mask.size(); word++) {
+        for (uint64_t bits = acc.set_mask[word]; bits != 0; bits &= bits - 1) {
+            size_t bedpe_idx = word * 64 + __builtin_ctzll(bits);
+            const IndexBins& bins = ctx.index_bins[bedpe_idx];
+            int32_t x = binX;
+            int32_t y = binY;
+            if (bins.merge > 1) {
+                x = mergeBin(binX, bins.merge);
+                y = mergeBin(binY, bins.merge);
             }
-        } else {
-            if (fread(&resolution, sizeof(int32_t), 1, raw_file) != 1) {
-                throw std::runtime_error("Failed to read resolution");
+            if (!ctx.isInter) {
+                int32_t bin_distance = std::abs(x - y);
+                if (bin_distance < bins.min_band_bins || bin_distance > bins.max_band_bins) continue;
+            }
+            APAMatrix& matrix = acc.matrices[bedpe_idx];
+            uint64_t& loop_hits = acc.counters.loop_hits;
+            auto add = [&](int relX, int relY, uint32_t count) {
+                matrix.add(relX, relY, value * static_cast<float>(count));
+                loop_hits += count;
+            };
+            if (acc.sweeping) {
+                acc.sweeps[bedpe_idx].forEachLoopCovering(chr1, chr2, x, y, add);
+            } else {
+                ctx.all_indices[bedpe_idx]->forEachLoopCovering(chr1, chr2, x, y, add);
             }
         }
+    }
+}
 
-        if (resolution <= 0) {
-            throw std::runtime_error("Invalid resolution in slice file");
+// Mark the slice bins (by chromosome ID) near the loop anchors of the
+// indices: their matrix windows and coverage sum windows
+void addNeededBins(const SharedLoopIndices& all_indices, int32_t resolution, std::vector<BinBitmap>& needed) {
+    for (const auto& shared : all_indices) {
+        const LoopIndex& index = *shared;
+        auto addAnchor = [&](int32_t chrom, int32_t origin, int32_t sumStart, uint64_t) {
+            int32_t first, last, sumFirst, sumLast;
+            index.windowSliceBins(origin, resolution, first, last);
+            index.windowSliceBins(sumStart, resolution, sumFirst, sumLast);
+            needed[chrom].setRange(std::min(first, sumFirst), std::max(last, sumLast));
+        };
+        index.forEachAnchor(addAnchor, addAnchor);
+    }
+}
+
+// Which index blocks can hold a contact that reaches a needed bin.
+// Coverage must stay exact, so a block is only skipped if neither its binX
+// range on chr1 nor its binY range on chr2 touches one. A block is wanted
+// if any anchor needs it, so splitting the loops over passes selects, over
+// all passes, the same blocks as one pass.
+std::vector<bool> blocksNeeding(const std::vector<SliceBlock>& blocks, const std::vector<BinBitmap>& needed,
+                                const ChromosomeTable& chromosomes, bool isInter) {
+    std::vector<bool> wanted(blocks.size(), false);
+    for (size_t i = 0; i < blocks.size(); i++) {
+        for (const auto& extent : blocks[i].extents) {
+            const int32_t chr1 = chromosomes.idForKey(extent.chr1Key);
+            const int32_t chr2 = chromosomes.idForKey(extent.chr2Key);
+            if (chr1 < 0 || chr2 < 0 || isInter == (chr1 == chr2)) continue;
+            if (needed[chr1].anyInRange(extent.minBinX, extent.maxBinX) ||
+                needed[chr2].anyInRange(extent.minBinY, extent.maxBinY)) {
+                wanted[i] = true;
+                break;
+            }
         }
+    }
+    return wanted;
+}
+
+// The blocks a scan of the context's indices wants
+std::vector<bool> selectBlocks(const std::vector<SliceBlock>& blocks, const ScanContext& ctx) {
+    std::vector<BinBitmap> needed(ctx.chromosomes.size());
+    addNeededBins(ctx.all_indices, ctx.resolution, needed);
+    return blocksNeeding(blocks, needed, ctx.chromosomes, ctx.isInter);
+}
 
-        std::cout << "Resolution is " << resolution << std::endl;
+// The sample round of each wanted block, -1 for the others, and the
+// chromosome pair (keys) of its first extent. Blocks are numbered within
+// their pair, from an offset hashed from the pair, so every round takes an
+// even share of every pair and pairs of fewer blocks than rounds are
+// spread over the rounds.
+std::vector<int32_t> sampleRounds(const std::vector<SliceBlock>& blocks, const std::vector<bool>& wanted,
+                                  int32_t every, std::vector<uint32_t>& block_pairs) {
+    std::vector<int32_t> rounds(blocks.size(), -1);
+    block_pairs.assign(blocks.size(), 0);
+    std::map<uint32_t, uint32_t> next;  // Pair -> ordinal of its next block
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (!wanted[i]) continue;
+        const uint32_t pair = blocks[i].extents.empty() ? 0
+            : static_cast<uint32_t>(static_cast<uint16_t>(blocks[i].extents[0].chr1Key)) << 16 |
+              static_cast<uint16_t>(blocks[i].extents[0].chr2Key);
+        auto it = next.find(pair);
+        if (it == next.end()) it = next.insert(std::make_pair(pair, (pair * 2654435761u) >> 8)).first;
+        block_pairs[i] = pair;
+        rounds[i] = static_cast<int32_t>(it->second++ % static_cast<uint32_t>(every));
+    }
+    return rounds;
+}
 
-        // Create data structures from BedpeEntries and then discard them
-        std::vector<RegionsOfInterest> all_roi;
-        std::vector<LoopIndex> all_indices;
-        all_roi.reserve(all_bedpe_entries.size());
-        all_indices.reserve(all_bedpe_entries.size());
+// The last bin holding a record on each chromosome, from the extents of a
+// block index; -1 for chromosomes without records. Empty without an index.
+std::vector<int32_t> indexedLastBins(const std::vector<SliceBlock>& blocks, const ChromosomeTable& chromosomes) {
+    if (blocks.empty()) return std::vector<int32_t>();
+    std::vector<int32_t> last_bins(chromosomes.size(), -1);
+    for (const auto& block : blocks) {
+        for (const auto& extent : block.extents) {
+            const int32_t chr1 = chromosomes.idForKey(extent.chr1Key);
+            const int32_t chr2 = chromosomes.idForKey(extent.chr2Key);
+            if (chr1 >= 0) last_bins[chr1] = std::max(last_bins[chr1], extent.maxBinX);
+            if (chr2 >= 0) last_bins[chr2] = std::max(last_bins[chr2], extent.maxBinY);
+        }
+    }
+    return last_bins;
+}
 
-        for (const auto& entries : all_bedpe_entries) {
-            all_roi.emplace_back(entries, resolution, window_size, isInter);
-            all_indices.emplace_back(entries, resolution);
+// The bins coverage is kept for at resolution * merge: on each chromosome,
+// the span of the coverage windows of the anchors of the indices at that
+// resolution, cut off after the last bin holding records (last_bins in
+// slice bins, if known)
+std::vector<CoverageVectors::Range> coverageReach(const SharedLoopIndices& all_indices,
+                                                  const ChromosomeTable& chromosomes, int32_t resolution,
+                                                  int32_t merge, const std::vector<int32_t>& last_bins) {
+    CoverageVectors::Range none = {INT32_MAX, 0};
+    std::vector<CoverageVectors::Range> ranges(chromosomes.size(), none);
+    for (const auto& index : all_indices) {
+        if (index->resolution != resolution * merge) continue;
+        const int32_t width = 2 * index->window + 1;
+        auto addAnchor = [&](int32_t chrom, int32_t, int32_t sumStart, uint64_t) {
+            if (chrom < 0) return;
+            ranges[chrom].first = std::min(ranges[chrom].first, std::max<int32_t>(sumStart, 0));
+            ranges[chrom].end = std::max(ranges[chrom].end, sumStart + width);
+        };
+        index->forEachAnchor(addAnchor, addAnchor);
+    }
+    if (!last_bins.empty()) {
+        for (size_t chrom = 0; chrom < ranges.size(); chrom++) {
+            const int32_t end = last_bins[chrom] < 0 ? 0 : last_bins[chrom] / merge + 1;
+            ranges[chrom].end = std::min(ranges[chrom].end, end);
         }
+    }
+    return ranges;
+}
 
-        // Clear original BedpeEntries as they're no longer needed
-        all_bedpe_entries.clear();
-        all_bedpe_entries.shrink_to_fit();
+// Hash of where a record lies, to sample slices without a block index
+// independently of record order and thread count
+inline uint32_t sampleHash(const ContactRecord& record) {
+    uint64_t h = (static_cast<uint64_t>(static_cast<uint16_t>(record.chr1Key)) << 16 |
+                  static_cast<uint16_t>(record.chr2Key)) * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ static_cast<uint32_t>(record.binX)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ static_cast<uint32_t>(record.binY)) * 0x94D049BB133111EBULL;
+    return static_cast<uint32_t>((h ^ (h >> 31)) >> 32);
+}
 
-        // Create vectors to hold per-bedpe data structures
-        size_t num_bedpes = all_roi.size();
-        std::vector<APAMatrix> all_matrices;
-        std::vector<std::vector<float>> all_rowSums(num_bedpes);
-        std::vector<std::vector<float>> all_colSums(num_bedpes);
+// Decode rows [start, start + n) of a batch into columns, with the record
+// layout fixed at compile time
+template <RecordLayout Layout>
+void decodeColumns(const RecordBatch& batch, size_t start, size_t n, const ScanContext& ctx,
+                   ScanAccumulator& acc) {
+    ContactColumns& cols = acc.columns;
+    const char* data = batch.data + start * RecordCodec<Layout>::BYTES;
+    const bool check_order = acc.sweeping && !ctx.sorted;
+    for (size_t i = 0; i < n; i++) {
+        ContactRecord record = RecordCodec<Layout>::decode(data + i * RecordCodec<Layout>::BYTES);
+        if (check_order) acc.checkOrder(record);
+        // Records on chromosomes missing from the header get -1 and are filtered out
+        cols.chr1[i] = ctx.chromosomes.idForKey(record.chr1Key);
+        cols.chr2[i] = ctx.chromosomes.idForKey(record.chr2Key);
+        cols.binX[i] = record.binX;
+        cols.binY[i] = record.binY;
+        cols.value[i] = record.value;
+        // ... as are those outside the sampled part
+        if (ctx.sample_every > 1 && static_cast<int32_t>(sampleHash(record) % ctx.sample_every) != ctx.sample_round) {
+            cols.chr1[i] = -1;
+        }
+    }
+    // So are those on chromosome pairs of other shards
+    if (!ctx.shard_pairs.empty()) {
+        const size_t size = static_cast<size_t>(ctx.chromosomes.size());
+        for (size_t i = 0; i < n; i++) {
+            if (cols.chr1[i] >= 0 && cols.chr2[i] >= 0 && !ctx.shard_pairs[cols.chr1[i] * size + cols.chr2[i]]) {
+                cols.chr1[i] = -1;
+            }
+        }
+    }
+}
 
-        // Initialize data structures for each BEDPE set
-        all_matrices.reserve(num_bedpes);
+// Records are decoded into columns FILTER_BATCH at a time and filtered
+// together; only the survivors reach the per-contact stages
+void processBatch(const RecordBatch& batch, const ScanContext& ctx, ScanAccumulator& acc) {
+    static const FilterKernel filter = selectFilterKernel();
+    ContactColumns& cols = acc.columns;
 
-        for (size_t i = 0; i < num_bedpes; i++) {
-            all_matrices.push_back(APAMatrix(window_size * 2 + 1));
-            all_rowSums[i].resize(window_size * 2 + 1, 0.0f);
-            all_colSums[i].resize(window_size * 2 + 1, 0.0f);
+    for (size_t start = 0; start < batch.count; start += FILTER_BATCH) {
+        const size_t n = std::min(FILTER_BATCH, batch.count - start);
+        if (batch.layout == RecordLayout::Packed16) {
+            decodeColumns<RecordLayout::Packed16>(batch, start, n, ctx, acc);
+        } else {
+            decodeColumns<RecordLayout::Padded20>(batch, start, n, ctx, acc);
         }
 
-        std::cout << "Data structures initialized..." << std::endl;
+        size_t num_valid, num_coverage, num_contacts;
+        filter(cols, n, ctx, num_valid, num_coverage, num_contacts);
+        acc.counters.records += n;
+        acc.counters.value_rejected += n - num_valid;
+        acc.counters.mode_rejected += num_valid - num_coverage;
+        acc.counters.band_rejected += num_coverage - num_contacts;
 
-        // Read chromosome mapping
-        int32_t numChromosomes;
-        if (is_compressed) {
-            if (gzread(gz_file, &numChromosomes, sizeof(int32_t)) != sizeof(int32_t)) {
-                throw std::runtime_error("Failed to read chromosome count");
+        // Add to coverage vectors (after inter/intra but before the distance filter)
+        for (size_t k = 0; k < num_coverage; k++) {
+            const uint32_t i = cols.coverage_rows[k];
+            acc.coverage.add(cols.chr1[i], cols.binX[i], cols.value[i]);
+            if (cols.chr1[i] != cols.chr2[i] || cols.binX[i] != cols.binY[i]) {  // Don't double count diagonal
+                acc.coverage.add(cols.chr2[i], cols.binY[i], cols.value[i]);
             }
-        } else {
-            if (fread(&numChromosomes, sizeof(int32_t), 1, raw_file) != 1) {
-                throw std::runtime_error("Failed to read chromosome count");
+            // The same at merged resolutions, where more contacts are diagonal
+            for (size_t c = 0; c < ctx.coverage_merges.size(); c++) {
+                const int32_t merge = ctx.coverage_merges[c];
+                const int32_t x = mergeBin(cols.binX[i], merge);
+                const int32_t y = mergeBin(cols.binY[i], merge);
+                acc.mergedCoverage[c].add(cols.chr1[i], x, cols.value[i]);
+                if (cols.chr1[i] != cols.chr2[i] || x != y) {
+                    acc.mergedCoverage[c].add(cols.chr2[i], y, cols.value[i]);
+                }
             }
         }
 
-        if (numChromosomes <= 0) {
-            throw std::runtime_error("Invalid number of chromosomes in slice file");
+        for (size_t k = 0; k < num_contacts; k++) {
+            const uint32_t i = cols.contact_rows[k];
+            matchContact(cols.chr1[i], cols.chr2[i], cols.binX[i], cols.binY[i], cols.value[i], ctx, acc);
         }
+    }
+}
 
-        std::cout << "Number of chromosomes: " << numChromosomes << std::endl;
+// Loops of one job scanned in a pass: all of them, or those whose chrom1
+// (a BedpeTable chromosome ID) is set in chroms1
+struct LoopChunk {
+    size_t job;                 // set * configs + config
+    std::vector<bool> chroms1;  // Empty for the whole set
+};
 
-        std::map<int16_t, std::string> chromosomeKeyToName;
-        for (int i = 0; i < numChromosomes; i++) {
-            int32_t nameLength;
-            if (is_compressed) {
-                if (gzread(gz_file, &nameLength, sizeof(int32_t)) != sizeof(int32_t)) {
-                    throw std::runtime_error("Failed to read chromosome name length");
-                }
-            } else {
-                if (fread(&nameLength, sizeof(int32_t), 1, raw_file) != 1) {
-                    throw std::runtime_error("Failed to read chromosome name length");
-                }
+typedef std::vector<LoopChunk> ScanPass;
+
+// Splits BEDPE sets into passes whose structures fit a memory budget, from
+// the sizes LoopIndex, RegionsOfInterest and the scan will allocate. Every
+// (set, config) pair is a job with its own index and matrix. A job whose
+// index is cached (cached_bytes[job], its file size, is not 0) is loaded
+// whole, and its regions of interest are budgeted as whole chromosomes.
+// Chromosome lengths come from the block index (indexed_last_bins) when
+// the slice has one.
+class PassPlanner {
+public:
+    PassPlanner(const std::vector<BedpeTable>& tables, const std::vector<ApaConfig>& configs,
+                const ChromosomeTable& chromosomes, int32_t resolution, int num_threads,
+                const std::vector<uint64_t>& cached_bytes, const std::vector<int32_t>& indexed_last_bins)
+        : costs(tables.size() * configs.size()), fixed_bytes(0), matrix_bytes(costs.size()),
+          cachedBytes(cached_bytes), chromLastBins(indexed_last_bins) {
+        // Every pass keeps one accumulator per worker besides the result
+        accumulators = num_threads > 1 ? num_threads + 1 : 1;
+        if (chromLastBins.empty()) {
+            for (const auto& name : chromosomes.names) {
+                chromLastBins.push_back(detail::getChromBins(name, resolution) - 1);
             }
+        }
+        std::map<int32_t, std::map<int32_t, int32_t>> coverage_reach;  // Merge -> chromosome -> last slice bin
 
-            std::vector<char> nameBuffer(nameLength + 1, 0);
-            if (is_compressed) {
-                if (gzread(gz_file, nameBuffer.data(), nameLength) != nameLength) {
-                    throw std::runtime_error("Failed to read chromosome name");
-                }
-            } else {
-                if (fread(nameBuffer.data(), 1, nameLength, raw_file) != (size_t)nameLength) {
-                    throw std::runtime_error("Failed to read chromosome name");
+        for (size_t job = 0; job < costs.size(); job++) {
+            const BedpeTable& table = tables[job / configs.size()];
+            const ApaConfig& config = configs[job % configs.size()];
+            const int window_size = config.window_size;
+            const int32_t merge = config.bin_merge;
+            const int32_t index_resolution = resolution * merge;
+            const int32_t cell_size = 2 * window_size + 1;
+            std::vector<int32_t> slice_ids;
+            for (const auto& name : table.chromNames) slice_ids.push_back(chromosomes.idForName(name));
+
+            // Origins per (chrom1, chrom2) bound the grid cells of each pair
+            std::map<std::pair<int32_t, int32_t>, std::pair<int32_t, int32_t>> origin_range;
+            const size_t width = cell_size;
+            matrix_bytes[job] = accumulators * width *
+                                ((width + APAMatrix::ALIGN_FLOATS - 1) / APAMatrix::ALIGN_FLOATS *
+                                 APAMatrix::ALIGN_FLOATS) * sizeof(float);
+            if (cachedBytes[job] != 0) {
+                for (size_t chrom = 0; chrom < chromLastBins.size(); chrom++) {
+                    extend(coverage_reach[merge], static_cast<int32_t>(chrom), chromLastBins[chrom]);
                 }
+                continue;
             }
-            std::string chromosomeName(nameBuffer.data());
-
-            int16_t key;
-            if (is_compressed) {
-                if (gzread(gz_file, &key, sizeof(int16_t)) != sizeof(int16_t)) {
-                    throw std::runtime_error("Failed to read chromosome key");
+            costs[job].resize(table.chromNames.size());
+            for (const auto& entry : table.entries) {
+                const int32_t chrom1 = slice_ids[entry.chrom1];
+                const int32_t chrom2 = slice_ids[entry.chrom2];
+                if (chrom1 < 0 && chrom2 < 0) continue;  // Not indexed at all
+                ChromosomeCost& cost = costs[job][entry.chrom1];
+                cost.loops++;
+                int32_t originX = LoopBins::windowOrigin(entry.start1, entry.end1, index_resolution, window_size);
+                int32_t originY = LoopBins::windowOrigin(entry.start2, entry.end2, index_resolution, window_size);
+                // The ROI is in slice bins, so a merged bin covers merge of them
+                if (chrom1 >= 0) extend(cost.rowExtent, chrom1, (originX + 2 * window_size + 1) * merge - 1);
+                if (chrom2 >= 0) extend(cost.colExtent, chrom2, (originY + 2 * window_size + 1) * merge - 1);
+                if (chrom1 >= 0 && chrom2 >= 0) {
+                    auto key = std::make_pair(entry.chrom1, entry.chrom2);
+                    auto range = origin_range.find(key);
+                    if (range == origin_range.end()) {
+                        origin_range[key] = std::make_pair(originX, originX);
+                    } else {
+                        range->second.first = std::min(range->second.first, originX);
+                        range->second.second = std::max(range->second.second, originX);
+                    }
                 }
-            } else {
-                if (fread(&key, sizeof(int16_t), 1, raw_file) != 1) {
-                    throw std::runtime_error("Failed to read chromosome key");
+            }
+            for (const auto& range : origin_range) {
+                costs[job][range.first.first].cells += (range.second.second - range.second.first) / cell_size + 3;
+            }
+            // Coverage windows reach about as far as the matrix windows
+            for (const auto& cost : costs[job]) {
+                for (const auto* extents : {&cost.rowExtent, &cost.colExtent}) {
+                    for (const auto& extent : *extents) extend(coverage_reach[merge], extent.first, extent.second);
                 }
             }
+        }
 
-            chromosomeKeyToName[key] = chromosomeName;
-            std::cout << "Read chromosome: " << chromosomeName << " (key=" << key << ")" << std::endl;
-        }
-
-        // Create single coverage vectors instance (shared across all BEDPEs)
-        CoverageVectors coverage(resolution);
-
-        // Single pass: process contacts for both coverage and APA
-        struct {
-            int16_t chr1Key;
-            int32_t binX;
-            int16_t chr2Key;
-            int32_t binY;
-            float value;
-        } record;
-
-        std::cout << "Processing contacts..." << std::endl;
-        int64_t contact_count = 0;
-
-        size_t record_size = sizeof(record);
-        while ((is_compressed ? 
-                (gzread(gz_file, &record, record_size) == static_cast<int>(record_size)) :
-                (fread(&record, record_size, 1, raw_file) == 1))) {
-            contact_count++;
-            
-            // Print first two records for debugging
-            if (contact_count <= 2) {
-                std::string chr1 = chromosomeKeyToName[record.chr1Key];
-                std::string chr2 = chromosomeKeyToName[record.chr2Key];
-                std::cout << "Contact " << contact_count << ": " 
-                         << chr1 << ":" << record.binX << " - "
-                         << chr2 << ":" << record.binY 
-                         << " value=" << record.value << std::endl;
+        // Coverage once per merge, over the bins within reach of its loops
+        for (const auto& reach : coverage_reach) {
+            for (const auto& extent : reach.second) {
+                const int32_t last = std::min(extent.second, chromLastBins[extent.first]);
+                if (last < 0) continue;
+                fixed_bytes += accumulators * static_cast<uint64_t>(last / reach.first + 1) * sizeof(float);
             }
+        }
+        if (num_threads > 1) {
+            fixed_bytes += static_cast<uint64_t>(num_threads) * BATCHES_PER_WORKER * RECORDS_PER_BATCH *
+                           RecordCodec<RecordLayout::Padded20>::BYTES;
+        }
+    }
 
-            if (std::isnan(record.value) || std::isinf(record.value) || record.value <= 0) {
-                continue;
+    uint64_t passBytes(const ScanPass& pass) const {
+        uint64_t bytes = fixed_bytes;
+        std::map<int32_t, int32_t> rows, cols;  // Union of the chunks' ROI extents
+        for (const auto& chunk : pass) {
+            bytes += matrix_bytes[chunk.job];
+            if (cachedBytes[chunk.job] != 0) {
+                bytes += cachedBytes[chunk.job];
+                for (size_t chrom = 0; chrom < chromLastBins.size(); chrom++) {
+                    extend(rows, static_cast<int32_t>(chrom), chromLastBins[chrom]);
+                    extend(cols, static_cast<int32_t>(chrom), chromLastBins[chrom]);
+                }
+            }
+            const std::vector<ChromosomeCost>& set_costs = costs[chunk.job];
+            for (size_t chrom = 0; chrom < set_costs.size(); chrom++) {
+                if (!chunk.chroms1.empty() && !chunk.chroms1[chrom]) continue;
+                const ChromosomeCost& cost = set_costs[chrom];
+                // LoopBins, plus as much again for the buffer of sorting them
+                bytes += cost.loops * 2 * sizeof(LoopBins) + cost.cells * sizeof(uint32_t);
+                for (const auto& extent : cost.rowExtent) extend(rows, extent.first, extent.second);
+                for (const auto& extent : cost.colExtent) extend(cols, extent.first, extent.second);
             }
+        }
+        // A bitmap bit plus a set mask per bin, as BinBitmap and BinSetMasks
+        const uint64_t words_per_bin = (pass.size() + 63) / 64;
+        for (const auto* extents : {&rows, &cols}) {
+            for (const auto& extent : *extents) {
+                const uint64_t bins = static_cast<uint64_t>(std::max(extent.second, 0)) + 1;
+                bytes += (bins / 64 + 1) * sizeof(uint64_t) + bins * words_per_bin * sizeof(uint64_t);
+            }
+        }
+        return bytes;
+    }
 
-            std::string chr1 = chromosomeKeyToName[record.chr1Key];
-            std::string chr2 = chromosomeKeyToName[record.chr2Key];
-            
-            // Quick filter for inter/intra chromosomal contacts
-            if (isInter && chr1 == chr2) continue;
-            if (!isInter && chr1 != chr2) continue;
-
-            // Add to coverage vectors (after inter/intra but before any other filtering)
-            coverage.add(chr1, record.binX, record.value);
-            if (chr1 != chr2 || record.binX != record.binY) {  // Don't double count diagonal
-                coverage.add(chr2, record.binY, record.value);
+    // Whole jobs while the pass fits, then a new pass; a job that does not
+    // fit an empty pass is split by chromosome. A single chromosome that
+    // does not fit still gets a pass of its own.
+    std::vector<ScanPass> plan(uint64_t budget) const {
+        std::vector<ScanPass> passes(1);
+        for (size_t job = 0; job < costs.size(); job++) {
+            LoopChunk whole = {job, std::vector<bool>()};
+            if (tryAdd(passes.back(), whole, budget)) continue;
+            if (!passes.back().empty()) {
+                passes.emplace_back();
+                if (tryAdd(passes.back(), whole, budget)) continue;
+            }
+            if (cachedBytes[job] != 0) {
+                passes.back().push_back(whole);  // Cannot be split
+                continue;
+            }
+            for (size_t chrom = 0; chrom < costs[job].size(); chrom++) {
+                if (costs[job][chrom].loops == 0) continue;
+                ScanPass& pass = passes.back();
+                if (!pass.empty() && pass.back().job == job) {
+                    ScanPass candidate = pass;
+                    candidate.back().chroms1[chrom] = true;
+                    if (passBytes(candidate) <= budget) {
+                        pass.swap(candidate);
+                        continue;
+                    }
+                }
+                LoopChunk piece = {job, std::vector<bool>(costs[job].size(), false)};
+                piece.chroms1[chrom] = true;
+                if (tryAdd(pass, piece, budget)) continue;
+                if (!pass.empty()) passes.emplace_back();
+                passes.back().push_back(piece);
             }
+        }
+        if (passes.back().empty()) passes.pop_back();
+        return passes;
+    }
+
+private:
+    // What the loops of one job with one chrom1 add to a pass
+    struct ChromosomeCost {
+        uint64_t loops;
+        uint64_t cells;
+        std::map<int32_t, int32_t> rowExtent;  // Slice chromosome ID -> last bin the ROI sets
+        std::map<int32_t, int32_t> colExtent;
 
-            // For intra-chromosomal analysis, filter by genomic distance
-            if (!isInter) {
-                // Convert bin distance to genomic distance
-                int32_t bin_distance = std::abs(record.binX - record.binY);
-                int64_t genomic_distance = static_cast<int64_t>(bin_distance) * resolution;
-                
-                // Add buffer of 3*window_size to both min and max distances
-                int64_t buffer = static_cast<int64_t>(3 * window_size) * resolution;
-                
-                // Skip if outside the distance range (with buffer) used to generate BEDPE
-                if (genomic_distance < (min_genome_dist - buffer) || 
-                    genomic_distance > (max_genome_dist + buffer)) {
-                    continue;
+        ChromosomeCost() : loops(0), cells(0) {}
+    };
+
+    static void extend(std::map<int32_t, int32_t>& extents, int32_t chrom, int32_t last) {
+        auto it = extents.find(chrom);
+        if (it == extents.end()) {
+            extents[chrom] = last;
+        } else {
+            it->second = std::max(it->second, last);
+        }
+    }
+
+    bool tryAdd(ScanPass& pass, const LoopChunk& chunk, uint64_t budget) const {
+        pass.push_back(chunk);
+        if (passBytes(pass) <= budget) return true;
+        pass.pop_back();
+        return false;
+    }
+
+    std::vector<std::vector<ChromosomeCost>> costs;  // By job and table chromosome ID
+    uint64_t fixed_bytes;                            // Coverage arenas and queued batches
+    std::vector<uint64_t> matrix_bytes;              // APA matrices of each job
+    std::vector<uint64_t> cachedBytes;
+    std::vector<int32_t> chromLastBins;              // By slice chromosome ID
+    size_t accumulators;
+};
+
+// Anchor sets take O(anchors) memory and are never split
+std::vector<ScanPass> planPasses(const std::vector<InterAnchors>& all_sets, const std::vector<ApaConfig>& configs,
+                                 const ChromosomeTable&, int32_t, int, const std::vector<uint64_t>&,
+                                 const std::vector<int32_t>&, uint64_t) {
+    ScanPass pass;
+    for (size_t job = 0; job < all_sets.size() * configs.size(); job++) {
+        LoopChunk whole = {job, std::vector<bool>()};
+        pass.push_back(whole);
+    }
+    return std::vector<ScanPass>(1, pass);
+}
+
+std::vector<ScanPass> planPasses(const std::vector<BedpeTable>& all_sets, const std::vector<ApaConfig>& configs,
+                                 const ChromosomeTable& chromosomes, int32_t resolution, int num_threads,
+                                 const std::vector<uint64_t>& cached_bytes,
+                                 const std::vector<int32_t>& indexed_last_bins, uint64_t budget) {
+    PassPlanner planner(all_sets, configs, chromosomes, resolution, num_threads, cached_bytes, indexed_last_bins);
+    std::vector<ScanPass> passes = planner.plan(budget);
+    uint64_t peak = 0;
+    for (const auto& pass : passes) peak = std::max(peak, planner.passBytes(pass));
+
+    // Formatted apart from std::cout, whose flags other jobs' threads share
+    const double gb = 1024.0 * 1024.0 * 1024.0;
+    std::ostringstream report;
+    report << "\nMemory Requirements:\n"
+           << "Estimated memory needed: " << std::fixed << std::setprecision(2) << peak / gb << " GB\n"
+           << "Memory budget: " << budget / gb << " GB\n\n";
+    std::cout << report.str();
+    if (passes.size() > 1) {
+        std::cout << "Loops exceed the memory budget in one pass; scanning the slice in "
+                  << passes.size() << " passes" << std::endl;
+    }
+    if (peak > budget) {
+        std::cerr << "Warning: the loops of a single chromosome exceed the memory budget" << std::endl;
+    }
+    return passes;
+}
+
+// Indexes are in merged bins, resolution * bin_merge
+std::shared_ptr<const LoopIndex> buildIndex(const BedpeTable& table, const LoopChunk& chunk,
+                                            const ChromosomeTable& chromosomes, int32_t resolution,
+                                            const ApaConfig& config) {
+    return std::make_shared<const LoopIndex>(table, chromosomes, resolution * config.bin_merge,
+                                             config.window_size, chunk.chroms1);
+}
+
+std::shared_ptr<const LoopIndex> buildIndex(const InterAnchors& anchors, const LoopChunk&,
+                                            const ChromosomeTable& chromosomes, int32_t resolution,
+                                            const ApaConfig& config) {
+    return std::make_shared<const LoopIndex>(anchors, chromosomes, resolution * config.bin_merge,
+                                             config.window_size);
+}
+
+// Scan every batch of the reader into a new accumulator on num_threads
+// workers, adding the number of records read to contact_count and the
+// bytes of their batches to record_bytes
+std::unique_ptr<ScanAccumulator> scanContacts(SliceReader& reader, const ScanContext& ctx, int num_threads,
+                                              int64_t& contact_count, uint64_t& record_bytes) {
+    std::unique_ptr<ScanAccumulator> result(new ScanAccumulator(ctx));
+    RecordBatch batch;
+
+    if (num_threads <= 1) {
+        while (reader.nextBatch(batch, RECORDS_PER_BATCH)) {
+            contact_count += batch.count;
+            record_bytes += batch.count * recordBytes(batch.layout);
+            processBatch(batch, ctx, *result);
+        }
+        return result;
+    }
+
+    std::cout << "Using " << num_threads << " worker threads" << std::endl;
+
+    // Batches are dealt round-robin so every worker sees a fixed
+    // subsequence of the file, keeping the merged sums deterministic
+    std::vector<std::unique_ptr<BlockingQueue<RecordBatch>>> queues;
+    std::vector<std::unique_ptr<ScanAccumulator>> partials;
+    std::vector<std::thread> workers;
+    std::exception_ptr worker_error;
+    std::mutex error_mutex;
+    for (int t = 0; t < num_threads; t++) {
+        queues.emplace_back(new BlockingQueue<RecordBatch>(BATCHES_PER_WORKER));
+        partials.emplace_back(new ScanAccumulator(ctx));
+    }
+    for (int t = 0; t < num_threads; t++) {
+        workers.emplace_back([&, t] {
+            RecordBatch work;
+            try {
+                while (queues[t]->pop(work)) {
+                    processBatch(work, ctx, *partials[t]);
                 }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!worker_error) worker_error = std::current_exception();
+                // Keep draining so the reader never blocks on a full queue
+                while (queues[t]->pop(work)) {}
             }
+        });
+    }
 
-            // Process for each BEDPE set
-            for (size_t bedpe_idx = 0; bedpe_idx < all_roi.size(); bedpe_idx++) {
-                if (all_roi[bedpe_idx].probablyContainsRecord(chr1, chr2, record.binX, record.binY)) {
-                    auto nearby_loops = all_indices[bedpe_idx].getNearbyLoops(chr1, chr2, record.binX);
-                    
-                    for (const auto* loop : nearby_loops) {
-                        // Convert BEDPE coordinates to bin positions
-                        int32_t bin1Start = loop->start1 / resolution;
-                        int32_t bin1End = (loop->end1 / resolution) + 1;
-                        int32_t bin2Start = loop->start2 / resolution;
-                        int32_t bin2End = (loop->end2 / resolution) + 1;
-                        
-                        // Calculate center bin positions
-                        int32_t loopCenterX = (bin1Start + bin1End) / 2;
-                        int32_t loopCenterY = (bin2Start + bin2End) / 2;
-                        
-                        // Only process if contact is within window of loop center
-                        if (std::abs(record.binX - loopCenterX) <= window_size &&
-                            std::abs(record.binY - loopCenterY) <= window_size) {
-                            
-                            // Calculate relative position and add to matrix
-                            int relX = record.binX - (loopCenterX - window_size);
-                            int relY = record.binY - (loopCenterY - window_size);
-                            all_matrices[bedpe_idx].add(relX, relY, record.value);
-                        }
-                    }
+    // Mapped batches point straight into the file; others are copied
+    // out of the reader's buffer before being queued
+    const bool stable = reader.batchesAreStable();
+    size_t next_worker = 0;
+    try {
+        while (reader.nextBatch(batch, RECORDS_PER_BATCH)) {
+            contact_count += batch.count;
+            record_bytes += batch.count * recordBytes(batch.layout);
+            if (!stable) batch.detach();
+            queues[next_worker]->push(std::move(batch));
+            next_worker = (next_worker + 1) % queues.size();
+            batch = RecordBatch();
+        }
+    } catch (...) {
+        for (auto& queue : queues) queue->close();
+        for (auto& worker : workers) worker.join();
+        throw;
+    }
+    for (auto& queue : queues) queue->close();
+    for (auto& worker : workers) worker.join();
+    if (worker_error) std::rethrow_exception(worker_error);
+
+    std::cout << "Merging per-thread results..." << std::endl;
+    for (const auto& partial : partials) {
+        result->merge(*partial);
+        result->sweeping = result->sweeping && partial->sweeping;
+    }
+    return result;
+}
+
+// Size of a file, 0 if it cannot be read
+uint64_t fileSize(const std::string& filename) {
+    struct stat st;
+    return stat(filename.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+}
+
+// Chromosome pairs of one shard: the pairs the mode reads are dealt to the
+// shards round-robin in ID order. Empty for an unsharded scan.
+std::vector<char> shardPairs(const ChromosomeTable& chromosomes, bool isInter, const SliceShard& shard) {
+    if (shard.count <= 1) return std::vector<char>();
+    const size_t size = static_cast<size_t>(chromosomes.size());
+    std::vector<char> pairs(size * size, 0);
+    int ordinal = 0;
+    for (size_t chr1 = 0; chr1 < size; chr1++) {
+        for (size_t chr2 = 0; chr2 < size; chr2++) {
+            if (isInter == (chr1 == chr2)) continue;
+            pairs[chr1 * size + chr2] = ordinal++ % shard.count == shard.index;
+        }
+    }
+    return pairs;
+}
+
+// Index blocks of one shard: the wanted blocks split into contiguous runs
+// of about equal numbers of records, each block going to the shard its
+// middle record falls in
+void shardBlocks(const std::vector<SliceBlock>& blocks, const SliceShard& shard, std::vector<bool>& wanted) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (wanted[i]) total += blocks[i].numRecords;
+    }
+    uint64_t before = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (!wanted[i]) continue;
+        const uint64_t middle = before + blocks[i].numRecords / 2;
+        before += blocks[i].numRecords;
+        const uint64_t owner = total == 0 ? 0 : middle * static_cast<uint64_t>(shard.count) / total;
+        wanted[i] = owner == static_cast<uint64_t>(shard.index);
+    }
+}
+
+// Build LoopIndexes against the chromosomes of the slice for every set
+// (BedpeTables or InterAnchors) and config, pass by pass, and scan the
+// slice for each. Results are by set, then config, and not yet normalized.
+template <typename LoopSets>
+std::vector<ApaPartial> processLoopSets(
+    const std::string& slice_file,
+    const LoopSets& all_sets,
+    const std::vector<ApaConfig>& configs,
+    bool isInter,
+    long min_genome_dist,
+    long max_genome_dist,
+    int num_threads,
+    uint64_t memory_budget,
+    const IndexCache* cache,
+    CountingSemaphore* io_slots,
+    const SliceShard& shard,
+    RunStats* stats,
+    const SampleOptions& sample) {
+    
+    std::cout << "Opening slice file..." << std::endl;
+    if (shard.count <= 0 || shard.index < 0 || shard.index >= shard.count) {
+        throw std::runtime_error("Invalid shard");
+    }
+    if (configs.empty()) {
+        throw std::runtime_error("No APA configurations given");
+    }
+    if (sample.every <= 0) {
+        throw std::runtime_error("Sample rounds must be positive");
+    }
+    if (sample.every > 1 && shard.count > 1) {
+        throw std::runtime_error("A sampled scan cannot be sharded");
+    }
+    for (const auto& config : configs) {
+        if (config.window_size <= 0) {
+            throw std::runtime_error("Window size must be positive");
+        }
+        if (config.bin_merge <= 0) {
+            throw std::runtime_error("Bin merge factor must be positive");
+        }
+    }
+
+    std::unique_ptr<SliceReader> reader = SliceReader::open(slice_file, num_threads);
+    std::cout << "File opened..." << std::endl;
+
+    const SliceHeader header = reader->header();
+    const int32_t resolution = header.resolution;
+    const ChromosomeTable& chromosomes = header.chromosomes;
+
+    std::cout << "Resolution is " << resolution << std::endl;
+
+    if (memory_budget == 0) {
+        memory_budget = static_cast<uint64_t>(detail::availableMemoryBytes() * 0.9);
+        if (memory_budget == 0) {
+            std::cerr << "Warning: Could not check system memory. Continuing without verification.\n";
+            memory_budget = UINT64_MAX;
+        }
+    }
+
+    // Per-job results, summed over the passes
+    const size_t num_configs = configs.size();
+    const size_t num_jobs = all_sets.size() * num_configs;
+
+    // Jobs whose index is cached are loaded rather than built
+    std::vector<uint64_t> cache_keys(num_jobs, 0);
+    std::vector<uint64_t> cached_bytes(num_jobs, 0);
+    if (cache) {
+        for (size_t job = 0; job < num_jobs; job++) {
+            cache_keys[job] = cache->key(job / num_configs, configs[job % num_configs], resolution, chromosomes);
+            cached_bytes[job] = cache->cachedBytes(cache_keys[job]);
+        }
+        size_t num_cached = num_jobs - std::count(cached_bytes.begin(), cached_bytes.end(), uint64_t(0));
+        std::cout << "Found " << num_cached << " of " << num_jobs << " loop indices in the cache" << std::endl;
+    }
+
+    // Chromosome lengths, if the block index gives them
+    const std::vector<int32_t> last_bins = indexedLastBins(reader->blocks(), chromosomes);
+
+    const std::vector<ScanPass> passes = planPasses(all_sets, configs, chromosomes, resolution, num_threads,
+                                                    cached_bytes, last_bins, memory_budget);
+    // Cached indices stay loaded from the check until a pass takes them.
+    // Those of later passes are dropped and read again in their pass, so
+    // that the memory held is one pass's.
+    if (cache) {
+        for (size_t pass_idx = 1; pass_idx < passes.size(); pass_idx++) {
+            for (const auto& chunk : passes[pass_idx]) cache->release(cache_keys[chunk.job]);
+        }
+    }
+    std::vector<ApaPartial> partials;
+    partials.reserve(num_jobs);
+
+    // Initialize data structures for each BEDPE set and config
+    for (size_t job = 0; job < num_jobs; job++) {
+        partials.emplace_back(configs[job % num_configs].window_size * 2 + 1);
+    }
+
+    // A shard reads its share of the index blocks if there are any, else
+    // its range of the records if they can be read by position. Otherwise
+    // it keeps the records of a subset of the chromosome pairs, which still
+    // reads the whole file.
+    const bool shard_blocks = shard.count > 1 && !reader->blocks().empty();
+    const uint64_t num_records = reader->blocks().empty() ? reader->selectableRecords() : 0;
+    const bool shard_records = shard.count > 1 && num_records > 0;
+    const bool sample_records = sample.every > 1 && num_records > 0;
+    if (sample.tolerance > 0 && reader->blocks().empty() && num_records == 0) {
+        throw std::runtime_error("Reading sample rounds until they converge needs a slice that can be read in "
+                                 "parts, else every round reads the whole file; 'apa4 convert --layout packed16' "
+                                 "makes one");
+    }
+    const std::pair<uint64_t, uint64_t> shard_range(num_records * shard.index / shard.count,
+                                                    num_records * (shard.index + 1) / shard.count);
+    const std::vector<char> shard_pairs =
+        shard_blocks || shard_records ? std::vector<char>() : shardPairs(chromosomes, isInter, shard);
+    if (shard.count > 1) {
+        std::cout << "Reading shard " << shard.index << "/" << shard.count << " by "
+                  << (shard_blocks ? "index blocks" : shard_records ? "record ranges" : "chromosome pairs")
+                  << std::endl;
+    }
+    if (shard_records) {
+        std::cout << "Reading records " << shard_range.first << " to " << shard_range.second << " of "
+                  << num_records << std::endl;
+    } else if (!shard_pairs.empty()) {
+        std::cout << "Warning: the slice is compressed or has variable-size records, so every shard reads the "
+                  << "whole file; 'apa4 convert --layout packed16' and 'apa4 index' make shards read only "
+                  << "their part" << std::endl;
+    }
+
+    // Coverage is kept at the slice resolution and once per coarser merge
+    std::vector<int32_t> coverage_merges;
+    for (const auto& config : configs) {
+        if (config.bin_merge > 1 &&
+            std::find(coverage_merges.begin(), coverage_merges.end(), config.bin_merge) == coverage_merges.end()) {
+            coverage_merges.push_back(config.bin_merge);
+        }
+    }
+
+    std::cout << "Data structures initialized..." << std::endl;
+
+    std::cout << "Number of chromosomes: " << header.chromosomeKeyToName.size() << std::endl;
+    for (const auto& chrom : header.chromosomeKeyToName) {
+        std::cout << "Read chromosome: " << chrom.second << " (key=" << chrom.first << ")" << std::endl;
+    }
+
+    // Distance bands in each config's bins, and their union in slice bins;
+    // merged bins m apart are (m - 1) * merge + 1 to (m + 1) * merge - 1
+    // slice bins apart
+    std::vector<IndexBins> config_bins(num_configs);
+    int32_t min_band_bins = INT32_MAX, max_band_bins = 0;
+    for (size_t c = 0; c < num_configs; c++) {
+        const int32_t merge = configs[c].bin_merge;
+        IndexBins& bins = config_bins[c];
+        bins.merge = merge;
+        distanceBandBins(min_genome_dist, max_genome_dist, resolution * merge, configs[c].window_size,
+                         bins.min_band_bins, bins.max_band_bins);
+        int64_t low = bins.min_band_bins == 0 ? 0 : (static_cast<int64_t>(bins.min_band_bins) - 1) * merge + 1;
+        int64_t high = (static_cast<int64_t>(bins.max_band_bins) + 1) * merge - 1;
+        min_band_bins = std::min<int32_t>(min_band_bins, static_cast<int32_t>(low));
+        max_band_bins = std::max<int32_t>(max_band_bins, static_cast<int32_t>(std::min<int64_t>(high, INT32_MAX)));
+    }
+
+    // The loop indices of a pass, loaded from the cache or built (and then
+    // stored if whole)
+    auto passIndices = [&](const ScanPass& pass, bool store) {
+        StageTimer timer(stats, "index_build");
+        SharedLoopIndices indices;
+        indices.reserve(pass.size());
+        for (const auto& chunk : pass) {
+            if (cached_bytes[chunk.job] != 0) {
+                // Checked whole when planning; this fails only if the
+                // file changed since, and then it is removed
+                indices.push_back(cache->find(cache_keys[chunk.job]));
+                if (!indices.back()) {
+                    throw std::runtime_error("A cached loop index changed during the run; run again to rebuild it");
                 }
+            } else {
+                indices.push_back(buildIndex(all_sets[chunk.job / num_configs], chunk, chromosomes, resolution,
+                                             configs[chunk.job % num_configs]));
+                if (store && cache && chunk.chroms1.empty()) cache->insert(cache_keys[chunk.job], indices.back());
             }
         }
-        std::cout << std::endl;
+        return indices;
+    };
 
-        std::cout << "Finished processing " << contact_count << " contacts" << std::endl;
-        
-        // Free RegionsOfInterest as it's no longer needed for contact processing
-        all_roi.clear();
-        all_roi.shrink_to_fit();
-
-        std::cout << "Calculating coverage normalization..." << std::endl;
-        // After processing all contacts, normalize each matrix
-        for (size_t bedpe_idx = 0; bedpe_idx < all_matrices.size(); bedpe_idx++) {
-            // Calculate row and column sums for this matrix
-            for (const auto& chrom_pair : all_indices[bedpe_idx].loops) {
-                for (const auto& bin_group : chrom_pair.second) {
-                    for (const auto& loop : bin_group.second) {
-                        int32_t bin1Start = ((loop.start1 + loop.end1) / 2) / resolution - window_size;
-                        int32_t bin2Start = ((loop.start2 + loop.end2) / 2) / resolution - window_size;
-                        
-                        coverage.addLocalSums(all_rowSums[bedpe_idx], loop.chrom1, bin1Start);
-                        coverage.addLocalSums(all_colSums[bedpe_idx], loop.chrom2, bin2Start);
-                    }
+    // Which blocks this shard owns must not depend on the passes, which
+    // follow the memory budget of each node: they are dealt out over the
+    // blocks of all passes. With several passes that takes building their
+    // indices once more; one pass deals out its own blocks.
+    std::vector<bool> shard_mask;
+    if (shard_blocks && passes.size() > 1) {
+        std::cout << "Finding the blocks of all passes to split them between shards..." << std::endl;
+        std::vector<BinBitmap> needed(chromosomes.size());
+        for (const auto& pass : passes) addNeededBins(passIndices(pass, false), resolution, needed);
+        shard_mask = blocksNeeding(reader->blocks(), needed, chromosomes, isInter);
+        shardBlocks(reader->blocks(), shard, shard_mask);
+    }
+
+    for (size_t pass_idx = 0; pass_idx < passes.size(); pass_idx++) {
+        const ScanPass& pass = passes[pass_idx];
+        if (passes.size() > 1) {
+            std::cout << "Pass " << pass_idx + 1 << " of " << passes.size() << std::endl;
+            if (!reader) reader = SliceReader::open(slice_file, num_threads);
+        }
+
+        // Create data structures from the sets
+        SharedLoopIndices all_indices = passIndices(pass, true);
+        std::vector<IndexBins> index_bins;
+        for (const auto& chunk : pass) index_bins.push_back(config_bins[chunk.job % num_configs]);
+        std::unique_ptr<RegionsOfInterest> roi;
+        {
+            StageTimer timer(stats, "index_build");
+            roi.reset(new RegionsOfInterest(all_indices, chromosomes, resolution, isInter));
+        }
+
+        size_t index_bytes = 0;
+        for (const auto& index : all_indices) index_bytes += index->memoryBytes();
+        std::cout << "Loop indices use " << index_bytes / (1024 * 1024) << " MB, regions of interest "
+                  << roi->memoryBytes() / (1024 * 1024) << " MB" << std::endl;
+
+        // Coverage only for the bins the normalization of this pass reads
+        std::vector<std::vector<CoverageVectors::Range>> coverage_ranges(
+            1, coverageReach(all_indices, chromosomes, resolution, 1, last_bins));
+        for (int32_t merge : coverage_merges) {
+            coverage_ranges.push_back(coverageReach(all_indices, chromosomes, resolution, merge, last_bins));
+        }
+
+        ScanContext ctx = {chromosomes, *roi, all_indices, index_bins, coverage_merges, coverage_ranges,
+                           resolution, isInter, header.sorted(), min_band_bins, max_band_bins, shard_pairs, 1, 0};
+
+        // With a block index, only read the parts of the file that matter
+        std::vector<bool> wanted;
+        uint64_t wanted_records = 0;
+        if (!reader->blocks().empty()) {
+            wanted = selectBlocks(reader->blocks(), ctx);
+            if (shard_blocks) {
+                if (shard_mask.empty()) {
+                    shard_mask = wanted;
+                    shardBlocks(reader->blocks(), shard, shard_mask);
                 }
+                for (size_t i = 0; i < wanted.size(); i++) wanted[i] = wanted[i] && shard_mask[i];
             }
+            size_t num_wanted = std::count(wanted.begin(), wanted.end(), true);
+            std::cout << "Reading " << num_wanted << " of " << wanted.size() << " indexed blocks" << std::endl;
+            for (size_t i = 0; i < wanted.size(); i++) {
+                if (wanted[i]) wanted_records += reader->blocks()[i].numRecords;
+            }
+        } else if (sample.every > 1 && !sample_records) {
+            ctx.sample_every = sample.every;
+        }
 
-            // Scale sums and normalize matrix
-            APAMatrix::scaleByAverage(all_rowSums[bedpe_idx]);
-            APAMatrix::scaleByAverage(all_colSums[bedpe_idx]);
-            all_matrices[bedpe_idx].normalize(all_rowSums[bedpe_idx], all_colSums[bedpe_idx]);
+        // The whole slice in one round, or sampled rounds until the estimate
+        // settles. A round of blocks sees only the loops near its blocks, so
+        // the estimate is not accepted before every chromosome pair read has
+        // had a block sampled.
+        std::vector<uint32_t> block_pairs;
+        const std::vector<int32_t> block_rounds =
+            wanted.empty() ? std::vector<int32_t>() : sampleRounds(reader->blocks(), wanted, sample.every, block_pairs);
+        std::set<uint32_t> wanted_pairs, sampled_pairs;
+        for (size_t i = 0; i < block_rounds.size(); i++) {
+            if (block_rounds[i] >= 0) wanted_pairs.insert(block_pairs[i]);
         }
+        std::unique_ptr<ScanAccumulator> result;
+        std::vector<ApaPartial> pass_sums;
+        std::vector<double> last_enrichment(pass.size(), 0.0);
+        uint64_t sampled_records = 0;
+        for (int round = 0; round < sample.every; round++) {
+            if (!reader) reader = SliceReader::open(slice_file, num_threads);
+            if (!wanted.empty()) {
+                std::vector<bool> part(wanted.size(), false);
+                for (size_t i = 0; i < wanted.size(); i++) {
+                    if (block_rounds[i] != round) continue;
+                    part[i] = true;
+                    sampled_records += reader->blocks()[i].numRecords;
+                    sampled_pairs.insert(block_pairs[i]);
+                }
+                reader->selectBlocks(part);
+            } else if (shard_records) {
+                reader->selectRecords(std::vector<std::pair<uint64_t, uint64_t>>(1, shard_range));
+            } else if (sample_records) {
+                // Every every-th run of records, so that a round spans the file
+                std::vector<std::pair<uint64_t, uint64_t>> part;
+                for (uint64_t first = static_cast<uint64_t>(round) * SAMPLE_RUN_RECORDS; first < num_records;
+                     first += static_cast<uint64_t>(sample.every) * SAMPLE_RUN_RECORDS) {
+                    part.push_back(std::make_pair(first, std::min(num_records, first + SAMPLE_RUN_RECORDS)));
+                    sampled_records += part.back().second - first;
+                }
+                reader->selectRecords(part);
+            }
+            ctx.sample_round = round;
 
-        if (is_compressed) {
-            gzclose(gz_file);
-        } else {
-            fclose(raw_file);
+            // Single pass over the file: process contacts for both coverage and APA
+            std::cout << "Processing contacts..." << std::endl;
+            int64_t contact_count = 0;
+            uint64_t record_bytes = 0;
+            std::unique_ptr<ScanAccumulator> round_result;
+            {
+                SemaphoreSlot io_slot(io_slots);  // Bounds the slices read at once in batch runs
+                StageTimer timer(stats, "scan");
+                round_result = scanContacts(*reader, ctx, num_threads, contact_count, record_bytes);
+                reader.reset();
+            }
+            std::cout << std::endl;
+            if (stats) stats->addScan(round_result->counters, record_bytes, fileSize(slice_file));
+            std::cout << "Finished processing " << contact_count << " contacts" << std::endl;
+            if (result) {
+                result->merge(*round_result);
+                result->sweeping = result->sweeping && round_result->sweeping;
+            } else {
+                result = std::move(round_result);
+            }
+
+            // The coverage sums of each index's loops, from histograms of their
+            // window starts; the indices are independent, so in parallel
+            {
+                StageTimer timer(stats, "window_sums");
+                pass_sums.clear();
+                for (const auto& index : all_indices) pass_sums.emplace_back(index->window * 2 + 1);
+                parallelFor(pass.size(), num_threads, [&](size_t i) {
+                    const int32_t merge = index_bins[i].merge;
+                    const CoverageVectors& coverage =
+                        merge == 1 ? result->coverage
+                                   : result->mergedCoverage[std::find(coverage_merges.begin(), coverage_merges.end(),
+                                                                      merge) - coverage_merges.begin()];
+                    const int32_t width = all_indices[i]->window * 2 + 1;
+                    WindowStarts row_starts(coverage, width), col_starts(coverage, width);
+                    all_indices[i]->forEachAnchor(
+                        [&](int32_t chrom, int32_t, int32_t sumStart, uint64_t weight) {
+                            row_starts.add(chrom, sumStart, weight);
+                        },
+                        [&](int32_t chrom, int32_t, int32_t sumStart, uint64_t weight) {
+                            col_starts.add(chrom, sumStart, weight);
+                        });
+                    coverage.addWindowSums(pass_sums[i].rowSums, row_starts);
+                    coverage.addWindowSums(pass_sums[i].colSums, col_starts);
+                    pass_sums[i].matrix.merge(result->matrices[i]);
+                });
+            }
+            if (sample.every == 1) break;
+            StageTimer timer(stats, "sample_check");
+
+            // Scale up by the records read, or the share of bin hashes kept
+            const double fraction = !wanted.empty()
+                ? (wanted_records == 0 ? 1.0 : static_cast<double>(sampled_records) / wanted_records)
+                : sample_records ? static_cast<double>(sampled_records) / num_records
+                : static_cast<double>(round + 1) / sample.every;
+            for (auto& sums : pass_sums) sums.scale(fraction > 0 ? static_cast<float>(1.0 / fraction) : 1.0f);
+
+            // Convergence: the largest relative change of any center enrichment
+            double largest_change = 0;
+            double low = INFINITY, high = 0;
+            for (size_t i = 0; i < pass.size(); i++) {
+                const double enrichment = pass_sums[i].normalized().centerEnrichment();
+                const double last = last_enrichment[i];
+                const double change = last > 0 ? std::fabs(enrichment - last) / last
+                                               : (enrichment == last ? 0.0 : INFINITY);
+                largest_change = std::max(largest_change, change);
+                low = std::min(low, enrichment);
+                high = std::max(high, enrichment);
+                last_enrichment[i] = enrichment;
+            }
+            std::cout << "Sample round " << round + 1 << " of " << sample.every << ": " << fraction * 100
+                      << "% of the records, center enrichment " << low << " to " << high;
+            if (round > 0) std::cout << ", largest change " << largest_change * 100 << "%";
+            if (sampled_pairs.size() < wanted_pairs.size()) {
+                std::cout << ", " << sampled_pairs.size() << " of " << wanted_pairs.size()
+                          << " chromosome pairs sampled";
+            }
+            std::cout << std::endl;
+            if (!(sample.tolerance > 0)) break;
+            if (round > 0 && round + 1 < sample.every && largest_change <= sample.tolerance &&
+                sampled_pairs.size() == wanted_pairs.size()) {
+                std::cout << "Center enrichment settled within " << sample.tolerance * 100 << "%; stopping after "
+                          << round + 1 << " of " << sample.every << " rounds" << std::endl;
+                break;
+            }
         }
-        
-        return all_matrices;
+        std::cout << (result->sweeping ? "Contacts were sorted by bin; matched them with a sweep"
+                                       : "Contacts were not sorted by bin; matched them by lookup")
+                  << std::endl;
 
-    } catch (const std::exception& e) {
-        if (is_compressed && gz_file) {
-            gzclose(gz_file);
-        } else if (!is_compressed && raw_file) {
-            fclose(raw_file);
+        // Free RegionsOfInterest as it's no longer needed for contact processing
+        roi.reset();
+
+        // Add this pass's matrices and sums
+        for (size_t i = 0; i < pass.size(); i++) {
+            partials[pass[i].job].add(pass_sums[i]);
         }
-        throw;
     }
+
+    return partials;
+}
+
+std::vector<APAMatrix> normalizeAll(const std::vector<ApaPartial>& partials, RunStats* stats = nullptr) {
+    StageTimer timer(stats, "normalize");
+    std::cout << "Calculating coverage normalization..." << std::endl;
+    std::vector<APAMatrix> matrices;
+    matrices.reserve(partials.size());
+    for (const auto& partial : partials) matrices.push_back(partial.normalized());
+    return matrices;
+}
+
+} // namespace
+
+std::vector<APAMatrix> processSliceFile(
+    const std::string& slice_file,
+    const std::vector<BedpeTable>& all_bedpe_entries,
+    int window_size,
+    bool isInter,
+    long min_genome_dist,
+    long max_genome_dist,
+    int num_threads,
+    uint64_t memory_budget) {
+    return normalizeAll(processLoopSets(slice_file, all_bedpe_entries,
+                                        std::vector<ApaConfig>(1, ApaConfig{window_size, 1}), isInter,
+                                        min_genome_dist, max_genome_dist, num_threads, memory_budget,
+                                        nullptr, nullptr, SliceShard{0, 1}, nullptr, SampleOptions()));
+}
+
+std::vector<APAMatrix> processSliceFile(
+    const std::string& slice_file,
+    const std::vector<BedpeTable>& all_bedpe_entries,
+    const std::vector<ApaConfig>& configs,
+    bool isInter,
+    long min_genome_dist,
+    long max_genome_dist,
+    int num_threads,
+    uint64_t memory_budget,
+    const IndexCache* cache,
+    CountingSemaphore* io_slots,
+    RunStats* stats,
+    const SampleOptions& sample) {
+    return normalizeAll(processLoopSets(slice_file, all_bedpe_entries, configs, isInter, min_genome_dist,
+                                        max_genome_dist, num_threads, memory_budget, cache, io_slots,
+                                        SliceShard{0, 1}, stats, sample),
+                        stats);
+}
+
+std::vector<APAMatrix> processSliceFile(
+    const std::string& slice_file,
+    const std::vector<InterAnchors>& all_anchors,
+    int window_size,
+    int num_threads,
+    uint64_t memory_budget) {
+    return normalizeAll(processLoopSets(slice_file, all_anchors, std::vector<ApaConfig>(1, ApaConfig{window_size, 1}),
+                                        true, 0, 0, num_threads, memory_budget, nullptr, nullptr,
+                                        SliceShard{0, 1}, nullptr, SampleOptions()));
+}
+
+std::vector<APAMatrix> processSliceFile(
+    const std::string& slice_file,
+    const std::vector<InterAnchors>& all_anchors,
+    const std::vector<ApaConfig>& configs,
+    int num_threads,
+    uint64_t memory_budget,
+    const IndexCache* cache,
+    CountingSemaphore* io_slots,
+    RunStats* stats,
+    const SampleOptions& sample) {
+    return normalizeAll(processLoopSets(slice_file, all_anchors, configs, true, 0, 0, num_threads, memory_budget,
+                                        cache, io_slots, SliceShard{0, 1}, stats, sample),
+                        stats);
+}
+
+std::vector<ApaPartial> processSliceShard(
+    const std::string& slice_file,
+    const std::vector<BedpeTable>& all_bedpe_entries,
+    const std::vector<ApaConfig>& configs,
+    bool isInter,
+    long min_genome_dist,
+    long max_genome_dist,
+    const SliceShard& shard,
+    int num_threads,
+    uint64_t memory_budget,
+    const IndexCache* cache,
+    RunStats* stats) {
+    return processLoopSets(slice_file, all_bedpe_entries, configs, isInter, min_genome_dist, max_genome_dist,
+                           num_threads, memory_budget, cache, nullptr, shard, stats, SampleOptions());
+}
+
+std::vector<ApaPartial> processSliceShard(
+    const std::string& slice_file,
+    const std::vector<InterAnchors>& all_anchors,
+    const std::vector<ApaConfig>& configs,
+    const SliceShard& shard,
+    int num_threads,
+    uint64_t memory_budget,
+    const IndexCache* cache,
+    RunStats* stats) {
+    return processLoopSets(slice_file, all_anchors, configs, true, 0, 0, num_threads, memory_budget, cache,
+                           nullptr, shard, stats, SampleOptions());
 }
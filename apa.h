@@ -2,11 +2,13 @@
 #define APA_H
 
 #include "bedpe_builder.h"  // Must come first since it defines BedpeEntry
+#include "slice_reader.h"
+#include "aligned_allocator.h"
+#include "matrix_writer.h"
 #include <string>
 #include <vector>
 #include <set>
 #include <unordered_map>
-#include <unordered_set>
 #include <stdexcept>
 #include <cstdint>  // For int32_t
 #include <iostream>
@@ -14,12 +16,21 @@
 #include <map>
 #include <sys/sysinfo.h>
 #include <iomanip>
+#include <cstdio>
+#include <memory>
 
 // Forward declarations
 struct RegionsOfInterest;
+struct WindowStarts;
 struct LoopIndex;
 struct APAMatrix;
 struct CoverageVectors;
+class IndexCache;
+class CountingSemaphore;
+class RunStats;
+
+// Loop indices in use by a scan, possibly shared with other scans
+typedef std::vector<std::shared_ptr<const LoopIndex>> SharedLoopIndices;
 
 namespace detail {
     // Default chromosome sizes (in bp)
@@ -34,153 +45,72 @@ namespace detail {
         {"chrY", 57227415}, {"chr22", 50818468}, {"chr21", 46709983}
     };
 
-    // Calculate number of bins for a chromosome at given resolution
+    // Calculate number of bins for a chromosome at given resolution, for
+    // slices whose block index does not give it. Names may leave out the
+    // "chr" prefix.
     inline int32_t getChromBins(const std::string& chrom, int32_t resolution) {
         auto it = DEFAULT_CHROM_SIZES.find(chrom);
+        if (it == DEFAULT_CHROM_SIZES.end()) it = DEFAULT_CHROM_SIZES.find("chr" + chrom);
         if (it != DEFAULT_CHROM_SIZES.end()) {
             return (it->second / resolution) + 1;
         }
         return 20000000 / resolution; // Default fallback size
     }
 
-    // Make all function definitions inline
-    inline size_t estimateChromCoverageMemory(const std::string& chrom, int32_t resolution) {
-        auto it = DEFAULT_CHROM_SIZES.find(chrom);
-        if (it != DEFAULT_CHROM_SIZES.end()) {
-            return (it->second / resolution + 1) * 4;  // 4 bytes per float
-        }
-        return 20000000 / resolution * 4; // Default size, 4 bytes per float
-    }
-
-    inline size_t estimateMemoryUsage(const std::vector<std::vector<BedpeEntry>>& bedpe_entries, 
-                              int window_size) {
-        size_t total_bedpes = 0;
-        std::set<std::string> unique_chroms;
-        
-        // Count total BEDPEs and unique chromosomes
-        for (const auto& entries : bedpe_entries) {
-            total_bedpes += entries.size();
-            for (const auto& entry : entries) {
-                unique_chroms.insert(entry.chrom1);
-                unique_chroms.insert(entry.chrom2);
+    // Bytes the kernel can hand out without swapping: MemAvailable, which
+    // counts reclaimable page cache, or free plus buffer RAM on kernels
+    // without it. 0 if neither is known.
+    inline uint64_t availableMemoryBytes() {
+        if (FILE* meminfo = fopen("/proc/meminfo", "r")) {
+            char line[256];
+            unsigned long long kb = 0;
+            bool found = false;
+            while (!found && fgets(line, sizeof(line), meminfo)) {
+                found = sscanf(line, "MemAvailable: %llu kB", &kb) == 1;
             }
+            fclose(meminfo);
+            if (found) return static_cast<uint64_t>(kb) * 1024;
         }
-        
-        size_t peak_memory = 0;
-        size_t current_memory = 0;
-        
-        // Phase 1: Initial loading and structure creation
-        // BedpeEntry size: 2 strings (32 bytes each) + 4 longs (8 bytes each)
-        current_memory += total_bedpes * (64 + 32);
-        
-        // RegionsOfInterest (2 maps of sets of bin indices)
-        size_t roi_size = bedpe_entries.size() * // Number of ROIs
-                         total_bedpes * // Entries per ROI
-                         (window_size * 2 + 1) * 2 * // Indices per entry (both dimensions)
-                         4; // Size of int32_t
-        current_memory += roi_size;
-        
-        // LoopIndex structures with LoopInfo
-        size_t loop_index_size = 0;
-        // LoopInfo: 2 strings (32 bytes each) + 6 int32_t (4 bytes each)
-        loop_index_size += total_bedpes * (64 + 24) * bedpe_entries.size();
-        
-        // ChromPair map structures
-        size_t chrom_pairs = (unique_chroms.size() * unique_chroms.size()) / 4;
-        loop_index_size += chrom_pairs * (
-            64 + // ChromPair (2 strings, 32 bytes each)
-            48 + // std::map overhead
-            // Estimate bin groups per chrom pair: chr1 size = 248956422
-            (248956422 / 1000000) * 24 // vector overhead, using 1M as bin group size (1000 * 1000)
-        );
-        current_memory += loop_index_size;
-        
-        peak_memory = std::max(peak_memory, current_memory);
-        
-        // Phase 2: After freeing BedpeEntries
-        current_memory -= total_bedpes * (64 + 32);
-        
-        // APAMatrix (width x width float matrix for each BEDPE set)
-        size_t matrix_width = window_size * 2 + 1;
-        size_t matrix_size = matrix_width * matrix_width * 4; // 4 bytes per float
-        current_memory += bedpe_entries.size() * matrix_size;
-        
-        // Coverage vectors (one float vector per chromosome)
-        size_t coverage_size = 0;
-        for (const auto& chrom : unique_chroms) {
-            coverage_size += estimateChromCoverageMemory(chrom, 1000);
-        }
-        current_memory += coverage_size;
-        
-        peak_memory = std::max(peak_memory, current_memory);
-        
-        // Phase 3: After freeing ROI
-        current_memory -= roi_size;
-        
-        // Row and column sums (float vector for each BEDPE set)
-        size_t sums_size = bedpe_entries.size() * 2 * // Two vectors per BEDPE set
-                          matrix_width * 4; // 4 bytes per float
-        current_memory += sums_size;
-        
-        peak_memory = std::max(peak_memory, current_memory);
-
-        // Add 30% overhead for STL containers and other overhead
-        peak_memory = static_cast<size_t>(peak_memory * 1.3);
-        
-        return peak_memory;
-    }
-
-    inline void checkMemoryRequirements(const std::vector<std::vector<BedpeEntry>>& bedpe_entries,
-                               int window_size) {
-        size_t estimated_bytes = estimateMemoryUsage(bedpe_entries, window_size);
-        
-        // Get available system memory
         struct sysinfo si;
         if (sysinfo(&si) == 0) {
-            uint64_t total_ram = si.totalram * si.mem_unit;
-            uint64_t available_ram = si.freeram * si.mem_unit;
-            
-            double est_gb = estimated_bytes / (1024.0 * 1024.0 * 1024.0);
-            double total_gb = total_ram / (1024.0 * 1024.0 * 1024.0);
-            double avail_gb = available_ram / (1024.0 * 1024.0 * 1024.0);
-            
-            std::cout << "\nMemory Requirements:\n"
-                      << "Estimated memory needed: " << std::fixed << std::setprecision(2) 
-                      << est_gb << " GB\n"
-                      << "Total system RAM: " << std::setprecision(2) << total_gb << " GB\n"
-                      << "Available RAM: " << std::setprecision(2) << avail_gb << " GB\n\n";
-            
-            if (estimated_bytes > available_ram * 0.9) { // Leave 10% buffer
-                throw std::runtime_error(
-                    "Insufficient memory available. Need " + 
-                    std::to_string(est_gb) + " GB but only " + 
-                    std::to_string(avail_gb) + " GB available"
-                );
-            }
-        } else {
-            std::cerr << "Warning: Could not check system memory. Continuing without verification.\n";
+            return (static_cast<uint64_t>(si.freeram) + si.bufferram) * si.mem_unit;
         }
+        return 0;
     }
 }
 
 // Define structures first
-struct LoopInfo {
-    std::string chrom1;
-    std::string chrom2;
-    int32_t start1;
-    int32_t end1;
-    int32_t start2;
-    int32_t end2;
-    
-    LoopInfo(const BedpeEntry& entry) 
-        : chrom1(entry.chrom1), chrom2(entry.chrom2),
-          start1(entry.start1), end1(entry.end1),
-          start2(entry.start2), end2(entry.end2) {}
+
+// Everything the scan needs about one loop, in bins at the slice resolution.
+// Built once per run so the hot loop never divides by the resolution.
+struct LoopBins {
+    int32_t originX;    // First bin of the window around the loop center (center - window)
+    int32_t originY;
+    int32_t sumStartX;  // First bin of the coverage window summed for normalization
+    int32_t sumStartY;
+
+    static LoopBins fromEntry(const BedpeEntry& entry, int32_t resolution, int32_t window) {
+        LoopBins bins = {windowOrigin(entry.start1, entry.end1, resolution, window),
+                         windowOrigin(entry.start2, entry.end2, resolution, window),
+                         sumStart(entry.start1, entry.end1, resolution, window),
+                         sumStart(entry.start2, entry.end2, resolution, window)};
+        return bins;
+    }
+
+    // Center bin of an anchor (+1 so bin ends include the full range) minus the window
+    static int32_t windowOrigin(long start, long end, int32_t resolution, int32_t window) {
+        return static_cast<int32_t>((start / resolution + end / resolution + 1) / 2) - window;
+    }
+
+    // Normalization centers on the anchor midpoint, as it always has
+    static int32_t sumStart(long start, long end, int32_t resolution, int32_t window) {
+        return static_cast<int32_t>(((start + end) / 2) / resolution) - window;
+    }
 };
 
 struct ChromPair {
-    std::string chrom1;
-    std::string chrom2;
+    int32_t chrom1;
+    int32_t chrom2;
     
     bool operator<(const ChromPair& other) const {
         if (chrom1 != other.chrom1) return chrom1 < other.chrom1;
@@ -194,108 +124,660 @@ struct BinRegion {
     int32_t end;
 };
 
+// Dense bitset over the bins of one chromosome, sized to the highest bin set
+struct BinBitmap {
+    std::vector<uint64_t> words;
+
+    // Set every bin in [first, last]; negative bins are dropped
+    void setRange(int32_t first, int32_t last) {
+        first = std::max<int32_t>(first, 0);
+        if (last < first) return;
+        size_t needed = static_cast<size_t>(last >> 6) + 1;
+        if (words.size() < needed) words.resize(needed, 0);
+        for (int32_t bin = first; bin <= last; bin++) {
+            words[bin >> 6] |= uint64_t(1) << (bin & 63);
+        }
+    }
+
+    // Allocate bins [0, last] up front; nothing for last < 0
+    void reserveBins(int32_t last) {
+        if (last >= 0) words.resize(std::max(words.size(), static_cast<size_t>(last >> 6) + 1), 0);
+    }
+
+    bool test(int32_t bin) const {
+        size_t word = static_cast<uint32_t>(bin) >> 6;  // Negative bins land far out of range
+        return word < words.size() && ((words[word] >> (bin & 63)) & 1);
+    }
+
+    // True if any bin in [first, last] is set
+    bool anyInRange(int32_t first, int32_t last) const {
+        first = std::max<int32_t>(first, 0);
+        last = std::min<int32_t>(last, static_cast<int32_t>(words.size() * 64) - 1);
+        for (int32_t bin = first; bin <= last;) {
+            uint64_t word = words[bin >> 6] >> (bin & 63);
+            int32_t span = std::min(63 - (bin & 63), last - bin);  // Bits of this word still in range
+            if (span < 63) word &= (uint64_t(2) << span) - 1;
+            if (word) return true;
+            bin += span + 1;
+        }
+        return false;
+    }
+
+    size_t memoryBytes() const {
+        return words.size() * sizeof(uint64_t);
+    }
+};
+
+// For every bin of one chromosome, a bitmask of the BEDPE sets whose
+// anchor windows cover it (words_per_bin 64-bit words per bin)
+struct BinSetMasks {
+    std::vector<uint64_t> masks;
+
+    void addRange(int32_t first, int32_t last, size_t set, size_t words_per_bin) {
+        first = std::max<int32_t>(first, 0);
+        if (last < first) return;
+        size_t needed = (static_cast<size_t>(last) + 1) * words_per_bin;
+        if (masks.size() < needed) masks.resize(needed, 0);
+        const uint64_t bit = uint64_t(1) << (set & 63);
+        for (int32_t bin = first; bin <= last; bin++) {
+            masks[bin * words_per_bin + (set >> 6)] |= bit;
+        }
+    }
+
+    void reserveBins(int32_t last, size_t words_per_bin) {
+        if (last >= 0) masks.resize(std::max(masks.size(), (static_cast<size_t>(last) + 1) * words_per_bin), 0);
+    }
+
+    // Only valid for bins set in the matching BinBitmap
+    const uint64_t* get(int32_t bin, size_t words_per_bin) const {
+        return &masks[bin * words_per_bin];
+    }
+
+    size_t memoryBytes() const {
+        return masks.size() * sizeof(uint64_t);
+    }
+};
+
+// Combined regions of interest of all BEDPE sets. The union bitmaps reject
+// most contacts with two bit tests; the survivors get the mask of sets
+// whose windows contain both bins, so each contact is tested once no
+// matter how many sets are loaded.
 struct RegionsOfInterest {
-    std::unordered_map<std::string, std::unordered_set<int32_t>> rowIndices;
-    std::unordered_map<std::string, std::unordered_set<int32_t>> colIndices;
+    std::vector<BinBitmap> rowBins;  // Indexed by chromosome ID
+    std::vector<BinBitmap> colBins;
+    std::vector<BinSetMasks> rowSets;
+    std::vector<BinSetMasks> colSets;
+    size_t numSets;
+    size_t wordsPerBin;
     int32_t resolution;
-    int32_t window;
     bool isInter;
 
-    RegionsOfInterest(const std::vector<BedpeEntry>& bedpe_entries, 
-                     int32_t res, int32_t win,
-                     bool inter) 
-        : resolution(res), window(win), isInter(inter) {
-        // Pre-reserve space for better performance
-        for (const auto& entry : bedpe_entries) {
-            rowIndices[entry.chrom1].reserve(detail::getChromBins(entry.chrom1, resolution));
-            colIndices[entry.chrom2].reserve(detail::getChromBins(entry.chrom2, resolution));
-        }
-
-        for (const auto& entry : bedpe_entries) {
-            // Convert BEDPE coordinates to bin positions
-            int32_t bin1Start = entry.start1 / resolution;
-            int32_t bin1End = (entry.end1 / resolution) + 1;  // +1 to include the full range
-            int32_t bin2Start = entry.start2 / resolution;
-            int32_t bin2End = (entry.end2 / resolution) + 1;  // +1 to include the full range
-            
-            // Calculate center positions
-            int32_t centerX = (bin1Start + bin1End) / 2;
-            int32_t centerY = (bin2Start + bin2End) / 2;
-            
-            // Add all possible bins within window of the loop center
-            for (int32_t bin = centerX - win; bin <= centerX + win; bin++) {
-                if (bin >= 0) rowIndices[entry.chrom1].insert(bin);
-            }
-            for (int32_t bin = centerY - win; bin <= centerY + win; bin++) {
-                if (bin >= 0) colIndices[entry.chrom2].insert(bin);
-            }
-        }
-    }
+    // Anchors on chromosomes the slice does not contain are skipped. Each
+    // index contributes the windows of its own size and resolution, in bins
+    // of the slice resolution res.
+    RegionsOfInterest(const SharedLoopIndices& all_indices,
+                     const ChromosomeTable& chromosomes,
+                     int32_t res,
+                     bool inter);
 
-    bool probablyContainsRecord(const std::string& chr1, const std::string& chr2,
+    bool probablyContainsRecord(int32_t chr1, int32_t chr2,
                               int32_t binX, int32_t binY) const {
         // Quick filter for inter/intra
         if (isInter && chr1 == chr2) return false;
         if (!isInter && chr1 != chr2) return false;
         
-        auto rowIt = rowIndices.find(chr1);
-        auto colIt = colIndices.find(chr2);
-        return rowIt != rowIndices.end() && colIt != colIndices.end() &&
-               rowIt->second.count(binX) && colIt->second.count(binY);
+        return rowBins[chr1].test(binX) && colBins[chr2].test(binY);
+    }
+
+    // Write the mask of sets whose windows contain the contact into
+    // mask[0..wordsPerBin). Returns false if no set matches.
+    bool matchingSets(int32_t chr1, int32_t chr2, int32_t binX, int32_t binY,
+                      uint64_t* mask) const {
+        if (!probablyContainsRecord(chr1, chr2, binX, binY)) return false;
+
+        const uint64_t* rows = rowSets[chr1].get(binX, wordsPerBin);
+        const uint64_t* cols = colSets[chr2].get(binY, wordsPerBin);
+        uint64_t any = 0;
+        for (size_t w = 0; w < wordsPerBin; w++) {
+            mask[w] = rows[w] & cols[w];
+            any |= mask[w];
+        }
+        return any != 0;
+    }
+
+    size_t memoryBytes() const {
+        size_t total = 0;
+        for (const auto& bins : rowBins) total += bins.memoryBytes();
+        for (const auto& bins : colBins) total += bins.memoryBytes();
+        for (const auto& sets : rowSets) total += sets.memoryBytes();
+        for (const auto& sets : colSets) total += sets.memoryBytes();
+        return total;
     }
 };
 
+// Loops of every chromosome pair laid out CSR-style: bucketed by the cell
+// of originX on a grid of 2*window+1 bins, and sorted by originY within a
+// cell. The window around a contact touches at most two cells, and the
+// loops that can match inside a cell are one contiguous originY range.
+//
+// An implicit index holds an inter set by its anchors instead (see
+// InterAnchors): per chromosome, the forward and reverse anchors sorted by
+// window origin, with the anchors sharing their bins counted together. A
+// contact matches every pair of a forward anchor near binX and a reverse
+// anchor near binY, so memory is O(anchors) rather than O(loops).
 struct LoopIndex {
-    static const int32_t BIN_GROUP_SIZE = 1000;
-    std::map<ChromPair, std::map<int32_t, std::vector<LoopInfo>>> loops;
+    // One chromosome pair; its loops and cell starts are ranges of the
+    // index-wide loopStorage and cellStorage
+    struct PairGrid {
+        int32_t chrom2;
+        int32_t firstCellX;
+        size_t loopsBegin;  // Loops are loopStorage[loopsBegin, loopsBegin + numLoops)
+        size_t numLoops;
+        size_t cellsBegin;  // Loops of cell firstCellX+i are [start[i], start[i+1]) with
+        size_t numCells;    // start = cellStorage + cellsBegin, relative to the pair's loops
+    };
+
+    // A loop with an anchor on a chromosome the slice does not contain
+    struct UnmatchableLoop {
+        int32_t chrom1;
+        int32_t chrom2;
+        LoopBins bins;
+    };
+
+    // Anchors of an implicit index that share both bins
+    struct AnchorBins {
+        int32_t origin;    // Window origin, as LoopBins::originX/originY
+        int32_t sumStart;  // As LoopBins::sumStartX/sumStartY
+        uint32_t count;
+    };
+
+    std::vector<std::vector<PairGrid>> grids;  // By chrom1; usually one pair (intra) per chromosome
+    std::vector<LoopBins> loopStorage;          // Every pair's loops, allocated once at their final size
+    std::vector<uint32_t> cellStorage;
+    std::vector<UnmatchableLoop> unmatchable;
     int32_t resolution;
-    
-    LoopIndex(const std::vector<BedpeEntry>& bedpe_entries, int32_t res) : resolution(res) {
-        for (const auto& loop : bedpe_entries) {
-            ChromPair chrom_pair{loop.chrom1, loop.chrom2};
-            int32_t mid_bin = ((loop.start1 + loop.end1) / 2) / resolution;
-            int32_t bin_group = mid_bin / BIN_GROUP_SIZE;
-            loops[chrom_pair][bin_group].emplace_back(loop);
+    int32_t window;
+    int32_t cellSize;
+
+    bool implicit;
+    std::vector<std::vector<AnchorBins>> forwardAnchors;  // By chromosome ID, sorted by origin
+    std::vector<std::vector<AnchorBins>> reverseAnchors;
+    std::vector<uint64_t> forwardPartners;  // Loops each forward anchor of a chromosome is part of
+    std::vector<uint64_t> reversePartners;
+    std::vector<char> pairs;                // pairs[chrom1 * numChroms + chrom2]: loops join them
+    size_t numChroms;
+
+    // An empty index, for IndexCache::load to fill
+    LoopIndex() : resolution(0), window(0), cellSize(1), implicit(false), numChroms(0) {}
+
+    // A chromosome the slice does not contain gets ID -1. Such loops never
+    // match a contact, but their other anchor still counts towards the
+    // coverage sums used for normalization.
+    //
+    // With chroms1 given, only the loops whose chrom1 (a table ID) is set
+    // in it are indexed, for scans that take the set in several passes.
+    LoopIndex(const BedpeTable& bedpe_entries, const ChromosomeTable& chromosomes,
+              int32_t res, int32_t win, const std::vector<bool>& chroms1 = std::vector<bool>())
+        : grids(chromosomes.size()), resolution(res), window(win), cellSize(2 * win + 1),
+          implicit(false), numChroms(chromosomes.size()) {
+        std::vector<int32_t> slice_ids;  // By the table's chromosome IDs
+        for (const auto& name : bedpe_entries.chromNames) slice_ids.push_back(chromosomes.idForName(name));
+
+        auto pairOf = [&](const BedpeEntry& entry) {
+            ChromPair chrom_pair{slice_ids[entry.chrom1], slice_ids[entry.chrom2]};
+            return chrom_pair;
+        };
+        auto indexed = [&](const BedpeEntry& entry) {
+            return (chroms1.empty() || chroms1[entry.chrom1]) &&
+                   (slice_ids[entry.chrom1] >= 0 || slice_ids[entry.chrom2] >= 0);
+        };
+
+        // Count the loops of every pair first so that each structure is
+        // allocated once at its final size
+        std::map<ChromPair, size_t> pair_offsets;
+        size_t num_unmatchable = 0;
+        for (const auto& entry : bedpe_entries.entries) {
+            if (!indexed(entry)) continue;
+            ChromPair chrom_pair = pairOf(entry);
+            if (chrom_pair.chrom1 < 0 || chrom_pair.chrom2 < 0) {
+                num_unmatchable++;
+            } else {
+                pair_offsets[chrom_pair]++;
+            }
+        }
+        size_t total = 0;
+        for (auto& pair : pair_offsets) {
+            size_t count = pair.second;
+            pair.second = total;
+            total += count;
+        }
+
+        loopStorage.resize(total);
+        unmatchable.reserve(num_unmatchable);
+        std::map<ChromPair, size_t> next(pair_offsets);
+        auto cursor = next.end();
+        for (const auto& entry : bedpe_entries.entries) {
+            if (!indexed(entry)) continue;
+            ChromPair chrom_pair = pairOf(entry);
+            LoopBins bins = LoopBins::fromEntry(entry, resolution, window);
+            if (chrom_pair.chrom1 < 0 || chrom_pair.chrom2 < 0) {
+                UnmatchableLoop loop = {chrom_pair.chrom1, chrom_pair.chrom2, bins};
+                unmatchable.push_back(loop);
+                continue;
+            }
+            // Entries come grouped by pair, so the last cursor usually fits
+            if (cursor == next.end() || cursor->first.chrom1 != chrom_pair.chrom1 ||
+                cursor->first.chrom2 != chrom_pair.chrom2) {
+                cursor = next.find(chrom_pair);
+            }
+            loopStorage[cursor->second++] = bins;
+        }
+
+        std::vector<PairGrid> pair_grids;
+        size_t total_cells = 0;
+        for (const auto& pair : pair_offsets) {
+            PairGrid grid;
+            grid.chrom2 = pair.first.chrom2;
+            grid.loopsBegin = pair.second;
+            grid.numLoops = next[pair.first] - pair.second;
+            LoopBins* loops = loopStorage.data() + grid.loopsBegin;
+            std::stable_sort(loops, loops + grid.numLoops, [this](const LoopBins& a, const LoopBins& b) {
+                int32_t cellA = cellOf(a.originX);
+                int32_t cellB = cellOf(b.originX);
+                if (cellA != cellB) return cellA < cellB;
+                return a.originY < b.originY;
+            });
+            grid.firstCellX = cellOf(loops[0].originX);
+            grid.numCells = cellOf(loops[grid.numLoops - 1].originX) - grid.firstCellX + 1;
+            grid.cellsBegin = total_cells;
+            total_cells += grid.numCells + 1;
+            pair_grids.push_back(grid);
+        }
+
+        cellStorage.assign(total_cells, 0);
+        auto pair = pair_offsets.begin();
+        for (const auto& grid : pair_grids) {
+            const LoopBins* loops = loopStorage.data() + grid.loopsBegin;
+            uint32_t* cellXStart = cellStorage.data() + grid.cellsBegin;
+            for (size_t i = 0; i < grid.numLoops; i++) {
+                cellXStart[cellOf(loops[i].originX) - grid.firstCellX + 1]++;
+            }
+            for (size_t i = 1; i <= grid.numCells; i++) {
+                cellXStart[i] += cellXStart[i - 1];
+            }
+            grids[(pair++)->first.chrom1].push_back(grid);
         }
     }
-    
-    std::vector<const LoopInfo*> getNearbyLoops(const std::string& chr1, const std::string& chr2, 
-                                               int32_t binX) const {
-        ChromPair chrom_pair{chr1, chr2};
-        auto chrom_it = loops.find(chrom_pair);
-        if (chrom_it == loops.end()) return {};
-        
-        int32_t bin_group = binX / BIN_GROUP_SIZE;
-        std::vector<const LoopInfo*> nearby_loops;
-        nearby_loops.reserve(10);
-        
-        for (int32_t i = -1; i <= 1; i++) {
-            auto group_it = chrom_it->second.find(bin_group + i);
-            if (group_it != chrom_it->second.end()) {
-                for (const auto& loop : group_it->second) {
-                    nearby_loops.push_back(&loop);
+
+    // The loops of an inter set, never materialized. As for explicit
+    // loops, anchors on chromosomes the slice does not contain never match
+    // but still count as partners of the anchors they pair with.
+    LoopIndex(const InterAnchors& anchors, const ChromosomeTable& chromosomes,
+              int32_t res, int32_t win)
+        : grids(chromosomes.size()), resolution(res), window(win), cellSize(2 * win + 1),
+          implicit(true), forwardAnchors(chromosomes.size()), reverseAnchors(chromosomes.size()),
+          forwardPartners(chromosomes.size(), 0), reversePartners(chromosomes.size(), 0),
+          pairs(chromosomes.size() * chromosomes.size(), 0), numChroms(chromosomes.size()) {
+        for (const auto& forward : anchors.forwards) {
+            for (const auto& reverse : anchors.reverses) {
+                if (!BedpeBuilder::isInterPair(forward.first, reverse.first)) continue;
+                int32_t chrom1 = chromosomes.idForName(forward.first);
+                int32_t chrom2 = chromosomes.idForName(reverse.first);
+                if (chrom1 >= 0) forwardPartners[chrom1] += reverse.second.size();
+                if (chrom2 >= 0) reversePartners[chrom2] += forward.second.size();
+                if (chrom1 >= 0 && chrom2 >= 0) pairs[chrom1 * numChroms + chrom2] = 1;
+            }
+        }
+        for (const auto& forward : anchors.forwards) {
+            int32_t chrom = chromosomes.idForName(forward.first);
+            if (chrom >= 0 && forwardPartners[chrom] > 0) forwardAnchors[chrom] = binAnchors(forward.second);
+        }
+        for (const auto& reverse : anchors.reverses) {
+            int32_t chrom = chromosomes.idForName(reverse.first);
+            if (chrom >= 0 && reversePartners[chrom] > 0) reverseAnchors[chrom] = binAnchors(reverse.second);
+        }
+    }
+
+    // Call visit(relX, relY, count) with the contact's position relative to
+    // the window origin of the loops whose window contains (binX, binY);
+    // count is the number of loops at that origin (always 1 unless the index
+    // is implicit). Allocates nothing.
+    template <typename Visit>
+    void forEachLoopCovering(int32_t chr1, int32_t chr2, int32_t binX, int32_t binY,
+                             Visit visit) const {
+        if (implicit) {
+            forEachAnchorPairCovering(chr1, chr2, binX, binY, visit);
+            return;
+        }
+        const PairGrid* grid = findGrid(chr1, chr2);
+        if (!grid) return;
+
+        // Matching loops have originX in [binX - 2w, binX] and likewise for Y
+        const uint32_t span = static_cast<uint32_t>(2 * window);
+        int32_t firstX, lastX;
+        cellsCovering(*grid, binX, firstX, lastX);
+
+        const LoopBins* loops = loopsOf(*grid);
+        const uint32_t* cellXStart = cellStartsOf(*grid);
+        for (int32_t cx = firstX; cx <= lastX; cx++) {
+            const LoopBins* end = loops + cellXStart[cx + 1];
+            const LoopBins* loop = firstWithOriginY(loops + cellXStart[cx], end, binY - 2 * window);
+            for (; loop != end && loop->originY <= binY; ++loop) {
+                int32_t relX = binX - loop->originX;
+                if (static_cast<uint32_t>(relX) <= span) {
+                    visit(relX, binY - loop->originY, 1u);
+                }
+            }
+        }
+    }
+
+    // nullptr if no loop joins the two chromosomes (always for an implicit index)
+    const PairGrid* findGrid(int32_t chr1, int32_t chr2) const {
+        for (const auto& candidate : grids[chr1]) {
+            if (candidate.chrom2 == chr2) return &candidate;
+        }
+        return nullptr;
+    }
+
+    // Slice bins [first, last] at slice_resolution (which divides the
+    // index resolution) covered by the window starting at origin
+    void windowSliceBins(int32_t origin, int32_t slice_resolution, int32_t& first, int32_t& last) const {
+        const int32_t merge = resolution / slice_resolution;
+        first = origin * merge;
+        last = (origin + 2 * window) * merge + merge - 1;
+    }
+
+    const LoopBins* loopsOf(const PairGrid& grid) const {
+        return loopStorage.data() + grid.loopsBegin;
+    }
+
+    // numCells + 1 offsets into the pair's loops
+    const uint32_t* cellStartsOf(const PairGrid& grid) const {
+        return cellStorage.data() + grid.cellsBegin;
+    }
+
+    // Range of grid cells (relative to firstCellX) holding loops whose window
+    // can contain binX; empty if firstX > lastX
+    void cellsCovering(const PairGrid& grid, int32_t binX, int32_t& firstX, int32_t& lastX) const {
+        const int32_t numCellsX = static_cast<int32_t>(grid.numCells);
+        firstX = std::max(cellOf(binX - 2 * window) - grid.firstCellX, 0);
+        lastX = std::min(cellOf(binX) - grid.firstCellX, numCellsX - 1);
+    }
+
+    static const LoopBins* firstWithOriginY(const LoopBins* begin, const LoopBins* end, int32_t originY) {
+        return std::lower_bound(begin, end, originY,
+            [](const LoopBins& l, int32_t y) { return l.originY < y; });
+    }
+
+    // Call row(chrom, origin, sumStart, weight) for the first anchor and
+    // col(...) for the second anchor of every loop, including unmatchable
+    // ones but skipping anchors on chromosomes the slice does not contain.
+    // weight is the number of loops the call stands for.
+    template <typename Row, typename Col>
+    void forEachAnchor(Row row, Col col) const {
+        if (implicit) {
+            for (size_t chrom = 0; chrom < numChroms; chrom++) {
+                for (const auto& anchor : forwardAnchors[chrom]) {
+                    row(static_cast<int32_t>(chrom), anchor.origin, anchor.sumStart,
+                        anchor.count * forwardPartners[chrom]);
+                }
+                for (const auto& anchor : reverseAnchors[chrom]) {
+                    col(static_cast<int32_t>(chrom), anchor.origin, anchor.sumStart,
+                        anchor.count * reversePartners[chrom]);
+                }
+            }
+            return;
+        }
+        for (size_t chrom1 = 0; chrom1 < grids.size(); chrom1++) {
+            for (const auto& grid : grids[chrom1]) {
+                const LoopBins* loops = loopsOf(grid);
+                for (size_t i = 0; i < grid.numLoops; i++) {
+                    const LoopBins& loop = loops[i];
+                    row(static_cast<int32_t>(chrom1), loop.originX, loop.sumStartX, uint64_t(1));
+                    col(grid.chrom2, loop.originY, loop.sumStartY, uint64_t(1));
                 }
             }
         }
-        return nearby_loops;
+        for (const auto& loop : unmatchable) {
+            if (loop.chrom1 >= 0) row(loop.chrom1, loop.bins.originX, loop.bins.sumStartX, uint64_t(1));
+            if (loop.chrom2 >= 0) col(loop.chrom2, loop.bins.originY, loop.bins.sumStartY, uint64_t(1));
+        }
+    }
+
+    size_t memoryBytes() const {
+        size_t total = unmatchable.capacity() * sizeof(UnmatchableLoop) + pairs.capacity() +
+                       loopStorage.capacity() * sizeof(LoopBins) + cellStorage.capacity() * sizeof(uint32_t);
+        for (const auto& chrom_grids : grids) total += chrom_grids.capacity() * sizeof(PairGrid);
+        for (const auto& anchors : forwardAnchors) total += anchors.capacity() * sizeof(AnchorBins);
+        for (const auto& anchors : reverseAnchors) total += anchors.capacity() * sizeof(AnchorBins);
+        return total;
+    }
+
+private:
+    // Grid cell of a bin, rounding towards negative infinity
+    int32_t cellOf(int32_t bin) const {
+        return bin >= 0 ? bin / cellSize : -((-bin + cellSize - 1) / cellSize);
+    }
+
+    std::vector<AnchorBins> binAnchors(const std::vector<BedEntry>& entries) const {
+        std::vector<AnchorBins> binned;
+        binned.reserve(entries.size());
+        for (const auto& entry : entries) {
+            AnchorBins anchor = {LoopBins::windowOrigin(entry.start, entry.end, resolution, window),
+                                 LoopBins::sumStart(entry.start, entry.end, resolution, window), 1};
+            binned.push_back(anchor);
+        }
+        std::sort(binned.begin(), binned.end(), [](const AnchorBins& a, const AnchorBins& b) {
+            return a.origin != b.origin ? a.origin < b.origin : a.sumStart < b.sumStart;
+        });
+        size_t kept = 0;
+        for (size_t i = 0; i < binned.size(); i++) {
+            if (kept > 0 && binned[kept - 1].origin == binned[i].origin &&
+                binned[kept - 1].sumStart == binned[i].sumStart) {
+                binned[kept - 1].count++;
+            } else {
+                binned[kept++] = binned[i];
+            }
+        }
+        binned.resize(kept);
+        return binned;
+    }
+
+    template <typename Visit>
+    void forEachAnchorPairCovering(int32_t chr1, int32_t chr2, int32_t binX, int32_t binY,
+                                   Visit visit) const {
+        if (!pairs[chr1 * numChroms + chr2]) return;
+        const std::vector<AnchorBins>& forwards = forwardAnchors[chr1];
+        const std::vector<AnchorBins>& reverses = reverseAnchors[chr2];
+        auto byOrigin = [](const AnchorBins& a, int32_t origin) { return a.origin < origin; };
+        auto firstReverse = std::lower_bound(reverses.begin(), reverses.end(), binY - 2 * window, byOrigin);
+        for (auto f = std::lower_bound(forwards.begin(), forwards.end(), binX - 2 * window, byOrigin);
+             f != forwards.end() && f->origin <= binX; ++f) {
+            for (auto r = firstReverse; r != reverses.end() && r->origin <= binY; ++r) {
+                visit(binX - f->origin, binY - r->origin, f->count * r->count);
+            }
+        }
     }
 };
 
+// Anchor windows of every set go into the union bitmaps and set masks
+inline RegionsOfInterest::RegionsOfInterest(const SharedLoopIndices& all_indices,
+                                            const ChromosomeTable& chromosomes,
+                                            int32_t res,
+                                            bool inter)
+    : rowBins(chromosomes.size()), colBins(chromosomes.size()),
+      rowSets(chromosomes.size()), colSets(chromosomes.size()),
+      numSets(all_indices.size()), wordsPerBin((all_indices.size() + 63) / 64),
+      resolution(res), isInter(inter) {
+    // Size every bitmap and mask array once, from the last bin it covers
+    std::vector<int32_t> lastRow(chromosomes.size(), -1);
+    std::vector<int32_t> lastCol(chromosomes.size(), -1);
+    for (const auto& shared : all_indices) {
+        const LoopIndex& index = *shared;
+        index.forEachAnchor(
+            [&](int32_t chrom, int32_t origin, int32_t, uint64_t) {
+                int32_t first, last;
+                index.windowSliceBins(origin, res, first, last);
+                lastRow[chrom] = std::max(lastRow[chrom], last);
+            },
+            [&](int32_t chrom, int32_t origin, int32_t, uint64_t) {
+                int32_t first, last;
+                index.windowSliceBins(origin, res, first, last);
+                lastCol[chrom] = std::max(lastCol[chrom], last);
+            });
+    }
+    for (int32_t chrom = 0; chrom < chromosomes.size(); chrom++) {
+        rowBins[chrom].reserveBins(lastRow[chrom]);
+        colBins[chrom].reserveBins(lastCol[chrom]);
+        rowSets[chrom].reserveBins(lastRow[chrom], wordsPerBin);
+        colSets[chrom].reserveBins(lastCol[chrom], wordsPerBin);
+    }
+
+    for (size_t set = 0; set < all_indices.size(); set++) {
+        const LoopIndex& index = *all_indices[set];
+        index.forEachAnchor(
+            [&](int32_t chrom, int32_t origin, int32_t, uint64_t) {
+                int32_t first, last;
+                index.windowSliceBins(origin, res, first, last);
+                rowBins[chrom].setRange(first, last);
+                rowSets[chrom].addRange(first, last, set, wordsPerBin);
+            },
+            [&](int32_t chrom, int32_t origin, int32_t, uint64_t) {
+                int32_t first, last;
+                index.windowSliceBins(origin, res, first, last);
+                colBins[chrom].setRange(first, last);
+                colSets[chrom].addRange(first, last, set, wordsPerBin);
+            });
+    }
+}
+
+// Merge-join cursor over one LoopIndex for contacts streamed in bin order.
+// While the contacts of a chromosome pair arrive with non-decreasing binX,
+// and non-decreasing binY within a row, the loops whose windows can contain
+// the contact are tracked by advancing pointers rather than looked up anew.
+// Any other order just repositions the cursor, so results never depend on it.
+class LoopSweep {
+public:
+    explicit LoopSweep(const LoopIndex& loop_index)
+        : index(&loop_index), grid(nullptr), chr1(-1), chr2(-1), binX(0), binY(0), numCells(0) {}
+
+    // Same contract as LoopIndex::forEachLoopCovering
+    template <typename Visit>
+    void forEachLoopCovering(int32_t c1, int32_t c2, int32_t x, int32_t y, Visit visit) {
+        // Anchor lookups of an implicit index are cheap enough already
+        if (index->implicit) {
+            index->forEachLoopCovering(c1, c2, x, y, visit);
+            return;
+        }
+        if (c1 != chr1 || c2 != chr2) {
+            chr1 = c1;
+            chr2 = c2;
+            grid = index->findGrid(c1, c2);
+            seekRow(x, y);
+        } else if (x != binX) {
+            seekRow(x, y);
+        } else if (y < binY) {
+            seekColumn(y);
+        } else {
+            advanceColumn(y);
+        }
+
+        const uint32_t span = static_cast<uint32_t>(2 * index->window);
+        for (int i = 0; i < numCells; i++) {
+            for (const LoopBins* loop = cells[i].lo; loop != cells[i].hi; ++loop) {
+                int32_t relX = x - loop->originX;
+                if (static_cast<uint32_t>(relX) <= span) {
+                    visit(relX, y - loop->originY, 1u);
+                }
+            }
+        }
+    }
+
+private:
+    // Loops of one grid cell; [lo, hi) have originY in [binY - 2w, binY]
+    struct Cell {
+        const LoopBins* begin;
+        const LoopBins* end;
+        const LoopBins* lo;
+        const LoopBins* hi;
+    };
+
+    void seekRow(int32_t x, int32_t y) {
+        binX = x;
+        numCells = 0;
+        if (grid) {
+            int32_t firstX, lastX;
+            index->cellsCovering(*grid, x, firstX, lastX);
+            const LoopBins* loops = index->loopsOf(*grid);
+            const uint32_t* cellXStart = index->cellStartsOf(*grid);
+            for (int32_t cx = firstX; cx <= lastX; cx++) {
+                Cell& cell = cells[numCells++];
+                cell.begin = loops + cellXStart[cx];
+                cell.end = loops + cellXStart[cx + 1];
+            }
+        }
+        seekColumn(y);
+    }
+
+    void seekColumn(int32_t y) {
+        binY = y;
+        for (int i = 0; i < numCells; i++) {
+            Cell& cell = cells[i];
+            cell.lo = LoopIndex::firstWithOriginY(cell.begin, cell.end, y - 2 * index->window);
+            cell.hi = cell.lo;
+            while (cell.hi != cell.end && cell.hi->originY <= y) ++cell.hi;
+        }
+    }
+
+    void advanceColumn(int32_t y) {
+        binY = y;
+        for (int i = 0; i < numCells; i++) {
+            Cell& cell = cells[i];
+            while (cell.hi != cell.end && cell.hi->originY <= y) ++cell.hi;
+            while (cell.lo != cell.hi && cell.lo->originY < y - 2 * index->window) ++cell.lo;
+        }
+    }
+
+    const LoopIndex* index;
+    const LoopIndex::PairGrid* grid;
+    int32_t chr1;
+    int32_t chr2;
+    int32_t binX;
+    int32_t binY;
+    int numCells;
+    Cell cells[2];  // A window of 2w+1 bins overlaps at most two cells
+};
+
 // Structure to hold APA matrix
 struct APAMatrix {
-    std::vector<std::vector<float>> matrix;
+    // Rows are padded to a whole number of 64-byte lines; padding stays zero
+    static const int ALIGN_FLOATS = 16;
+
+    std::vector<float, AlignedAllocator<float, 64>> data;  // Row-major, `stride` floats per row
     int width;
-    
-    APAMatrix(int size) : width(size) {
+    int stride;
+
+    APAMatrix(int size) : width(size), stride((size + ALIGN_FLOATS - 1) / ALIGN_FLOATS * ALIGN_FLOATS) {
         if (size <= 0) {
             throw std::runtime_error("APAMatrix size must be positive");
         }
-        matrix.resize(size, std::vector<float>(size, 0.0f));
+        data.assign(static_cast<size_t>(width) * stride, 0.0f);
     }
-    
+
+    float at(int r, int c) const {
+        return data[static_cast<size_t>(r) * stride + c];
+    }
+
     void add(int relX, int relY, float value) {
         if (relX >= 0 && relX < width && relY >= 0 && relY < width) {
-            matrix[relX][relY] += value;
+            data[static_cast<size_t>(relX) * stride + relY] += value;
+        }
+    }
+
+    // Add another (per-thread) matrix of the same width into this one
+    void merge(const APAMatrix& other) {
+        for (size_t i = 0; i < data.size(); ++i) {
+            data[i] += other.data[i];
         }
     }
 
@@ -322,67 +804,305 @@ struct APAMatrix {
         }
     }
 
-    // Normalize matrix using row and column sums
-    void normalize(const std::vector<float>& rowSums, const std::vector<float>& colSums) {
-        std::vector<std::vector<float>> normalized(width, std::vector<float>(width, 0.0f));
-        
-        for (int r = 0; r < width; ++r) {
-            for (int c = 0; c < width; ++c) {
-                float normVal = rowSums[r] * colSums[c];
-                if (normVal > 0) {
-                    normalized[r][c] = matrix[r][c] / normVal;
-                }
-                // If normVal is 0, leave normalized[r][c] as 0
-            }
+    // Divide every cell by rowSums[r] * colSums[c] in place; cells whose
+    // product is not positive become 0. Uses AVX-512 or AVX2 when the CPU
+    // has them; every path produces the same bits.
+    void normalize(const std::vector<float>& rowSums, const std::vector<float>& colSums);
+
+    // The center cell over the mean of the lower-left corner, the last
+    // width / 4 rows of the first width / 4 columns (at least one cell);
+    // 0 if that mean is not positive
+    double centerEnrichment() const {
+        const int corner = std::max(1, width / 4);
+        double sum = 0;
+        for (int r = width - corner; r < width; r++) {
+            for (int c = 0; c < corner; c++) sum += at(r, c);
         }
-        
-        matrix = std::move(normalized);
+        const double mean = sum / (static_cast<double>(corner) * corner);
+        return mean > 0 ? at(width / 2, width / 2) / mean : 0.0;
     }
 
-    void save(const std::string& filename) const;
+    void save(const std::string& filename, const OutputFormat& format = OutputFormat()) const;
 };
 
-// Structure to hold coverage vectors
+// Which part of a slice a scan reads: shard index of count (0 of 1 for
+// the whole slice)
+struct SliceShard {
+    int index;
+    int count;
+};
+
+// The result for one set and config before normalization: the summed
+// matrix and the coverage sums around the loop anchors. Both are sums over
+// contacts, so the partials of the shards of a slice add up to the
+// partial of the whole slice.
+struct ApaPartial {
+    APAMatrix matrix;
+    std::vector<float> rowSums;
+    std::vector<float> colSums;
+
+    explicit ApaPartial(int width) : matrix(width), rowSums(width, 0.0f), colSums(width, 0.0f) {}
+
+    void add(const ApaPartial& other) {
+        if (other.matrix.width != matrix.width) {
+            throw std::runtime_error("Partial results of different window sizes cannot be merged");
+        }
+        matrix.merge(other.matrix);
+        for (int i = 0; i < matrix.width; i++) {
+            rowSums[i] += other.rowSums[i];
+            colSums[i] += other.colSums[i];
+        }
+    }
+
+    // Scale a sample's sums up to the whole slice
+    void scale(float factor) {
+        for (float& value : matrix.data) value *= factor;
+        for (int i = 0; i < matrix.width; i++) {
+            rowSums[i] *= factor;
+            colSums[i] *= factor;
+        }
+    }
+
+    // The matrix divided by the sums, each scaled by its average
+    APAMatrix normalized() const {
+        std::vector<float> rows(rowSums), cols(colSums);
+        APAMatrix::scaleByAverage(rows);
+        APAMatrix::scaleByAverage(cols);
+        APAMatrix result(matrix);
+        result.normalize(rows, cols);
+        return result;
+    }
+
+    // Binary, with the shard it came from and a fingerprint of its run
+    // (see IndexCache::runFingerprint) so that merges can check that every
+    // shard of one run is there once
+    void save(const std::string& filename, const SliceShard& shard, uint64_t fingerprint) const;
+    static ApaPartial load(const std::string& filename, SliceShard& shard, uint64_t& fingerprint);
+};
+
+// Coverage of the bins the normalization reads, by chromosome ID: each
+// chromosome keeps one range of bins, allocated once in a single arena.
+// Contacts on bins outside the ranges are dropped, as nothing reads them.
 struct CoverageVectors {
-    std::unordered_map<std::string, std::vector<float>> vectors;  // chrom -> coverage vector
+    struct Range {
+        int32_t first;  // Bins [first, end); empty if end <= first
+        int32_t end;
+    };
+
+    std::vector<float> arena;        // Every chromosome's range, in ID order
+    std::vector<size_t> offsets;     // chromosome ID -> its first bin in arena
+    std::vector<uint32_t> firstBins;
+    std::vector<uint32_t> numBins;
     int32_t resolution;
-    
-    CoverageVectors(int32_t res) : resolution(res) {}
-    
-    void add(const std::string& chrom, int32_t bin, float value) {
-        auto& vec = vectors[chrom];
-        if (vec.empty()) {
-            vec.resize(detail::getChromBins(chrom, resolution), 0.0f);
-        }
-        if (static_cast<size_t>(bin) >= vec.size()) {
-            size_t new_size = detail::getChromBins(chrom, resolution);
-            vec.resize(new_size, 0.0f);
-        }
-        vec[bin] += value;
-    }
-
-    void addLocalSums(std::vector<float>& sums, const std::string& chrom, 
-                     int32_t binStart) const {
-        auto it = vectors.find(chrom);
-        if (it != vectors.end()) {
-            const auto& vec = it->second;
-            for (size_t i = 0; i < sums.size(); i++) {
-                int32_t bin = binStart + static_cast<int32_t>(i);
-                if (bin >= 0 && static_cast<size_t>(bin) < vec.size()) {
-                    sums[i] += vec[bin];
-                }
+
+    // ranges by chromosome ID; negative bins are never kept
+    CoverageVectors(const std::vector<Range>& ranges, int32_t res) : resolution(res) {
+        size_t total = 0;
+        for (const auto& range : ranges) {
+            const int32_t first = std::max<int32_t>(range.first, 0);
+            const uint32_t bins = range.end > first ? static_cast<uint32_t>(range.end - first) : 0;
+            offsets.push_back(total);
+            firstBins.push_back(static_cast<uint32_t>(first));
+            numBins.push_back(bins);
+            total += bins;
+        }
+        arena.assign(total, 0.0f);
+    }
+
+    void add(int32_t chrom, int32_t bin, float value) {
+        // Negative bins wrap far out of range
+        const uint32_t i = static_cast<uint32_t>(bin) - firstBins[chrom];
+        if (i < numBins[chrom]) arena[offsets[chrom] + i] += value;
+    }
+
+    // Add another (per-thread) set of coverage vectors over the same ranges into this one
+    void merge(const CoverageVectors& other) {
+        for (size_t i = 0; i < arena.size(); i++) {
+            arena[i] += other.arena[i];
+        }
+    }
+
+    // Add the coverage of every counted window: sums[i] gets the coverage
+    // of bin start + i times the count of each start. One pass over the
+    // distinct starts, however many anchors share them.
+    void addWindowSums(std::vector<float>& sums, const WindowStarts& starts) const;
+};
+
+// How many anchors of one axis start their coverage window at each bin,
+// by chromosome ID. Only the starts whose windows of `width` bins overlap
+// the bins kept in the coverage are counted; the others sum to nothing.
+struct WindowStarts {
+    std::vector<std::vector<double>> counts;  // By start - origins[chrom]; doubles count exactly
+    std::vector<int64_t> origins;
+    int32_t width;
+
+    WindowStarts(const CoverageVectors& coverage, int32_t w) : counts(coverage.numBins.size()), width(w) {
+        for (size_t chrom = 0; chrom < counts.size(); chrom++) {
+            origins.push_back(static_cast<int64_t>(coverage.firstBins[chrom]) - (width - 1));
+            if (coverage.numBins[chrom] > 0) counts[chrom].assign(coverage.numBins[chrom] + width - 1, 0.0);
+        }
+    }
+
+    void add(int32_t chrom, int32_t start, uint64_t weight) {
+        if (chrom < 0) return;
+        const uint64_t k = static_cast<uint64_t>(start - origins[chrom]);  // Starts below the origin wrap
+        if (k < counts[chrom].size()) counts[chrom][k] += static_cast<double>(weight);
+    }
+};
+
+inline void CoverageVectors::addWindowSums(std::vector<float>& sums, const WindowStarts& starts) const {
+    const int64_t width = starts.width;
+    std::vector<double> total(width, 0.0);
+    for (size_t chrom = 0; chrom < starts.counts.size(); chrom++) {
+        const std::vector<double>& counts = starts.counts[chrom];
+        const float* bins = arena.data() + offsets[chrom];
+        const int64_t num_bins = numBins[chrom];
+        for (size_t k = 0; k < counts.size(); k++) {
+            const double count = counts[k];
+            if (count == 0) continue;
+            // The window covers kept bins [lo, lo + width)
+            const int64_t lo = static_cast<int64_t>(k) - (width - 1);
+            const int64_t first = std::max<int64_t>(0, -lo);
+            const int64_t last = std::min<int64_t>(width, num_bins - lo);
+            for (int64_t i = first; i < last; i++) {
+                total[i] += count * bins[lo + i];
             }
         }
     }
+    for (int64_t i = 0; i < width && i < static_cast<int64_t>(sums.size()); i++) {
+        sums[i] += static_cast<float>(total[i]);
+    }
+}
+
+// One aggregate to compute in the scan: the window half-width in bins,
+// with bin_merge slice bins merged into each bin
+struct ApaConfig {
+    int window_size;
+    int bin_merge;
+};
+
+// A quick approximate APA from a deterministic sample of the slice. Its
+// records are split into `every` parts, read one per round: with a block
+// index, round r reads every every-th block the scan would read of each
+// chromosome pair; without one, a slice that can be read by position
+// (uncompressed, fixed-size records) has every every-th run of 4096
+// records read from the r-th; any other slice is read whole, keeping the
+// records whose bins hash to r. The rounds read so far are scaled up to
+// the whole slice. Reading all rounds gives the exact result.
+//
+// Blocks and runs of a sorted slice each hold a narrow range of bins, so a
+// round sees the loops near those bins only: its estimate is biased
+// towards them, the more so the fewer rounds are read. Convergence is
+// only accepted once every chromosome pair of the index has had a block
+// read. It is refused for slices read whole, where reading round after
+// round would cost more than the exact scan.
+struct SampleOptions {
+    int every;         // 1 reads the slice whole
+    double tolerance;  // > 0: read rounds until no matrix's center enrichment changes by more than
+                       // this fraction between two; else only the first round is read
+
+    SampleOptions() : every(1), tolerance(0) {}
 };
 
-// Update function declaration
+// Process all contacts of a slice file against every BEDPE set.
+// With num_threads > 1 the file is read on the calling thread and record
+// batches are dealt round-robin to worker threads, each accumulating into
+// its own APAMatrix/CoverageVectors copies; the copies are summed in worker
+// order at the end. Results are deterministic for a given thread count.
+// Integer-valued contact counts (exact in float below 2^24 per cell) give
+// output bit-identical to the single-threaded run; for fractional values
+// the merged sums differ only by float reassociation, i.e. a relative error
+// on the order of 1e-6 per cell.
+//
+// The loop indices and regions of interest must fit memory_budget bytes
+// (by default 90% of the available memory). When they would not, the sets
+// are scanned a few at a time, and a set too large on its own a group of
+// chromosomes (of the first anchor) at a time, reading the slice once per
+// pass. The per-pass matrices and normalization sums are added before
+// normalizing, so only float reassociation tells the results apart.
+//
+// All configs from a single read of the slice. Returns one matrix per set
+// and config, set-major: matrices[set * configs.size() + config]. Each is
+// what a run at window_size would give on the slice with its bins merged
+// bin_merge to one (values of merged contacts summed), up to float rounding.
+//
+// With a cache, indices found in it are loaded instead of built, so the
+// tables of such sets may be left empty; indices built whole are stored.
+// With io_slots, a slot is held while the slice is read. With stats, the
+// stages and the scan's counters are added to it. With sample.every > 1
+// the result is estimated from a sample of the slice (see SampleOptions);
+// each pass of a multi-pass scan is sampled on its own.
+std::vector<APAMatrix> processSliceFile(
+    const std::string& slice_file,
+    const std::vector<BedpeTable>& all_bedpe_entries,
+    const std::vector<ApaConfig>& configs,
+    bool isInter,
+    long min_genome_dist,
+    long max_genome_dist,
+    int num_threads = 1,
+    uint64_t memory_budget = 0,
+    const IndexCache* cache = nullptr,
+    CountingSemaphore* io_slots = nullptr,
+    RunStats* stats = nullptr,
+    const SampleOptions& sample = SampleOptions());
+
+std::vector<APAMatrix> processSliceFile(
+    const std::string& slice_file,
+    const std::vector<InterAnchors>& all_anchors,
+    const std::vector<ApaConfig>& configs,
+    int num_threads = 1,
+    uint64_t memory_budget = 0,
+    const IndexCache* cache = nullptr,
+    CountingSemaphore* io_slots = nullptr,
+    RunStats* stats = nullptr,
+    const SampleOptions& sample = SampleOptions());
+
 std::vector<APAMatrix> processSliceFile(
     const std::string& slice_file, 
-    const std::vector<std::vector<BedpeEntry>>& all_bedpe_entries,
+    const std::vector<BedpeTable>& all_bedpe_entries,
     int window_size = 10,
     bool isInter = false,
     long min_genome_dist = 0,
-    long max_genome_dist = 0);
+    long max_genome_dist = 0,
+    int num_threads = 1,
+    uint64_t memory_budget = 0);
+
+// One shard of the scan the config overloads above run, returning the
+// results before normalization; add the partials of every shard and
+// normalize them for the result of the whole slice.
+std::vector<ApaPartial> processSliceShard(
+    const std::string& slice_file,
+    const std::vector<BedpeTable>& all_bedpe_entries,
+    const std::vector<ApaConfig>& configs,
+    bool isInter,
+    long min_genome_dist,
+    long max_genome_dist,
+    const SliceShard& shard,
+    int num_threads = 1,
+    uint64_t memory_budget = 0,
+    const IndexCache* cache = nullptr,
+    RunStats* stats = nullptr);
+
+std::vector<ApaPartial> processSliceShard(
+    const std::string& slice_file,
+    const std::vector<InterAnchors>& all_anchors,
+    const std::vector<ApaConfig>& configs,
+    const SliceShard& shard,
+    int num_threads = 1,
+    uint64_t memory_budget = 0,
+    const IndexCache* cache = nullptr,
+    RunStats* stats = nullptr);
+
+// Inter-chromosomal APA of sets given by their anchors (see
+// BedpeBuilder::buildInterAnchors). Matches what processSliceFile gives
+// for the materialized sets, except that loops sharing an anchor bin add
+// their contribution (and normalization sums) once, multiplied by their
+// number, so float sums can differ by rounding.
+std::vector<APAMatrix> processSliceFile(
+    const std::string& slice_file,
+    const std::vector<InterAnchors>& all_anchors,
+    int window_size = 10,
+    int num_threads = 1,
+    uint64_t memory_budget = 0);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,287 @@
+#include "batch.h"
+#include "apa.h"
+#include "index_cache.h"
+#include "run_spec.h"
+#include "scheduler.h"
+#include "stats.h"
+#include <algorithm>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <sys/stat.h>
+
+namespace {
+
+// One index some job needs, from one of the batch's loop sources
+struct IndexRequest {
+    size_t source;
+    uint64_t key;
+    ApaConfig config;
+    const SliceHeader* header;
+};
+
+struct BatchJob {
+    size_t line;  // In the manifest, for messages
+    RunSpec spec;
+    std::vector<ApaConfig> configs;
+    std::vector<uint64_t> set_hashes;
+    std::vector<IndexRequest> requests;  // Distinct keys
+};
+
+// The loops of a (BED files, distances, mode) combination, shared by every
+// job that lists it. Its indices are built by the first job that needs
+// them; a failure is kept so that the later jobs fail the same way.
+struct LoopSource {
+    BedpeSet files;  // output_file unused
+    long min_dist;
+    long max_dist;
+    bool isInter;
+    std::mutex mutex;
+    std::string error;  // Empty unless building failed
+};
+
+// Jobs of each manifest line that parses; lines that do not are reported
+// and counted in failed
+std::vector<BatchJob> readManifest(const std::string& manifest, const std::vector<int>& bin_merges,
+                                   size_t& failed) {
+    std::ifstream in(manifest);
+    if (!in) {
+        throw std::runtime_error("Could not open manifest: " + manifest);
+    }
+    std::vector<BatchJob> jobs;
+    std::string line;
+    for (size_t number = 1; std::getline(in, line); number++) {
+        std::istringstream words(line);
+        std::vector<std::string> args;
+        std::string word;
+        while (words >> word) args.push_back(word);
+        if (args.empty() || args[0][0] == '#') continue;
+
+        BatchJob job;
+        job.line = number;
+        try {
+            if (!parseRunSpec(args, job.spec)) {
+                throw std::runtime_error("wrong number of arguments");
+            }
+        } catch (const std::exception& e) {
+            failed++;
+            std::cerr << "Error: job on line " << number << " of " << manifest << ": " << e.what() << std::endl;
+            continue;
+        }
+        job.configs = runConfigs(job.spec.window_sizes, bin_merges);
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+// Run task(worker, item) for every item on num_workers threads; the first
+// exception is rethrown once all have finished
+template <typename T, typename Task>
+void runStealing(const std::vector<T>& items, size_t num_workers, Task task) {
+    WorkStealingQueues<T> queues(num_workers);
+    for (size_t i = 0; i < items.size(); i++) queues.push(i, items[i]);
+
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < num_workers; w++) {
+        workers.emplace_back([&, w] {
+            T item;
+            while (queues.pop(w, item)) {
+                try {
+                    task(w, item);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error) error = std::current_exception();
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    if (error) std::rethrow_exception(error);
+}
+
+uint64_t fileSize(const std::string& filename) {
+    struct stat st;
+    return stat(filename.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+}
+
+// Build the indices of requests (all from one source) that are in neither
+// the store nor the cache directory
+void buildIndices(LoopSource& source, const std::vector<const IndexRequest*>& requests, const IndexCache& shared,
+                  const BatchOptions& options) {
+    std::lock_guard<std::mutex> lock(source.mutex);
+    if (!source.error.empty()) throw std::runtime_error(source.error);
+    std::vector<const IndexRequest*> missing;
+    for (const auto* request : requests) {
+        if (!shared.find(request->key)) missing.push_back(request);
+    }
+    if (missing.empty()) return;
+    try {
+        BedpeBuilder builder(source.files.forward_bed, source.files.reverse_bed, source.min_dist,
+                             source.max_dist, source.isInter, options.num_threads, options.stats);
+        if (source.isInter) {
+            InterAnchors anchors = builder.buildInterAnchors();
+            StageTimer timer(options.stats, "index_build");
+            for (const auto* request : missing) {
+                shared.insert(request->key, std::make_shared<const LoopIndex>(
+                    anchors, request->header->chromosomes,
+                    request->header->resolution * request->config.bin_merge, request->config.window_size));
+            }
+        } else {
+            BedpeTable table = builder.buildBedpe();
+            StageTimer timer(options.stats, "index_build");
+            for (const auto* request : missing) {
+                shared.insert(request->key, std::make_shared<const LoopIndex>(
+                    table, request->header->chromosomes,
+                    request->header->resolution * request->config.bin_merge, request->config.window_size));
+            }
+        }
+    } catch (const std::exception& e) {
+        source.error = "loop set " + source.files.forward_bed + " " + source.files.reverse_bed + ": " + e.what();
+        throw std::runtime_error(source.error);
+    }
+}
+
+} // namespace
+
+size_t runBatch(const std::string& manifest, const BatchOptions& options) {
+    size_t failed = 0;
+    std::vector<BatchJob> all_jobs = readManifest(manifest, options.bin_merges, failed);
+    const size_t total_jobs = all_jobs.size() + failed;
+    std::cout << "Batch of " << total_jobs << " jobs from " << manifest << std::endl;
+
+    // Headers of every slice, for the resolutions and chromosomes the
+    // indices are built against; jobs whose slice cannot be opened fail here
+    std::map<std::string, SliceHeader> headers;
+    std::vector<BatchJob> jobs;
+    for (const auto& job : all_jobs) {
+        try {
+            if (!headers.count(job.spec.slice_file)) {
+                headers[job.spec.slice_file] = SliceReader::open(job.spec.slice_file)->header();
+            }
+            jobs.push_back(job);
+        } catch (const std::exception& e) {
+            failed++;
+            std::cerr << "Error: job on line " << job.line << " (" << job.spec.slice_file << "): " << e.what()
+                      << std::endl;
+        }
+    }
+
+    // Every distinct loop set, and the indices each job needs from them
+    std::vector<std::unique_ptr<LoopSource>> sources;
+    std::map<std::string, std::pair<size_t, uint64_t>> source_ids;  // name -> (source, set hash)
+    std::map<uint64_t, size_t> jobs_left;  // Index key -> jobs still to run that read it
+    for (auto& job : jobs) {
+        const SliceHeader& header = headers[job.spec.slice_file];
+        for (const auto& set : job.spec.bedpe_sets) {
+            std::string name = (job.spec.isInter ? "inter " : "intra ") + std::to_string(job.spec.min_dist) +
+                               " " + std::to_string(job.spec.max_dist) + " " + set.forward_bed + " " +
+                               set.reverse_bed;
+            auto id = source_ids.find(name);
+            if (id == source_ids.end()) {
+                sources.emplace_back(new LoopSource());
+                LoopSource& source = *sources.back();
+                source.files = set;
+                source.min_dist = job.spec.min_dist;
+                source.max_dist = job.spec.max_dist;
+                source.isInter = job.spec.isInter;
+                uint64_t hash = 0;
+                try {
+                    hash = IndexCache::hashLoopInputs(set.forward_bed, set.reverse_bed, job.spec.min_dist,
+                                                      job.spec.max_dist, job.spec.isInter);
+                } catch (const std::exception& e) {
+                    // The jobs reading the set fail when they start
+                    source.error = "loop set " + set.forward_bed + " " + set.reverse_bed + ": " + e.what();
+                }
+                id = source_ids.insert(std::make_pair(name, std::make_pair(sources.size() - 1, hash))).first;
+            }
+            job.set_hashes.push_back(id->second.second);
+            for (const auto& config : job.configs) {
+                IndexRequest request = {
+                    id->second.first,
+                    IndexCache::indexKey(id->second.second, config, header.resolution, header.chromosomes),
+                    config, &header};
+                bool seen = false;
+                for (const auto& other : job.requests) seen = seen || other.key == request.key;
+                if (seen) continue;
+                job.requests.push_back(request);
+                jobs_left[request.key]++;
+            }
+        }
+    }
+    std::cout << "Jobs read " << sources.size() << " loop sets" << std::endl;
+
+    const size_t num_workers = std::max(1, options.jobs);
+    LoopIndexStore store;
+    const IndexCache shared(options.cache_dir, std::vector<uint64_t>(), &store);
+    std::mutex jobs_left_mutex;
+
+    // Largest slices first, so that the last jobs to start are short
+    std::vector<size_t> order(jobs.size());
+    std::vector<uint64_t> sizes(jobs.size());
+    for (size_t i = 0; i < jobs.size(); i++) {
+        order[i] = i;
+        sizes[i] = fileSize(jobs[i].spec.slice_file);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    // Concurrent jobs split the memory budget. A job's indices count
+    // towards its share: they are built when the first job reading them
+    // starts and released after the last one, so only those of running
+    // jobs are resident.
+    uint64_t budget = options.memory_budget;
+    if (budget == 0) budget = static_cast<uint64_t>(detail::availableMemoryBytes() * 0.9);
+    const uint64_t job_budget = budget == 0 ? 0 : std::max<uint64_t>(budget / num_workers, 1);
+    CountingSemaphore io_slots(std::max(1, std::min(options.max_io, static_cast<int>(num_workers))));
+
+    std::mutex report_mutex;
+    runStealing(order, num_workers, [&](size_t, size_t i) {
+        const BatchJob& job = jobs[i];
+        const RunSpec& spec = job.spec;
+        try {
+            std::map<size_t, std::vector<const IndexRequest*>> by_source;
+            for (const auto& request : job.requests) by_source[request.source].push_back(&request);
+            for (const auto& entry : by_source) buildIndices(*sources[entry.first], entry.second, shared, options);
+
+            // Every index is in the store, so the jobs need no loops of their own
+            const IndexCache cache("", job.set_hashes, &store);
+            const size_t num_sets = spec.bedpe_sets.size();
+            std::vector<APAMatrix> matrices = spec.isInter
+                ? processSliceFile(spec.slice_file, std::vector<InterAnchors>(num_sets), job.configs,
+                                   options.num_threads, job_budget, &cache, &io_slots, options.stats, options.sample)
+                : processSliceFile(spec.slice_file, std::vector<BedpeTable>(num_sets), job.configs, false,
+                                   spec.min_dist, spec.max_dist, options.num_threads, job_budget, &cache,
+                                   &io_slots, options.stats, options.sample);
+            StageTimer timer(options.stats, "save");
+            std::vector<std::string> paths;
+            for (size_t m = 0; m < matrices.size(); m++) {
+                const std::string& output_file = spec.bedpe_sets[m / job.configs.size()].output_file;
+                const ApaConfig& config = job.configs[m % job.configs.size()];
+                paths.push_back(job.configs.size() == 1 ? output_file : configOutputName(output_file, config));
+            }
+            writeMatrices(matrices, paths, options.output_format, options.num_threads);
+            std::lock_guard<std::mutex> lock(report_mutex);
+            std::cout << "Job on line " << job.line << " (" << spec.slice_file << ") done" << std::endl;
+        } catch (const std::exception& e) {
+            std::lock_guard<std::mutex> lock(report_mutex);
+            failed++;
+            std::cerr << "Error: job on line " << job.line << " (" << spec.slice_file << "): " << e.what()
+                      << std::endl;
+        }
+        std::lock_guard<std::mutex> lock(jobs_left_mutex);
+        for (const auto& request : job.requests) {
+            if (--jobs_left[request.key] == 0) store.erase(request.key);
+        }
+    });
+
+    std::cout << "Batch finished: " << total_jobs - failed << " of " << total_jobs << " jobs succeeded"
+              << std::endl;
+    return failed;
+}
@@ -0,0 +1,36 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "apa.h"
+#include "matrix_writer.h"
+
+class RunStats;
+
+struct BatchOptions {
+    int jobs;                      // Slices scanned at once
+    int num_threads;               // Worker threads of each scan
+    int max_io;                    // Slices read at once, at most jobs
+    uint64_t memory_budget;        // For all jobs together; 0 for 90% of the available memory
+    std::vector<int> bin_merges;
+    std::string cache_dir;         // Empty for no on-disk index cache
+    RunStats* stats;               // Null unless the stages are timed
+    OutputFormat output_format;
+    SampleOptions sample;          // Of every job
+};
+
+// Run every job of a manifest: one per line, the positional arguments of a
+// single run (see RunSpec), with blank lines and lines starting with '#'
+// ignored. The jobs run on options.jobs workers, largest slice first, with
+// idle workers stealing queued jobs from the others. Every loop index is
+// built once, by the first job that needs it, shared by the jobs running
+// while it is held and released after the last job reading it, so
+// options.memory_budget bounds the indices of the running jobs too.
+// A job that fails, including one whose manifest line does not parse or
+// whose BED files cannot be read, is reported and the rest still run.
+// Returns the number of failed jobs.
+size_t runBatch(const std::string& manifest, const BatchOptions& options);
+
+#endif
@@ -1,36 +1,196 @@
 #include "bedpe_builder.h"
-#include <fstream>
-#include <sstream>
+#include "scheduler.h"
+#include "stats.h"
 #include <iostream>
 #include <algorithm>
 #include <stdexcept>
 #include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <functional>
+#include <mutex>
+
+namespace {
+
+// Read a whole file into memory
+std::vector<char> readFile(const std::string& filename) {
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (!file) {
+        throw std::runtime_error("Cannot open input file: " + filename);
+    }
+    std::vector<char> data;
+    char buffer[1 << 16];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        data.insert(data.end(), buffer, buffer + n);
+    }
+    bool failed = ferror(file) != 0;
+    fclose(file);
+    if (failed) {
+        throw std::runtime_error("Failed to read input file: " + filename);
+    }
+    return data;
+}
+
+bool isFieldSeparator(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Parse a decimal integer field at p, leaving p after it; false if the
+// field is not a number
+bool parseLong(const char*& p, const char* end, long& value) {
+    const char* q = p;
+    bool negative = false;
+    if (q < end && (*q == '-' || *q == '+')) negative = *q++ == '-';
+    if (q == end || !isdigit(static_cast<unsigned char>(*q))) return false;
+    long v = 0;
+    while (q < end && isdigit(static_cast<unsigned char>(*q))) {
+        v = v * 10 + (*q++ - '0');
+    }
+    if (q < end && !isFieldSeparator(*q)) return false;
+    value = negative ? -v : v;
+    p = q;
+    return true;
+}
+
+bool samePosition(const BedEntry& a, const BedEntry& b) {
+    return a.start == b.start && a.end == b.end;
+}
+
+// Drop anchors at the same position as an earlier one, keeping the list
+// sorted by midpoint; returns how many were dropped. Equal positions have
+// equal midpoints, so only runs of equal midpoint need a look.
+size_t removeDuplicateAnchors(std::vector<BedEntry>& entries) {
+    size_t kept = 0;
+    for (size_t begin = 0; begin < entries.size();) {
+        size_t end = begin + 1;
+        while (end < entries.size() && entries[end].getMid() == entries[begin].getMid()) end++;
+        if (end - begin > 1) {
+            std::sort(entries.begin() + begin, entries.begin() + end, [](const BedEntry& a, const BedEntry& b) {
+                return a.start != b.start ? a.start < b.start : a.end < b.end;
+            });
+        }
+        for (size_t i = begin; i < end; i++) {
+            if (i > begin && samePosition(entries[i], entries[kept - 1])) continue;
+            if (kept != i) entries[kept] = std::move(entries[i]);
+            kept++;
+        }
+        begin = end;
+    }
+    size_t removed = entries.size() - kept;
+    entries.resize(kept);
+    return removed;
+}
+
+// Sort the entries of one chromosome pair by (start1, start2, end1, end2).
+// An LSD radix sort on start1 << 32 | start2 orders them, skipping the
+// bytes every key shares; the rare runs of equal starts are then sorted by
+// their ends. Coordinates that do not fit 32 bits fall back to std::sort.
+void sortPairEntries(std::vector<BedpeEntry>& entries) {
+    const size_t n = entries.size();
+    if (n < 2) return;
+
+    struct KeyedIndex {
+        uint64_t key;
+        uint32_t index;
+    };
+    std::vector<KeyedIndex> keyed(n);
+    size_t counts[8][256] = {};
+    for (size_t i = 0; i < n; i++) {
+        const BedpeEntry& entry = entries[i];
+        if (entry.start1 < 0 || entry.start1 > UINT32_MAX || entry.start2 < 0 || entry.start2 > UINT32_MAX ||
+            n > UINT32_MAX) {
+            std::sort(entries.begin(), entries.end());
+            return;
+        }
+        uint64_t key = (static_cast<uint64_t>(entry.start1) << 32) | static_cast<uint64_t>(entry.start2);
+        keyed[i].key = key;
+        keyed[i].index = static_cast<uint32_t>(i);
+        for (int b = 0; b < 8; b++) counts[b][(key >> (8 * b)) & 0xff]++;
+    }
+
+    std::vector<KeyedIndex> scratch(n);
+    for (int b = 0; b < 8; b++) {
+        const int shift = 8 * b;
+        if (counts[b][(keyed[0].key >> shift) & 0xff] == n) continue;
+        size_t offsets[256];
+        size_t total = 0;
+        for (int digit = 0; digit < 256; digit++) {
+            offsets[digit] = total;
+            total += counts[b][digit];
+        }
+        for (const auto& item : keyed) scratch[offsets[(item.key >> shift) & 0xff]++] = item;
+        keyed.swap(scratch);
+    }
+
+    std::vector<BedpeEntry> sorted(n);
+    for (size_t i = 0; i < n; i++) sorted[i] = entries[keyed[i].index];
+    for (size_t begin = 0; begin < n;) {
+        size_t end = begin + 1;
+        while (end < n && keyed[end].key == keyed[begin].key) end++;
+        if (end - begin > 1) std::sort(sorted.begin() + begin, sorted.begin() + end);
+        begin = end;
+    }
+    entries.swap(sorted);
+}
+
+} // namespace
 
 BedpeBuilder::BedpeBuilder(const std::string& forward_bed, 
                           const std::string& reverse_bed,
                           long min_dist,
                           long max_dist,
-                          bool isInter)
+                          bool isInter,
+                          int num_threads,
+                          RunStats* stats)
     : forward_bed_file(forward_bed)
     , reverse_bed_file(reverse_bed)
     , min_genome_dist(min_dist)
     , max_genome_dist(max_dist)
-    , isInter(isInter) {}
+    , isInter(isInter)
+    , num_threads(num_threads)
+    , stats(stats) {}
 
 std::map<std::string, std::vector<BedEntry>> BedpeBuilder::loadBedFile(const std::string& filename) {
     std::map<std::string, std::vector<BedEntry>> bed_data;
-    std::ifstream file(filename);
-    if (!file.is_open()) {
-        throw std::runtime_error("Cannot open input file: " + filename);
-    }
-    std::string line;
-    
-    while (std::getline(file, line)) {
-        std::istringstream iss(line);
+    const std::vector<char> data = readFile(filename);
+
+    // Lines are "chrom start end ...", split on spaces or tabs. Lines
+    // without numeric start and end (blank, comments, track and browser
+    // lines) are skipped.
+    const char* p = data.data();
+    const char* end = p + data.size();
+    std::vector<BedEntry>* last_chrom = nullptr;
+    std::string chrom;
+    while (p < end) {
+        const char* line_end = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (!line_end) line_end = end;
+
+        while (p < line_end && isFieldSeparator(*p)) p++;
+        const char* chrom_begin = p;
+        while (p < line_end && !isFieldSeparator(*p)) p++;
+        const char* chrom_end = p;
         BedEntry entry;
-        iss >> entry.chrom >> entry.start >> entry.end;
-        
-        bed_data[entry.chrom].push_back(entry);
+        bool parsed = chrom_end > chrom_begin;
+        while (parsed && p < line_end && isFieldSeparator(*p)) p++;
+        parsed = parsed && parseLong(p, line_end, entry.start);
+        while (parsed && p < line_end && isFieldSeparator(*p)) p++;
+        parsed = parsed && parseLong(p, line_end, entry.end);
+
+        if (parsed) {
+            // Consecutive lines are usually on the same chromosome
+            if (!last_chrom || chrom.compare(0, std::string::npos, chrom_begin, chrom_end - chrom_begin) != 0) {
+                chrom.assign(chrom_begin, chrom_end);
+                last_chrom = &bed_data[chrom];
+            }
+            entry.chrom = chrom;
+            last_chrom->push_back(entry);
+        }
+        p = line_end + 1;
     }
     
     // Sort entries by position
@@ -45,27 +205,32 @@ std::map<std::string, std::vector<BedEntry>> BedpeBuilder::loadBedFile(const std
 }
 
 std::vector<BedpeEntry> BedpeBuilder::generateIntraChromosomal(
-    const std::string& chrom,
+    int32_t chrom,
     const std::vector<BedEntry>& forwards,
     const std::vector<BedEntry>& reverses) {
     
     std::vector<BedpeEntry> results;
-    
+
+    // Both lists are sorted by midpoint, so the reverses at a distance in
+    // (min, max] from a forward are a window that only moves right
+    size_t first = 0;
     for (const auto& forward : forwards) {
-        for (const auto& reverse : reverses) {
+        const long forward_mid = forward.getMid();
+        while (first < reverses.size() && reverses[first].getMid() - forward_mid <= min_genome_dist) {
+            first++;
+        }
+        for (size_t r = first; r < reverses.size(); r++) {
+            const BedEntry& reverse = reverses[r];
+            if (reverse.getMid() - forward_mid > max_genome_dist) break;
             if (forward.end < reverse.start) {
-                long dist = reverse.getMid() - forward.getMid();
-                
-                if (dist > min_genome_dist && dist <= max_genome_dist) {
-                    BedpeEntry bedpe;
-                    bedpe.chrom1 = chrom;
-                    bedpe.start1 = forward.start;
-                    bedpe.end1 = forward.end;
-                    bedpe.chrom2 = chrom;
-                    bedpe.start2 = reverse.start;
-                    bedpe.end2 = reverse.end;
-                    results.push_back(bedpe);
-                }
+                BedpeEntry bedpe;
+                bedpe.chrom1 = chrom;
+                bedpe.start1 = forward.start;
+                bedpe.end1 = forward.end;
+                bedpe.chrom2 = chrom;
+                bedpe.start2 = reverse.start;
+                bedpe.end2 = reverse.end;
+                results.push_back(bedpe);
             }
         }
     }
@@ -86,19 +251,12 @@ static bool isStandardChromosome(const std::string& chrom) {
     return !num.empty() && std::all_of(num.begin(), num.end(), ::isdigit);
 }
 
-std::vector<BedpeEntry> BedpeBuilder::generateInterChromosomal(
-    const std::string& chrom1,
-    const std::string& chrom2,
-    const std::vector<BedEntry>& forwards,
-    const std::vector<BedEntry>& reverses) {
-    
-    std::vector<BedpeEntry> results;
-    
+bool BedpeBuilder::isInterPair(const std::string& chrom1, const std::string& chrom2) {
     // Skip if same chromosome or non-standard chromosomes
-    if (chrom1 == chrom2 || 
-        !isStandardChromosome(chrom1) || 
+    if (chrom1 == chrom2 ||
+        !isStandardChromosome(chrom1) ||
         !isStandardChromosome(chrom2)) {
-        return results;
+        return false;
     }
 
     // Extract chromosome numbers for comparison (safe now because we validated format)
@@ -106,13 +264,20 @@ std::vector<BedpeEntry> BedpeBuilder::generateInterChromosomal(
     int chr2_num = std::stoi(chrom2.substr(3));
 
     // Only process pairs where chr1 <= chr2
-    if(chr1_num > chr2_num) {
-        return results;
-    }
+    return chr1_num <= chr2_num;
+}
+
+std::vector<BedpeEntry> BedpeBuilder::generateInterChromosomal(
+    int32_t chrom1,
+    int32_t chrom2,
+    const std::vector<BedEntry>& forwards,
+    const std::vector<BedEntry>& reverses) {
+    
+    std::vector<BedpeEntry> results;
 
     // Set variables for the forward direction only
-    std::string first_chrom = chrom1;
-    std::string second_chrom = chrom2;
+    int32_t first_chrom = chrom1;
+    int32_t second_chrom = chrom2;
     const std::vector<BedEntry>& first_entries = forwards;
     const std::vector<BedEntry>& second_entries = reverses;
 
@@ -132,54 +297,128 @@ std::vector<BedpeEntry> BedpeBuilder::generateInterChromosomal(
     return results;
 }
 
-std::vector<BedpeEntry> BedpeBuilder::buildBedpe() {
-    std::cout << "Loading forward BED file: " << forward_bed_file << std::endl;
-    auto forward_data = loadBedFile(forward_bed_file);
-    std::cout << "Loading reverse BED file: " << reverse_bed_file << std::endl;
-    auto reverse_data = loadBedFile(reverse_bed_file);
-    
-    std::vector<BedpeEntry> all_results;
+BedpeTable BedpeBuilder::buildBedpe() {
+    std::map<std::string, std::vector<BedEntry>> forward_data, reverse_data;
+    {
+        StageTimer timer(stats, "bed_load");
+        std::cout << "Loading forward BED file: " << forward_bed_file << std::endl;
+        forward_data = loadBedFile(forward_bed_file);
+        std::cout << "Loading reverse BED file: " << reverse_bed_file << std::endl;
+        reverse_data = loadBedFile(reverse_bed_file);
+    }
+    StageTimer timer(stats, "bedpe_build");
+
+    // Anchors at the same position give equal loops. Without them every
+    // (forward, reverse) pair is generated at most once, so the entries
+    // come out unique and only need sorting.
+    size_t duplicates = 0;
+    for (auto* side : {&forward_data, &reverse_data}) {
+        for (auto& chrom : *side) duplicates += removeDuplicateAnchors(chrom.second);
+    }
+    if (duplicates > 0) {
+        std::cout << "Removed " << duplicates << " duplicate anchors" << std::endl;
+    }
+
+    BedpeTable table;
+    std::map<std::string, int32_t> chrom_ids;
+    for (const auto& chrom : forward_data) chrom_ids[chrom.first] = 0;
+    for (const auto& chrom : reverse_data) chrom_ids[chrom.first] = 0;
+    for (auto& chrom : chrom_ids) {
+        chrom.second = static_cast<int32_t>(table.chromNames.size());
+        table.chromNames.push_back(chrom.first);
+    }
     
+    // One task per chromosome (pair), in the order of the final sort, so
+    // that sorting each task's entries sorts them all
+    std::vector<std::function<std::vector<BedpeEntry>()>> tasks;
     if (isInter) {
         std::cout << "Generating inter-chromosomal BEDPE entries..." << std::endl;
         for (const auto& forward_pair : forward_data) {
             for (const auto& reverse_pair : reverse_data) {
-                if (forward_pair.first != reverse_pair.first) {
-                    auto results = generateInterChromosomal(forward_pair.first,
-                                                          reverse_pair.first,
-                                                          forward_pair.second,
-                                                          reverse_pair.second);
-                    all_results.insert(all_results.end(), results.begin(), results.end());
+                if (isInterPair(forward_pair.first, reverse_pair.first)) {
+                    int32_t chrom1 = chrom_ids[forward_pair.first];
+                    int32_t chrom2 = chrom_ids[reverse_pair.first];
+                    tasks.push_back([this, chrom1, chrom2, &forward_pair, &reverse_pair] {
+                        return generateInterChromosomal(chrom1, chrom2, forward_pair.second, reverse_pair.second);
+                    });
                 }
             }
         }
     } else {
         std::cout << "Generating intra-chromosomal BEDPE entries..." << std::endl;
         for (const auto& forward_pair : forward_data) {
-            const std::string& chrom = forward_pair.first;
-            if (reverse_data.count(chrom) > 0) {
-                auto results = generateIntraChromosomal(chrom, 
-                                                      forward_pair.second,
-                                                      reverse_data[chrom]);
-                all_results.insert(all_results.end(), results.begin(), results.end());
+            auto reverse = reverse_data.find(forward_pair.first);
+            if (reverse != reverse_data.end()) {
+                int32_t chrom = chrom_ids[forward_pair.first];
+                tasks.push_back([this, chrom, &forward_pair, reverse] {
+                    return generateIntraChromosomal(chrom, forward_pair.second, reverse->second);
+                });
             }
         }
     }
-    
-    std::cout << "Sorting and removing duplicates..." << std::endl;
-    std::sort(all_results.begin(), all_results.end());
-    auto last = std::unique(all_results.begin(), all_results.end());
-    all_results.erase(last, all_results.end());
+
+    std::cout << "Sorting BEDPE entries..." << std::endl;
+    std::vector<std::vector<BedpeEntry>> task_results(tasks.size());
+    parallelFor(tasks.size(), num_threads, [&](size_t i) {
+        std::vector<BedpeEntry> results = tasks[i]();
+        sortPairEntries(results);
+        task_results[i].swap(results);
+    });
+
+    // Move every task's entries into its slice of the output
+    std::vector<size_t> offsets(task_results.size() + 1, 0);
+    for (size_t i = 0; i < task_results.size(); i++) {
+        offsets[i + 1] = offsets[i] + task_results[i].size();
+    }
+    std::vector<BedpeEntry>& all_results = table.entries;
+    all_results.resize(offsets.back());
+    parallelFor(task_results.size(), num_threads, [&](size_t i) {
+        std::copy(task_results[i].begin(), task_results[i].end(), all_results.begin() + offsets[i]);
+        std::vector<BedpeEntry>().swap(task_results[i]);
+    });
 
     std::cout << "Generated " << all_results.size() << " unique BEDPE entries" << std::endl;
-    return all_results;
+    return table;
+}
+
+InterAnchors BedpeBuilder::buildInterAnchors() {
+    InterAnchors anchors;
+    {
+        StageTimer timer(stats, "bed_load");
+        std::cout << "Loading forward BED file: " << forward_bed_file << std::endl;
+        anchors.forwards = loadBedFile(forward_bed_file);
+        std::cout << "Loading reverse BED file: " << reverse_bed_file << std::endl;
+        anchors.reverses = loadBedFile(reverse_bed_file);
+    }
+    StageTimer timer(stats, "bedpe_build");
+
+    // Anchors equal in position give equal loops, which buildBedpe
+    // deduplicates; uniquing the anchors does the same for the product
+    std::cout << "Removing duplicate anchors..." << std::endl;
+    for (auto* side : {&anchors.forwards, &anchors.reverses}) {
+        for (auto& chrom : *side) removeDuplicateAnchors(chrom.second);
+    }
+
+    uint64_t num_loops = 0;
+    for (const auto& forward_pair : anchors.forwards) {
+        for (const auto& reverse_pair : anchors.reverses) {
+            if (isInterPair(forward_pair.first, reverse_pair.first)) {
+                num_loops += static_cast<uint64_t>(forward_pair.second.size()) * reverse_pair.second.size();
+            }
+        }
+    }
+    std::cout << "Anchors describe " << num_loops << " unique inter-chromosomal BEDPE entries" << std::endl;
+    return anchors;
 }
 
 bool BedpeEntry::operator<(const BedpeEntry& other) const {
     if (chrom1 != other.chrom1) return chrom1 < other.chrom1;
     if (chrom2 != other.chrom2) return chrom2 < other.chrom2;
     if (start1 != other.start1) return start1 < other.start1;
-    return start2 < other.start2;
+    if (start2 != other.start2) return start2 < other.start2;
+    // Break ties on the ends too so that duplicates always end up adjacent
+    if (end1 != other.end1) return end1 < other.end1;
+    return end2 < other.end2;
 }
 
 bool BedpeEntry::operator==(const BedpeEntry& other) const {
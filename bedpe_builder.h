@@ -9,6 +9,8 @@
 #include <cstdint>  // For int32_t
 #include <cctype>   // For isdigit
 
+class RunStats;
+
 struct BedEntry {
     std::string chrom;
     long start;
@@ -20,11 +22,12 @@ struct BedEntry {
     }
 };
 
+// One loop; its chromosomes are indices into BedpeTable::chromNames
 struct BedpeEntry {
-    std::string chrom1;
+    int32_t chrom1;
+    int32_t chrom2;
     long start1;
     long end1;
-    std::string chrom2;
     long start2;
     long end2;
 
@@ -32,15 +35,42 @@ struct BedpeEntry {
     bool operator==(const BedpeEntry& other) const;
 };
 
+// The BEDPE entries of one set, unique and sorted by (chrom1, chrom2,
+// start1, start2, end1, end2)
+struct BedpeTable {
+    std::vector<std::string> chromNames;  // Sorted, so IDs compare like the names
+    std::vector<BedpeEntry> entries;
+
+    size_t size() const { return entries.size(); }
+};
+
+// The anchors of an inter-chromosomal set, standing for every forward x
+// reverse pair of each chromosome pair BedpeBuilder::isInterPair allows.
+// Anchors are unique and sorted by midpoint per chromosome.
+struct InterAnchors {
+    std::map<std::string, std::vector<BedEntry>> forwards;
+    std::map<std::string, std::vector<BedEntry>> reverses;
+};
+
 class BedpeBuilder {
 public:
     BedpeBuilder(const std::string& forward_bed, 
                  const std::string& reverse_bed,
                  long min_dist,
                  long max_dist,
-                 bool isInter);  // true for inter-chromosomal, false for intra-chromosomal
+                 bool isInter,  // true for inter-chromosomal, false for intra-chromosomal
+                 int num_threads = 1,
+                 RunStats* stats = nullptr);  // Times loading the BED files and building the loops
+
+    BedpeTable buildBedpe();
+
+    // Inter mode without materializing the loops: the same set buildBedpe
+    // would return, as its anchors
+    InterAnchors buildInterAnchors();
 
-    std::vector<BedpeEntry> buildBedpe();
+    // Whether inter mode pairs forward anchors on chrom1 with reverse
+    // anchors on chrom2: distinct numbered chromosomes, lower number first
+    static bool isInterPair(const std::string& chrom1, const std::string& chrom2);
 
 private:
     std::string forward_bed_file;
@@ -48,13 +78,15 @@ private:
     long min_genome_dist;
     long max_genome_dist;
     bool isInter;
+    int num_threads;
+    RunStats* stats;
 
     std::map<std::string, std::vector<BedEntry>> loadBedFile(const std::string& filename);
-    std::vector<BedpeEntry> generateIntraChromosomal(const std::string& chrom,
+    std::vector<BedpeEntry> generateIntraChromosomal(int32_t chrom,
                                                     const std::vector<BedEntry>& forwards,
                                                     const std::vector<BedEntry>& reverses);
-    std::vector<BedpeEntry> generateInterChromosomal(const std::string& chrom1,
-                                                    const std::string& chrom2,
+    std::vector<BedpeEntry> generateInterChromosomal(int32_t chrom1,
+                                                    int32_t chrom2,
                                                     const std::vector<BedEntry>& forwards,
                                                     const std::vector<BedEntry>& reverses);
 };
@@ -0,0 +1,407 @@
+#include "synthetic.h"
+#include "apa.h"
+#include "bedpe_builder.h"
+#include "slice_reader.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+// Benchmarks for apa4: synthetic inputs, microbenchmarks of the hot paths
+// and an end-to-end run. Build with ./build.sh bench.
+
+namespace {
+
+void printUsage() {
+    std::cout << "Usage: apa4_bench gen-slice [slice options] [--layout <padded20|packed16|varint|columnar>]"
+              << " [--gzip] <output.hicslice>\n"
+              << "       apa4_bench gen-bed [bed options] <forward.bed> <reverse.bed>\n"
+              << "       apa4_bench micro [slice and bed options] [--window <W>] [--only <name>]\n"
+              << "       apa4_bench e2e [slice and bed options] [--window <W>] [--threads <N>] [--gzip]"
+              << " [--repeat <N>]\n"
+              << "\tSlice options: --records <N> --resolution <bp> --chroms <N> --chrom-length <bp>\n"
+              << "\t\t--intra <fraction> --decay <exponent> --float --unsorted --seed <N>\n"
+              << "\tBed options: --anchors <per chromosome> --anchor-width <bp> --bed-seed <N>\n"
+              << "\tmicro and e2e take --min-dist and --max-dist (bp) for the intra loops\n";
+}
+
+// --name value options, and flags given as --name alone
+class Options {
+public:
+    Options(int argc, char* argv[], int first, const std::vector<std::string>& flags) {
+        for (int i = first; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.compare(0, 2, "--") != 0) {
+                positional.push_back(arg);
+            } else if (std::find(flags.begin(), flags.end(), arg) != flags.end()) {
+                values[arg] = "1";
+            } else if (i + 1 < argc) {
+                values[arg] = argv[++i];
+            } else {
+                throw std::runtime_error("Missing value for " + arg);
+            }
+        }
+    }
+
+    bool has(const std::string& name) const { return values.count(name) != 0; }
+
+    std::string text(const std::string& name, const std::string& fallback) const {
+        auto it = values.find(name);
+        return it != values.end() ? it->second : fallback;
+    }
+
+    double number(const std::string& name, double fallback) const {
+        auto it = values.find(name);
+        return it != values.end() ? std::stod(it->second) : fallback;
+    }
+
+    std::vector<std::string> positional;
+
+private:
+    std::map<std::string, std::string> values;
+};
+
+const std::vector<std::string> FLAGS = {"--float", "--unsorted", "--gzip"};
+
+SliceParams sliceParams(const Options& options) {
+    SliceParams params;
+    params.records = static_cast<uint64_t>(options.number("--records", static_cast<double>(params.records)));
+    params.resolution = static_cast<int32_t>(options.number("--resolution", params.resolution));
+    params.num_chroms = static_cast<int>(options.number("--chroms", params.num_chroms));
+    params.chrom_length =
+        static_cast<int64_t>(options.number("--chrom-length", static_cast<double>(params.chrom_length)));
+    params.intra_fraction = options.number("--intra", params.intra_fraction);
+    params.decay = options.number("--decay", params.decay);
+    params.float_values = options.has("--float");
+    params.sorted = !options.has("--unsorted");
+    params.seed = static_cast<uint64_t>(options.number("--seed", static_cast<double>(params.seed)));
+    return params;
+}
+
+BedParams bedParams(const Options& options, const SliceParams& slice) {
+    BedParams params;
+    params.num_chroms = slice.num_chroms;
+    params.chrom_length = slice.chrom_length;
+    params.anchors_per_chrom =
+        static_cast<size_t>(options.number("--anchors", static_cast<double>(params.anchors_per_chrom)));
+    params.width = static_cast<int32_t>(options.number("--anchor-width", params.width));
+    params.seed = static_cast<uint64_t>(options.number("--bed-seed", static_cast<double>(params.seed)));
+    return params;
+}
+
+RecordLayout parseLayout(const std::string& name) {
+    if (name == "padded20") return RecordLayout::Padded20;
+    if (name == "packed16") return RecordLayout::Packed16;
+    if (name == "varint") return RecordLayout::DeltaVarint;
+    if (name == "columnar") return RecordLayout::Columnar;
+    throw std::runtime_error("Unknown record layout: " + name);
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Keeps results alive so the compiler cannot drop the benchmarked work
+volatile double sink;
+
+// Run body (which does ops operations) until at least 0.5 s have passed
+// and print the time per operation
+void runBenchmark(const std::string& name, uint64_t ops, const std::function<double()>& body) {
+    body();  // Warm up
+    uint64_t runs = 0;
+    double total = 0;
+    const auto start = std::chrono::steady_clock::now();
+    do {
+        total += body();
+        runs++;
+    } while (secondsSince(start) < 0.5);
+    const double seconds = secondsSince(start);
+    sink = total;
+    const double per_op = seconds * 1e9 / (static_cast<double>(ops) * runs);
+    std::cout << std::left << std::setw(32) << name << std::right << std::setw(12) << std::fixed
+              << std::setprecision(2) << per_op << " ns/op" << std::setw(12) << 1e3 / per_op << " Mops/s"
+              << std::setw(8) << runs << " runs" << std::endl;
+    std::cout.unsetf(std::ios::fixed);
+}
+
+// A directory for generated inputs, removed with everything in it
+class TempDir {
+public:
+    TempDir() {
+        const char* base = std::getenv("TMPDIR");
+        std::string pattern = std::string(base ? base : "/tmp") + "/apa4_bench.XXXXXX";
+        std::vector<char> buffer(pattern.begin(), pattern.end());
+        buffer.push_back('\0');
+        if (!mkdtemp(buffer.data())) {
+            throw std::runtime_error("Could not create a temporary directory");
+        }
+        path = buffer.data();
+    }
+
+    ~TempDir() {
+        for (const auto& file : files) std::remove(file.c_str());
+        rmdir(path.c_str());
+    }
+
+    std::string file(const std::string& name) {
+        files.push_back(path + "/" + name);
+        return files.back();
+    }
+
+private:
+    std::string path;
+    std::vector<std::string> files;
+};
+
+// Silences the progress messages of the library while it lives
+class QuietCout {
+public:
+    QuietCout() : saved(std::cout.rdbuf(nullptr)) {}
+    ~QuietCout() {
+        std::cout.rdbuf(saved);
+        std::cout.clear();  // Writing without a buffer set badbit
+    }
+
+private:
+    std::streambuf* saved;
+};
+
+int genSlice(const Options& options) {
+    if (options.positional.size() != 1) {
+        printUsage();
+        return 1;
+    }
+    const SliceParams params = sliceParams(options);
+    const auto start = std::chrono::steady_clock::now();
+    writeSyntheticSlice(params, options.positional[0], parseLayout(options.text("--layout", "padded20")),
+                        options.has("--gzip"));
+    std::cout << "Wrote " << params.records << " records to " << options.positional[0] << " in "
+              << secondsSince(start) << " s" << std::endl;
+    return 0;
+}
+
+int genBed(const Options& options) {
+    if (options.positional.size() != 2) {
+        printUsage();
+        return 1;
+    }
+    const BedParams params = bedParams(options, sliceParams(options));
+    writeSyntheticBeds(params, options.positional[0], options.positional[1]);
+    std::cout << "Wrote " << params.anchors_per_chrom * params.num_chroms << " anchors to each of "
+              << options.positional[0] << " and " << options.positional[1] << std::endl;
+    return 0;
+}
+
+int micro(const Options& options) {
+    const SliceParams slice = sliceParams(options);
+    const BedParams bed = bedParams(options, slice);
+    const int window = static_cast<int>(options.number("--window", 10));
+    const long min_dist = static_cast<long>(options.number("--min-dist", 20000));
+    const long max_dist = static_cast<long>(options.number("--max-dist", 2000000));
+    const std::string only = options.text("--only", "");
+    auto wanted = [&](const std::string& name) { return only.empty() || name.find(only) != std::string::npos; };
+
+    TempDir dir;
+    const std::string forward = dir.file("forward.bed");
+    const std::string reverse = dir.file("reverse.bed");
+    writeSyntheticBeds(bed, forward, reverse);
+    const std::vector<ContactRecord> records = syntheticContacts(slice);
+    const uint64_t n = records.size();
+
+    BedpeTable table;
+    {
+        QuietCout quiet;
+        table = BedpeBuilder(forward, reverse, min_dist, max_dist, false).buildBedpe();
+    }
+    const ChromosomeTable chromosomes(slice.keyToName());
+    SharedLoopIndices indices(1, std::make_shared<const LoopIndex>(table, chromosomes, slice.resolution, window));
+    const RegionsOfInterest roi(indices, chromosomes, slice.resolution, false);
+    std::cout << records.size() << " records, " << table.size() << " loops, window " << window << std::endl;
+
+    std::vector<int32_t> chr1(n), chr2(n);
+    for (uint64_t i = 0; i < n; i++) {
+        chr1[i] = chromosomes.idForKey(records[i].chr1Key);
+        chr2[i] = chromosomes.idForKey(records[i].chr2Key);
+    }
+
+    if (wanted("probablyContainsRecord")) {
+        runBenchmark("probablyContainsRecord", n, [&] {
+            uint64_t hits = 0;
+            for (uint64_t i = 0; i < n; i++) {
+                hits += roi.probablyContainsRecord(chr1[i], chr2[i], records[i].binX, records[i].binY);
+            }
+            return static_cast<double>(hits);
+        });
+    }
+
+    if (wanted("forEachLoopCovering")) {
+        // Only the contacts that get this far in a scan
+        std::vector<uint64_t> candidates;
+        for (uint64_t i = 0; i < n; i++) {
+            if (roi.probablyContainsRecord(chr1[i], chr2[i], records[i].binX, records[i].binY)) {
+                candidates.push_back(i);
+            }
+        }
+        const LoopIndex& index = *indices[0];
+        runBenchmark("forEachLoopCovering", std::max<uint64_t>(candidates.size(), 1), [&] {
+            uint64_t hits = 0;
+            for (uint64_t i : candidates) {
+                index.forEachLoopCovering(chr1[i], chr2[i], records[i].binX, records[i].binY,
+                                          [&](int, int, uint32_t count) { hits += count; });
+            }
+            return static_cast<double>(hits);
+        });
+    }
+
+    const int width = 2 * window + 1;
+    if (wanted("APAMatrix::add")) {
+        std::mt19937 rng(3);
+        std::uniform_int_distribution<int> cell(0, width - 1);
+        std::vector<std::pair<int, int>> cells(1 << 16);
+        for (auto& c : cells) c = std::make_pair(cell(rng), cell(rng));
+        APAMatrix matrix(width);
+        runBenchmark("APAMatrix::add", cells.size(), [&] {
+            for (const auto& c : cells) matrix.add(c.first, c.second, 1.0f);
+            return static_cast<double>(matrix.at(0, 0));
+        });
+    }
+
+    if (wanted("APAMatrix::normalize")) {
+        std::vector<float> row_sums(width, 2.0f), col_sums(width, 3.0f);
+        APAMatrix values(width);
+        for (int r = 0; r < width; r++) {
+            for (int c = 0; c < width; c++) values.add(r, c, static_cast<float>(r + c + 1));
+        }
+        runBenchmark("APAMatrix::normalize", static_cast<uint64_t>(width) * width, [&] {
+            APAMatrix matrix(values);
+            matrix.normalize(row_sums, col_sums);
+            return static_cast<double>(matrix.at(width / 2, width / 2));
+        });
+    }
+
+    if (wanted("BedpeBuilder::buildBedpe")) {
+        runBenchmark("BedpeBuilder::buildBedpe", std::max<size_t>(table.size(), 1), [&] {
+            QuietCout quiet;
+            BedpeBuilder builder(forward, reverse, min_dist, max_dist, false);
+            return static_cast<double>(builder.buildBedpe().size());
+        });
+    }
+
+    // Decoding the fixed-size layouts and varint deltas from memory
+    typedef RecordCodec<RecordLayout::Padded20> Padded;
+    typedef RecordCodec<RecordLayout::Packed16> Packed;
+    std::vector<char> padded(n * Padded::BYTES);
+    std::vector<char> packed(n * Packed::BYTES);
+    std::vector<char> varint(n * DeltaVarintCodec::MAX_BYTES);
+    size_t varint_bytes = 0;
+    {
+        DeltaVarintCodec codec;
+        for (uint64_t i = 0; i < n; i++) {
+            Padded::encode(records[i], &padded[i * Padded::BYTES]);
+            Packed::encode(records[i], &packed[i * Packed::BYTES]);
+            varint_bytes += codec.encode(records[i], &varint[varint_bytes]);
+        }
+    }
+    if (wanted("decode padded20")) {
+        runBenchmark("decode padded20", n, [&] {
+            double sum = 0;
+            for (uint64_t i = 0; i < n; i++) sum += Padded::decode(&padded[i * Padded::BYTES]).binY;
+            return sum;
+        });
+    }
+    if (wanted("decode packed16")) {
+        runBenchmark("decode packed16", n, [&] {
+            double sum = 0;
+            for (uint64_t i = 0; i < n; i++) sum += Packed::decode(&packed[i * Packed::BYTES]).binY;
+            return sum;
+        });
+    }
+    if (wanted("decode varint")) {
+        runBenchmark("decode varint", n, [&] {
+            DeltaVarintCodec codec;
+            ContactRecord record = ContactRecord();
+            double sum = 0;
+            const char* end = varint.data() + varint_bytes;
+            for (const char* p = varint.data(); p < end;) {
+                p += codec.decode(p, end, record);
+                sum += record.binY;
+            }
+            return sum;
+        });
+    }
+    return 0;
+}
+
+int endToEnd(const Options& options) {
+    const SliceParams slice = sliceParams(options);
+    const BedParams bed = bedParams(options, slice);
+    const int window = static_cast<int>(options.number("--window", 10));
+    const int threads = static_cast<int>(options.number("--threads", 1));
+    const int repeat = std::max(1, static_cast<int>(options.number("--repeat", 3)));
+    const long min_dist = static_cast<long>(options.number("--min-dist", 20000));
+    const long max_dist = static_cast<long>(options.number("--max-dist", 2000000));
+    const bool gzip = options.has("--gzip");
+
+    TempDir dir;
+    const std::string forward = dir.file("forward.bed");
+    const std::string reverse = dir.file("reverse.bed");
+    const std::string slice_file = dir.file(gzip ? "contacts.hicslice.gz" : "contacts.hicslice");
+    writeSyntheticBeds(bed, forward, reverse);
+    writeSyntheticSlice(slice, slice_file, parseLayout(options.text("--layout", "padded20")), gzip);
+
+    std::vector<BedpeTable> tables(1);
+    {
+        QuietCout quiet;
+        tables[0] = BedpeBuilder(forward, reverse, min_dist, max_dist, false, threads).buildBedpe();
+    }
+    std::cout << slice.records << " records, " << tables[0].size() << " loops, window " << window << ", "
+              << threads << " threads" << (gzip ? ", gzip" : "") << std::endl;
+
+    double best = 0;
+    for (int run = 0; run < repeat; run++) {
+        const auto start = std::chrono::steady_clock::now();
+        {
+            QuietCout quiet;
+            std::vector<APAMatrix> matrices = processSliceFile(slice_file, tables, window, false, min_dist, max_dist,
+                                                               threads);
+            sink = matrices[0].at(window, window);
+        }
+        const double seconds = secondsSince(start);
+        best = run == 0 ? seconds : std::min(best, seconds);
+        std::cout << "run " << run + 1 << ": " << seconds << " s" << std::endl;
+    }
+    std::cout << "best " << best << " s, " << slice.records / best / 1e6 << " M records/s" << std::endl;
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    try {
+        if (argc < 2) {
+            printUsage();
+            return 1;
+        }
+        const std::string command = argv[1];
+        const Options options(argc, argv, 2, FLAGS);
+        if (command == "gen-slice") return genSlice(options);
+        if (command == "gen-bed") return genBed(options);
+        if (command == "micro") return micro(options);
+        if (command == "e2e") return endToEnd(options);
+        printUsage();
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
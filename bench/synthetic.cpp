@@ -0,0 +1,127 @@
+#include "synthetic.h"
+#include "slice_reader.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <zlib.h>
+
+namespace {
+
+// Bin distance d in [0, max_distance] with P(d) proportional to (d + 1)^-decay,
+// by inverting the continuous distribution of d + 1
+int32_t sampleDistance(std::mt19937_64& rng, int32_t max_distance, double decay) {
+    const double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    const double top = static_cast<double>(max_distance) + 1.0;
+    double x;
+    if (std::fabs(decay - 1.0) < 1e-9) {
+        x = std::pow(top, u);
+    } else {
+        const double e = 1.0 - decay;
+        x = std::pow(1.0 + u * (std::pow(top, e) - 1.0), 1.0 / e);
+    }
+    return std::min(max_distance, std::max<int32_t>(0, static_cast<int32_t>(x) - 1));
+}
+
+bool recordLess(const ContactRecord& a, const ContactRecord& b) {
+    if (a.chr1Key != b.chr1Key) return a.chr1Key < b.chr1Key;
+    if (a.chr2Key != b.chr2Key) return a.chr2Key < b.chr2Key;
+    if (a.binX != b.binX) return a.binX < b.binX;
+    return a.binY < b.binY;
+}
+
+void gzipFile(const std::string& input, const std::string& output) {
+    std::ifstream in(input, std::ios::binary);
+    gzFile out = gzopen(output.c_str(), "wb6");
+    if (!in || !out) {
+        if (out) gzclose(out);
+        throw std::runtime_error("Could not compress " + input + " to " + output);
+    }
+    std::vector<char> buffer(1 << 20);
+    bool ok = true;
+    while (ok && in) {
+        in.read(buffer.data(), buffer.size());
+        const std::streamsize n = in.gcount();
+        ok = n == 0 || gzwrite(out, buffer.data(), static_cast<unsigned>(n)) == n;
+    }
+    if (gzclose(out) != Z_OK || !ok) {
+        throw std::runtime_error("Could not write " + output);
+    }
+}
+
+} // namespace
+
+std::map<int16_t, std::string> SliceParams::keyToName() const {
+    std::map<int16_t, std::string> names;
+    for (int c = 1; c <= num_chroms; c++) names[static_cast<int16_t>(c)] = "chr" + std::to_string(c);
+    return names;
+}
+
+std::vector<ContactRecord> syntheticContacts(const SliceParams& params) {
+    if (params.num_chroms <= 0 || params.resolution <= 0 || params.chrom_length < params.resolution) {
+        throw std::runtime_error("Invalid synthetic slice parameters");
+    }
+    std::mt19937_64 rng(params.seed);
+    const int32_t bins = params.chromBins();
+    std::uniform_int_distribution<int> pick_chrom(1, params.num_chroms);
+    std::uniform_int_distribution<int32_t> pick_bin(0, bins - 1);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::geometric_distribution<int> count(0.5);
+    std::exponential_distribution<float> weight(1.0f);
+
+    std::vector<ContactRecord> records(params.records);
+    for (auto& record : records) {
+        int c1 = pick_chrom(rng);
+        int c2 = c1;
+        if (params.num_chroms > 1 && unit(rng) >= params.intra_fraction) {
+            while (c2 == c1) c2 = pick_chrom(rng);
+            if (c2 < c1) std::swap(c1, c2);
+            record.binX = pick_bin(rng);
+            record.binY = pick_bin(rng);
+        } else {
+            const int32_t d = sampleDistance(rng, bins - 1, params.decay);
+            record.binX = std::uniform_int_distribution<int32_t>(0, bins - 1 - d)(rng);
+            record.binY = record.binX + d;
+        }
+        record.chr1Key = static_cast<int16_t>(c1);
+        record.chr2Key = static_cast<int16_t>(c2);
+        record.value = params.float_values ? weight(rng) : static_cast<float>(1 + count(rng));
+    }
+    if (params.sorted) std::sort(records.begin(), records.end(), recordLess);
+    return records;
+}
+
+void writeSyntheticSlice(const SliceParams& params, const std::string& filename, RecordLayout layout, bool gzip) {
+    const std::vector<ContactRecord> records = syntheticContacts(params);
+    const std::string raw = gzip ? filename + ".raw" : filename;
+    {
+        SliceWriter writer(raw, params.resolution, params.keyToName(), layout);
+        for (const auto& record : records) writer.write(record);
+        writer.finish(params.sorted ? SLICE_FLAG_SORTED : 0);
+    }
+    if (gzip) {
+        gzipFile(raw, filename);
+        std::remove(raw.c_str());
+    }
+}
+
+void writeSyntheticBeds(const BedParams& params, const std::string& forward_bed, const std::string& reverse_bed) {
+    std::mt19937_64 rng(params.seed);
+    std::uniform_int_distribution<int64_t> pick_start(0, std::max<int64_t>(0, params.chrom_length - params.width));
+    for (const std::string* filename : {&forward_bed, &reverse_bed}) {
+        std::ofstream out(*filename);
+        for (int c = 1; c <= params.num_chroms; c++) {
+            std::vector<int64_t> starts(params.anchors_per_chrom);
+            for (auto& start : starts) start = pick_start(rng);
+            std::sort(starts.begin(), starts.end());
+            for (int64_t start : starts) {
+                out << "chr" << c << '\t' << start << '\t' << start + params.width << '\n';
+            }
+        }
+        if (!out) {
+            throw std::runtime_error("Could not write " + *filename);
+        }
+    }
+}
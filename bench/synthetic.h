@@ -0,0 +1,52 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include "record_layout.h"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Shape of a synthetic Hi-C slice: chromosomes chr1..chrN of equal length,
+// keyed 1..N. Intra contacts are d bins apart with probability falling as
+// (d + 1)^-decay; inter contacts pick both bins uniformly.
+struct SliceParams {
+    uint64_t records;
+    int32_t resolution;
+    int num_chroms;
+    int64_t chrom_length;   // bp
+    double intra_fraction;
+    double decay;
+    bool float_values;      // Else small integer counts
+    bool sorted;            // Records ordered by (chr1Key, chr2Key, binX, binY) and flagged sorted
+    uint64_t seed;
+
+    SliceParams()
+        : records(1000000), resolution(5000), num_chroms(4), chrom_length(100000000), intra_fraction(0.9),
+          decay(1.0), float_values(false), sorted(true), seed(1) {}
+
+    int32_t chromBins() const { return static_cast<int32_t>(chrom_length / resolution) + 1; }
+    std::map<int16_t, std::string> keyToName() const;
+};
+
+// Anchors of a synthetic BED pair: anchors_per_chrom forward and as many
+// reverse anchors per chromosome, width bp wide, at uniform positions
+struct BedParams {
+    int num_chroms;
+    int64_t chrom_length;
+    size_t anchors_per_chrom;
+    int32_t width;
+    uint64_t seed;
+
+    BedParams() : num_chroms(4), chrom_length(100000000), anchors_per_chrom(1000), width(1000), seed(2) {}
+};
+
+std::vector<ContactRecord> syntheticContacts(const SliceParams& params);
+
+// Write the contacts to a slice file in the given layout; with gzip the
+// whole file is gzip-compressed, as the reader accepts
+void writeSyntheticSlice(const SliceParams& params, const std::string& filename, RecordLayout layout, bool gzip);
+
+void writeSyntheticBeds(const BedParams& params, const std::string& forward_bed, const std::string& reverse_bed);
+
+#endif
@@ -1,9 +1,22 @@
 #!/bin/bash
 
-# Compile with C++11 support and all necessary warnings
-g++ -std=c++11 -Wall -Wextra -o apa4 main.cpp apa.cpp bedpe_builder.cpp -lz
+# Compile with C++11 support, optimizations and all necessary warnings
+g++ -std=c++11 -O2 -pthread -Wall -Wextra -o apa4 main.cpp apa.cpp bedpe_builder.cpp slice_reader.cpp index_cache.cpp run_spec.cpp batch.cpp stats.cpp matrix_writer.cpp -lz
+
+# Benchmarks: "./build.sh bench" also builds apa4_bench (synthetic inputs,
+# microbenchmarks and an end-to-end run; see bench/bench.cpp)
+if [ "$1" = "bench" ]; then
+    g++ -std=c++11 -O2 -pthread -Wall -Wextra -I. -o apa4_bench bench/bench.cpp bench/synthetic.cpp apa.cpp bedpe_builder.cpp slice_reader.cpp index_cache.cpp stats.cpp matrix_writer.cpp -lz
+fi
+
+# Tests: the same sources also build with CMake, which adds round-trip and
+# equivalence tests under tests/ run by ctest:
+# cmake -S . -B build && cmake --build build && ctest --test-dir build
 
 # Example usage:
 # ./apa4 intra 5000 50000 100 data.hicslice forward.bed reverse.bed output.txt
 # ./apa4 inter 0 0 100 data.hicslice forward.bed reverse.bed output.txt
+# ./apa4 --threads 16 intra 5000 50000 100 data.hicslice forward.bed reverse.bed output.txt
+# ./apa4_bench micro --records 2000000 --anchors 2000
+# ./apa4_bench e2e --records 10000000 --threads 4
 
@@ -0,0 +1,409 @@
+#include "index_cache.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+const char CACHE_MAGIC[8] = {'A', 'P', 'A', 'I', 'N', 'D', 'E', 'X'};
+const uint32_t CACHE_VERSION = 1;
+const uint32_t BYTE_ORDER_MARK = 0x01020304;  // Files are in host byte order
+
+// 64-bit FNV-1a
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+void fnvAdd(uint64_t& hash, const void* data, size_t n) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < n; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+}
+
+void fnvAddInt(uint64_t& hash, int64_t value) {
+    char bytes[8];
+    storeLE64(bytes, static_cast<uint64_t>(value));
+    fnvAdd(hash, bytes, 8);
+}
+
+// Length first, so that adjacent strings hash apart from their concatenation
+void fnvAddString(uint64_t& hash, const std::string& text) {
+    fnvAddInt(hash, static_cast<int64_t>(text.size()));
+    fnvAdd(hash, text.data(), text.size());
+}
+
+void fnvAddFile(uint64_t& hash, const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Could not open file: " + filename);
+    }
+    std::vector<char> buffer(1 << 20);
+    int64_t total = 0;
+    while (file) {
+        file.read(buffer.data(), buffer.size());
+        fnvAdd(hash, buffer.data(), static_cast<size_t>(file.gcount()));
+        total += file.gcount();
+    }
+    fnvAddInt(hash, total);
+}
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t key;
+    int32_t resolution;
+    int32_t window;
+    int32_t cellSize;
+    uint32_t implicit;
+    uint64_t numChroms;
+};
+
+// A LoopIndex::PairGrid with the chrom1 it is filed under
+struct GridRecord {
+    int32_t chrom1;
+    int32_t chrom2;
+    int32_t firstCellX;
+    int32_t unused;
+    uint64_t loopsBegin;
+    uint64_t numLoops;
+    uint64_t cellsBegin;
+    uint64_t numCells;
+};
+
+// Every array is its uint64_t length and the elements, padded to 8 bytes
+template <typename T>
+void writeArray(std::ostream& out, const T* data, uint64_t count) {
+    static const char zeros[8] = {0};
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char*>(data), count * sizeof(T));
+    out.write(zeros, (8 - count * sizeof(T) % 8) % 8);
+}
+
+template <typename T>
+void writeArray(std::ostream& out, const std::vector<T>& values) {
+    writeArray(out, values.data(), values.size());
+}
+
+// Per-chromosome arrays as offsets [numChroms + 1] and the concatenation
+template <typename T>
+void writeNested(std::ostream& out, const std::vector<std::vector<T>>& nested) {
+    std::vector<uint64_t> offsets(1, 0);
+    std::vector<T> flat;
+    for (const auto& values : nested) {
+        flat.insert(flat.end(), values.begin(), values.end());
+        offsets.push_back(flat.size());
+    }
+    writeArray(out, offsets);
+    writeArray(out, flat);
+}
+
+// Bounds-checked walk over a mapped cache file
+class CacheCursor {
+public:
+    CacheCursor(const char* data, size_t length) : data(data), length(length), offset(0) {}
+
+    bool read(void* dst, size_t n) {
+        if (length - offset < n) return false;
+        std::memcpy(dst, data + offset, n);
+        offset += n;
+        return true;
+    }
+
+    template <typename T>
+    bool readArray(std::vector<T>& values) {
+        uint64_t count;
+        if (!read(&count, sizeof(count)) || count > (length - offset) / sizeof(T)) return false;
+        values.resize(count);
+        if (!read(values.data(), count * sizeof(T))) return false;
+        const size_t padding = (8 - count * sizeof(T) % 8) % 8;
+        if (length - offset < padding) return false;
+        offset += padding;
+        return true;
+    }
+
+    template <typename T>
+    bool readNested(std::vector<std::vector<T>>& nested) {
+        std::vector<uint64_t> offsets;
+        std::vector<T> flat;
+        if (!readArray(offsets) || !readArray(flat) || offsets.empty()) return false;
+        nested.assign(offsets.size() - 1, std::vector<T>());
+        for (size_t i = 0; i < nested.size(); i++) {
+            if (offsets[i] > offsets[i + 1] || offsets[i + 1] > flat.size()) return false;
+            nested[i].assign(flat.begin() + offsets[i], flat.begin() + offsets[i + 1]);
+        }
+        return true;
+    }
+
+    bool atEnd() const { return offset == length; }
+
+private:
+    const char* data;
+    size_t length;
+    size_t offset;
+};
+
+// Read-only mapping of a whole file; empty if it cannot be mapped
+struct MappedFile {
+    const char* data;
+    size_t length;
+
+    explicit MappedFile(const std::string& filename) : data(nullptr), length(0) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* base = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (base != MAP_FAILED) {
+                data = static_cast<const char*>(base);
+                length = static_cast<size_t>(st.st_size);
+                madvise(base, length, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (data) munmap(const_cast<char*>(data), length);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+
+bool validHeader(const CacheHeader& header, uint64_t key) {
+    return std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+           header.version == CACHE_VERSION && header.byteOrder == BYTE_ORDER_MARK && header.key == key &&
+           header.resolution > 0 && header.window > 0 && header.cellSize == 2 * header.window + 1;
+}
+
+} // namespace
+
+IndexCache::IndexCache(const std::string& directory, const std::vector<uint64_t>& set_hashes,
+                       LoopIndexStore* store)
+    : directory(directory), setHashes(set_hashes), store(store) {
+    if (!directory.empty() && mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST) {
+        throw std::runtime_error("Could not create index cache directory: " + directory);
+    }
+}
+
+uint64_t IndexCache::hashLoopInputs(const std::string& forward_bed, const std::string& reverse_bed,
+                                    long min_genome_dist, long max_genome_dist, bool isInter) {
+    uint64_t hash = FNV_OFFSET;
+    fnvAddFile(hash, forward_bed);
+    fnvAddFile(hash, reverse_bed);
+    fnvAddInt(hash, min_genome_dist);
+    fnvAddInt(hash, max_genome_dist);
+    fnvAddInt(hash, isInter ? 1 : 0);
+    return hash;
+}
+
+uint64_t IndexCache::runFingerprint(uint64_t index_key, const std::string& slice_file) {
+    std::ifstream file(slice_file, std::ios::binary | std::ios::ate);
+    if (!file) {
+        throw std::runtime_error("Could not open file: " + slice_file);
+    }
+    const int64_t size = static_cast<int64_t>(file.tellg());
+    const int64_t chunk = std::min<int64_t>(size, 1 << 20);
+    std::vector<char> buffer(static_cast<size_t>(chunk));
+    uint64_t hash = FNV_OFFSET;
+    fnvAddInt(hash, static_cast<int64_t>(index_key));
+    fnvAddInt(hash, size);
+    const int64_t offsets[2] = {0, size - chunk};
+    for (int64_t offset : offsets) {
+        file.seekg(offset);
+        if (!file.read(buffer.data(), chunk)) {
+            throw std::runtime_error("Could not read file: " + slice_file);
+        }
+        fnvAdd(hash, buffer.data(), buffer.size());
+    }
+    return hash;
+}
+
+uint64_t IndexCache::indexKey(uint64_t set_hash, const ApaConfig& config, int32_t resolution,
+                              const ChromosomeTable& chromosomes) {
+    uint64_t hash = FNV_OFFSET;
+    fnvAddInt(hash, static_cast<int64_t>(set_hash));
+    fnvAddInt(hash, config.window_size);
+    fnvAddInt(hash, config.bin_merge);
+    fnvAddInt(hash, resolution);
+    // Chromosome IDs index the arrays, so the slice's names are part of the key
+    fnvAddInt(hash, chromosomes.size());
+    for (const auto& name : chromosomes.names) fnvAddString(hash, name);
+    return hash;
+}
+
+std::string IndexCache::pathFor(uint64_t key) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.apaidx", static_cast<unsigned long long>(key));
+    return directory + "/" + name;
+}
+
+std::shared_ptr<const LoopIndex> IndexCache::held(uint64_t key) const {
+    std::shared_ptr<const LoopIndex> index = store ? store->find(key) : nullptr;
+    return index ? index : loaded.find(key);
+}
+
+bool IndexCache::contains(uint64_t key) const {
+    if (held(key)) return true;
+    if (directory.empty()) return false;
+    std::shared_ptr<LoopIndex> index(new LoopIndex());
+    if (!loadFile(key, *index)) return false;
+    if (store) {
+        store->insert(key, index);
+    } else {
+        loaded.insert(key, index);
+    }
+    return true;
+}
+
+uint64_t IndexCache::cachedBytes(uint64_t key) const {
+    std::shared_ptr<const LoopIndex> index = contains(key) ? held(key) : nullptr;
+    return index ? sizeof(LoopIndex) + index->memoryBytes() : 0;
+}
+
+std::shared_ptr<const LoopIndex> IndexCache::find(uint64_t key) const {
+    std::shared_ptr<const LoopIndex> index = store ? store->find(key) : nullptr;
+    if (index) return index;
+    index = loaded.find(key);
+    if (index) {
+        loaded.erase(key);
+    } else {
+        if (directory.empty()) return nullptr;
+        std::shared_ptr<LoopIndex> read(new LoopIndex());
+        if (!loadFile(key, *read)) return nullptr;
+        index = read;
+    }
+    if (store) store->insert(key, index);
+    return index;
+}
+
+void IndexCache::insert(uint64_t key, const std::shared_ptr<const LoopIndex>& index) const {
+    if (store) store->insert(key, index);
+    if (!directory.empty()) storeFile(key, *index);
+}
+
+bool IndexCache::loadFile(uint64_t key, LoopIndex& index) const {
+    const std::string path = pathFor(key);
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    if (readFile(path, key, index)) return true;
+    // Damaged or stale: remove it, so that the index is built and stored again
+    std::cerr << "Warning: removing unreadable index cache file " << path << std::endl;
+    std::remove(path.c_str());
+    return false;
+}
+
+bool IndexCache::readFile(const std::string& path, uint64_t key, LoopIndex& index) const {
+    MappedFile file(path);
+    if (!file.data) return false;
+    CacheCursor cursor(file.data, file.length);
+    CacheHeader header;
+    if (!cursor.read(&header, sizeof(header)) || !validHeader(header, key)) return false;
+
+    LoopIndex loaded;
+    loaded.resolution = header.resolution;
+    loaded.window = header.window;
+    loaded.cellSize = header.cellSize;
+    loaded.implicit = header.implicit != 0;
+    loaded.numChroms = static_cast<size_t>(header.numChroms);
+
+    std::vector<GridRecord> grids;
+    if (!cursor.readArray(loaded.loopStorage) || !cursor.readArray(loaded.cellStorage) ||
+        !cursor.readArray(loaded.unmatchable) || !cursor.readArray(grids) ||
+        !cursor.readArray(loaded.pairs) || !cursor.readArray(loaded.forwardPartners) ||
+        !cursor.readArray(loaded.reversePartners) ||
+        !cursor.readNested(loaded.forwardAnchors) || !cursor.readNested(loaded.reverseAnchors) ||
+        !cursor.atEnd()) {
+        return false;
+    }
+    if (loaded.implicit && (loaded.pairs.size() != loaded.numChroms * loaded.numChroms ||
+                            loaded.forwardPartners.size() != loaded.numChroms ||
+                            loaded.reversePartners.size() != loaded.numChroms ||
+                            loaded.forwardAnchors.size() != loaded.numChroms ||
+                            loaded.reverseAnchors.size() != loaded.numChroms)) {
+        return false;
+    }
+
+    loaded.grids.assign(loaded.numChroms, std::vector<LoopIndex::PairGrid>());
+    for (const auto& record : grids) {
+        if (record.chrom1 < 0 || static_cast<size_t>(record.chrom1) >= loaded.numChroms ||
+            record.chrom2 < 0 || static_cast<size_t>(record.chrom2) >= loaded.numChroms ||
+            record.numLoops == 0 || record.loopsBegin + record.numLoops > loaded.loopStorage.size() ||
+            record.cellsBegin + record.numCells + 1 > loaded.cellStorage.size()) {
+            return false;
+        }
+        LoopIndex::PairGrid grid;
+        grid.chrom2 = record.chrom2;
+        grid.firstCellX = record.firstCellX;
+        grid.loopsBegin = static_cast<size_t>(record.loopsBegin);
+        grid.numLoops = static_cast<size_t>(record.numLoops);
+        grid.cellsBegin = static_cast<size_t>(record.cellsBegin);
+        grid.numCells = static_cast<size_t>(record.numCells);
+        loaded.grids[record.chrom1].push_back(grid);
+    }
+
+    index = std::move(loaded);
+    return true;
+}
+
+void IndexCache::storeFile(uint64_t key, const LoopIndex& index) const {
+    const std::string path = pathFor(key);
+    const std::string temp = path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "Warning: could not write index cache file " << temp << std::endl;
+            return;
+        }
+
+        CacheHeader header;
+        std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        header.version = CACHE_VERSION;
+        header.byteOrder = BYTE_ORDER_MARK;
+        header.key = key;
+        header.resolution = index.resolution;
+        header.window = index.window;
+        header.cellSize = index.cellSize;
+        header.implicit = index.implicit ? 1 : 0;
+        header.numChroms = index.numChroms;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        std::vector<GridRecord> grids;
+        for (size_t chrom1 = 0; chrom1 < index.grids.size(); chrom1++) {
+            for (const auto& grid : index.grids[chrom1]) {
+                GridRecord record = {static_cast<int32_t>(chrom1), grid.chrom2, grid.firstCellX, 0,
+                                     grid.loopsBegin, grid.numLoops, grid.cellsBegin, grid.numCells};
+                grids.push_back(record);
+            }
+        }
+        writeArray(out, index.loopStorage);
+        writeArray(out, index.cellStorage);
+        writeArray(out, index.unmatchable);
+        writeArray(out, grids);
+        writeArray(out, index.pairs);
+        writeArray(out, index.forwardPartners);
+        writeArray(out, index.reversePartners);
+        writeNested(out, index.forwardAnchors);
+        writeNested(out, index.reverseAnchors);
+        if (!out.flush()) {
+            std::cerr << "Warning: could not write index cache file " << temp << std::endl;
+            out.close();
+            std::remove(temp.c_str());
+            return;
+        }
+    }
+    if (std::rename(temp.c_str(), path.c_str()) != 0) {
+        std::cerr << "Warning: could not write index cache file " << path << std::endl;
+        std::remove(temp.c_str());
+    }
+}
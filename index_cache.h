@@ -0,0 +1,106 @@
+#ifndef INDEX_CACHE_H
+#define INDEX_CACHE_H
+
+#include "apa.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Loop indices built or loaded in this process, shared by every scan that
+// asks for the same key (batch runs over many slices). Thread-safe.
+class LoopIndexStore {
+public:
+    // nullptr if there is none
+    std::shared_ptr<const LoopIndex> find(uint64_t key) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = indices.find(key);
+        return it != indices.end() ? it->second : nullptr;
+    }
+
+    void insert(uint64_t key, const std::shared_ptr<const LoopIndex>& index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        indices[key] = index;
+    }
+
+    // Scans still holding the index keep it alive
+    void erase(uint64_t key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        indices.erase(key);
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::map<uint64_t, std::shared_ptr<const LoopIndex>> indices;
+};
+
+// LoopIndexes kept between runs, one per set and config, under a hash of
+// everything the index is built from: the BED contents, distances and mode
+// (the set's input hash), the window, bin merge and resolution, and the
+// slice's chromosome names. Indices live in files in the directory, flat
+// arrays that are mapped and copied straight into the index, and/or in a
+// LoopIndexStore; either may be left out.
+class IndexCache {
+public:
+    // set_hashes[set] is hashLoopInputs() of each set
+    IndexCache(const std::string& directory, const std::vector<uint64_t>& set_hashes,
+               LoopIndexStore* store = nullptr);
+
+    // Hash of the BED files' bytes and the options that shape their loops
+    static uint64_t hashLoopInputs(const std::string& forward_bed, const std::string& reverse_bed,
+                                   long min_genome_dist, long max_genome_dist, bool isInter);
+
+    static uint64_t indexKey(uint64_t set_hash, const ApaConfig& config, int32_t resolution,
+                             const ChromosomeTable& chromosomes);
+
+    // What a shard's partial result is part of: the index key of its set
+    // and config, and the slice's size and its first and last megabyte
+    // (hashing all of a large slice would cost a scan)
+    static uint64_t runFingerprint(uint64_t index_key, const std::string& slice_file);
+
+    uint64_t key(size_t set, const ApaConfig& config, int32_t resolution,
+                 const ChromosomeTable& chromosomes) const {
+        return indexKey(setHashes[set], config, resolution, chromosomes);
+    }
+
+    // True if the store holds the key or its file loads. The whole file is
+    // read, so that a run told yes can rely on find(); a file that does not
+    // load is removed. The loaded index is added to the store, or kept
+    // until find() takes it or release() drops it, so a run that checks,
+    // plans and scans reads each file once.
+    bool contains(uint64_t key) const;
+
+    // Memory of the index, loading it as contains() does; 0 if it is not
+    // cached
+    uint64_t cachedBytes(uint64_t key) const;
+
+    // The index from the store or kept by contains(), else from its file
+    // (then also added to the store); nullptr if there is neither, or the
+    // file is stale or truncated (it is then removed). A kept index is
+    // handed over, so a run holds it only while it scans with it.
+    std::shared_ptr<const LoopIndex> find(uint64_t key) const;
+
+    // Drop an index kept by contains(); find() then reads its file again
+    void release(uint64_t key) const { loaded.erase(key); }
+
+    // Add to the store and write the file. Files go through a temporary
+    // renamed into place, so concurrent runs never see a partial file;
+    // failing to write one only prints a warning.
+    void insert(uint64_t key, const std::shared_ptr<const LoopIndex>& index) const;
+
+private:
+    std::string pathFor(uint64_t key) const;
+    std::shared_ptr<const LoopIndex> held(uint64_t key) const;
+    bool loadFile(uint64_t key, LoopIndex& index) const;
+    bool readFile(const std::string& path, uint64_t key, LoopIndex& index) const;
+    void storeFile(uint64_t key, const LoopIndex& index) const;
+
+    std::string directory;  // Empty for no files
+    std::vector<uint64_t> setHashes;
+    LoopIndexStore* store;
+    mutable LoopIndexStore loaded;  // Loaded by contains() without a store
+};
+
+#endif
@@ -1,10 +1,15 @@
 #include "bedpe_builder.h"
 #include "apa.h"
+#include "index_cache.h"
+#include "run_spec.h"
+#include "batch.h"
+#include "stats.h"
+#include <fstream>
 #include <iostream>
 #include <string>
-#include <fstream>
 #include <stdexcept>
 #include <cstdint>
+#include <vector>
 
 // APA4 Aggregate Peak Analysis
 // first generate a bedpe file of all potential loop locations from bed files
@@ -12,112 +17,360 @@
 // add up the total counts for all reads that overlap a loop
 // output the total counts
 void printUsage() {
-    std::cout << "Usage: apa4 <inter|intra> <min_genome_dist> <max_genome_dist> <window_size> "
+    std::cout << "Usage: apa4 [options] <inter|intra> <min_genome_dist> <max_genome_dist> <window_size> "
               << "<hic_slice_file> [<forward.bed> <reverse.bed> <output.txt>]...\n"
+              << "\tOptions:\n"
+              << "\t\t--threads <N> number of worker threads for contact processing (default 1)\n"
+              << "\t\t--max-memory <GB> memory for loop lookup structures (default 90% of available);\n"
+              << "\t\t\tlarger sets are scanned in several passes over the slice\n"
+              << "\t\t--bin-merge <M[,M...]> also aggregate with M slice bins merged into one (default 1)\n"
+              << "\t\t--index-cache <dir> keep built loop indices in dir and reuse them when the BED files,\n"
+              << "\t\t\tdistances, mode, window, merge and slice resolution and chromosomes match\n"
+              << "\t\t--jobs <N> batch only: slices scanned at once (default 1)\n"
+              << "\t\t--max-io <N> batch only: slices read at once (default the number of jobs)\n"
+              << "\t\t--stats <file.json> write the wall and CPU time of each stage, scan throughput,\n"
+              << "\t\t\tfilter rejection rates and peak memory as JSON\n"
+              << "\t\t--output-format <text|f32|npy>[.gz] how matrices are written (default text): 6-decimal\n"
+              << "\t\t\ttext, raw little-endian float32 after an 'APAMF32' magic and the width, or NumPy .npy;\n"
+              << "\t\t\ta .gz suffix gzip-compresses the file. Several outputs are written at once\n"
+              << "\t\t--sample <K> approximate APA from 1/K of the slice: every K-th indexed block of each\n"
+              << "\t\t\tchromosome pair, without a block index every K-th run of 4096 records, or for\n"
+              << "\t\t\tcompressed or varint/columnar slices the records whose bins hash to the same 1/K\n"
+              << "\t\t\t(reading the whole file), scaled up to the whole slice. Blocks and runs of a sorted\n"
+              << "\t\t\tslice hold narrow bin ranges, so a sample only sees the loops near them and is biased\n"
+              << "\t\t\ttowards them; the bias shrinks as more of the slice is read\n"
+              << "\t\t--converge <tolerance> with --sample, keep reading the next 1/K of the slice until no\n"
+              << "\t\t\tmatrix's center enrichment changes by more than tolerance (e.g. 0.01) between rounds;\n"
+              << "\t\t\tnot for slices --sample reads whole\n"
+              << "\t\t--shard <K>/<N> read only shard K (from 0) of N of the slice and write the unnormalized\n"
+              << "\t\t\tpartial results to the outputs; combine the shards with 'apa4 merge'. Shards read equal\n"
+              << "\t\t\tshares of the indexed blocks a run wants, or of the records of an uncompressed slice\n"
+              << "\t\t\twith fixed-size records; shards of other slices each read the whole file\n"
               << "\tCreate potential loop locations using the anchors\n"
               << "\t\t'inter' for inter-chromosomal features\n"
               << "\t\t'intra' for intra-chromosomal features\n"
               << "\t\t<min_genome_dist> minimum genomic distance for loops\n"
               << "\t\t<max_genome_dist> maximum genomic distance for loops\n"
-              << "\t\t<window_size> window size around loop\n"
+              << "\t\t<window_size> window size around loop, or a comma-separated list of them;\n"
+              << "\t\t\twith several window sizes or merge factors all are computed from one read\n"
+              << "\t\t\tof the slice and each output gets a _w<window>_b<merge> suffix\n"
               << "\t\t<hic_slice_file> path to the HiC slice file\n"
-              << "\t\t<forward.bed> <reverse.bed> <output.txt> triplets (can have multiple)\n";
+              << "\t\t<forward.bed> <reverse.bed> <output.txt> triplets (can have multiple)\n"
+              << "       apa4 [options] batch <manifest>\n"
+              << "\tRun many jobs in one process, one per manifest line, each line holding the arguments\n"
+              << "\tof a single run from <inter|intra> on ('#' starts a comment line). Loop indices are\n"
+              << "\tbuilt once and shared by every job\n"
+              << "       apa4 merge [--output-format <format>] <output.txt> <partial>...\n"
+              << "\tAdd up the partial results of every shard of a run and save the normalized matrix\n"
+              << "       apa4 index <hic_slice_file>\n"
+              << "\tAdd a block index to an uncompressed slice file so later runs\n"
+              << "\tonly read the chromosome pairs and bins near their loops; the file then\n"
+              << "\tgets a version 2 header, so older versions of apa4 refuse it\n"
+              << "       apa4 convert [--layout <columnar|padded20|packed16|varint>] <input_slice> <output_slice>\n"
+              << "\tRewrite a slice file (possibly compressed) uncompressed in the given record layout\n"
+              << "\t(default columnar, the smallest and fastest to read); padded20 output can be read by older versions of apa4\n";
 }
 
-bool fileExists(const std::string& filename) {
-    std::ifstream f(filename);
-    return f.good();
-}
-
-struct BedpeSet {
-    std::string forward_bed;
-    std::string reverse_bed;
-    std::string output_file;
-};
-
 int main(int argc, char* argv[]) {
     try {
-        // Need at least 6 args (base args) + 3 (one bedpe set)
-        if (argc < 9 || (argc - 6) % 3 != 0) {
-            printUsage();
-            return 1;
+        if (argc >= 2 && std::string(argv[1]) == "index") {
+            if (argc != 3) {
+                printUsage();
+                return 1;
+            }
+            size_t blocks = writeSliceIndex(argv[2]);
+            std::cout << "Wrote block index with " << blocks << " blocks to " << argv[2] << std::endl;
+            return 0;
         }
 
-        // Parse base arguments
-        std::string mode = argv[1];
-        bool isInter;
-        if (mode == "inter") {
-            isInter = true;
-        } else if (mode == "intra") {
-            isInter = false;
-        } else {
-            throw std::runtime_error("First argument must be either 'inter' or 'intra'");
+        if (argc >= 2 && std::string(argv[1]) == "merge") {
+            OutputFormat format;
+            if (argc >= 4 && std::string(argv[2]) == "--output-format") {
+                format = parseOutputFormat(argv[3]);
+                argc -= 2;
+                argv += 2;
+            }
+            if (argc < 4) {
+                printUsage();
+                return 1;
+            }
+            std::vector<ApaPartial> partials;
+            std::vector<SliceShard> shards(argc - 3);
+            std::vector<uint64_t> fingerprints(argc - 3);
+            for (int i = 3; i < argc; i++) {
+                partials.push_back(ApaPartial::load(argv[i], shards[i - 3], fingerprints[i - 3]));
+            }
+            const int count = shards[0].count;
+            std::vector<bool> seen(count > 0 ? count : 0, false);
+            for (size_t i = 0; i < shards.size(); i++) {
+                if (fingerprints[i] != fingerprints[0]) {
+                    throw std::runtime_error(std::string("Partial result is from another run (slice, BED files, ") +
+                                             "distances, mode or window than " + argv[3] + "): " + argv[i + 3]);
+                }
+                if (shards[i].count != count || shards[i].index < 0 || shards[i].index >= count) {
+                    throw std::runtime_error(std::string("Partial result is from another run: ") + argv[i + 3]);
+                }
+                if (seen[shards[i].index]) {
+                    throw std::runtime_error("Shard " + std::to_string(shards[i].index) + " is given twice");
+                }
+                seen[shards[i].index] = true;
+            }
+            for (int k = 0; k < count; k++) {
+                if (!seen[k]) {
+                    throw std::runtime_error("Shard " + std::to_string(k) + "/" + std::to_string(count) +
+                                             " is missing");
+                }
+            }
+            for (size_t i = 1; i < partials.size(); i++) {
+                partials[0].add(partials[i]);
+            }
+            std::cout << "Merged " << argc - 3 << " partial results" << std::endl;
+            std::cout << "Saving matrix to: " << argv[2] << std::endl;
+            partials[0].normalized().save(argv[2], format);
+            return 0;
         }
 
-        long min_dist = std::stol(argv[2]);
-        long max_dist = std::stol(argv[3]);
-        int window_size = std::stoi(argv[4]);
-        std::string slice_file = argv[5];
+        if (argc >= 2 && std::string(argv[1]) == "convert") {
+            RecordLayout layout = RecordLayout::Columnar;
+            int first = 2;
+            if (argc >= 4 && std::string(argv[2]) == "--layout") {
+                std::string name = argv[3];
+                if (name == "padded20") {
+                    layout = RecordLayout::Padded20;
+                } else if (name == "packed16") {
+                    layout = RecordLayout::Packed16;
+                } else if (name == "varint") {
+                    layout = RecordLayout::DeltaVarint;
+                } else if (name == "columnar") {
+                    layout = RecordLayout::Columnar;
+                } else {
+                    throw std::runtime_error("Unknown record layout: " + name);
+                }
+                first = 4;
+            }
+            if (argc != first + 2) {
+                printUsage();
+                return 1;
+            }
+            uint64_t records = convertSlice(argv[first], argv[first + 1], layout);
+            std::cout << "Wrote " << records << " records to " << argv[first + 1] << std::endl;
+            return 0;
+        }
 
-        // Validate parameters
-        if (min_dist < 0 || max_dist < min_dist) {
-            throw std::runtime_error("Invalid distance parameters");
+        // Parse leading options
+        int num_threads = 1;
+        uint64_t memory_budget = 0;
+        std::vector<int> bin_merges(1, 1);
+        std::string cache_dir;
+        std::string stats_file;
+        OutputFormat output_format;
+        SampleOptions sample;
+        int jobs = 1;
+        int max_io = 0;
+        SliceShard shard = {0, 1};
+        bool sharded = false;
+        int first = 1;
+        while (first < argc && std::string(argv[first]).compare(0, 2, "--") == 0) {
+            std::string option = argv[first];
+            if (option == "--threads" && first + 1 < argc) {
+                num_threads = std::stoi(argv[first + 1]);
+                if (num_threads <= 0) {
+                    throw std::runtime_error("Thread count must be positive");
+                }
+                first += 2;
+            } else if (option == "--max-memory" && first + 1 < argc) {
+                double gb = std::stod(argv[first + 1]);
+                if (!(gb > 0)) {
+                    throw std::runtime_error("Memory limit must be positive");
+                }
+                memory_budget = static_cast<uint64_t>(gb * 1024 * 1024 * 1024);
+                first += 2;
+            } else if (option == "--bin-merge" && first + 1 < argc) {
+                bin_merges = parseIntList(argv[first + 1], "Bin merge factor");
+                first += 2;
+            } else if (option == "--shard" && first + 1 < argc) {
+                std::string value = argv[first + 1];
+                size_t slash = value.find('/');
+                if (slash == std::string::npos) {
+                    throw std::runtime_error("Shard must be given as <K>/<N>: " + value);
+                }
+                shard.index = std::stoi(value.substr(0, slash));
+                shard.count = std::stoi(value.substr(slash + 1));
+                if (shard.count <= 0 || shard.index < 0 || shard.index >= shard.count) {
+                    throw std::runtime_error("Invalid shard: " + value);
+                }
+                sharded = true;
+                first += 2;
+            } else if (option == "--stats" && first + 1 < argc) {
+                stats_file = argv[first + 1];
+                first += 2;
+            } else if (option == "--sample" && first + 1 < argc) {
+                sample.every = std::stoi(argv[first + 1]);
+                if (sample.every <= 0) {
+                    throw std::runtime_error("Sample rounds must be positive");
+                }
+                first += 2;
+            } else if (option == "--converge" && first + 1 < argc) {
+                sample.tolerance = std::stod(argv[first + 1]);
+                if (!(sample.tolerance > 0)) {
+                    throw std::runtime_error("Convergence tolerance must be positive");
+                }
+                first += 2;
+            } else if (option == "--output-format" && first + 1 < argc) {
+                output_format = parseOutputFormat(argv[first + 1]);
+                first += 2;
+            } else if (option == "--index-cache" && first + 1 < argc) {
+                cache_dir = argv[first + 1];
+                first += 2;
+            } else if ((option == "--jobs" || option == "--max-io") && first + 1 < argc) {
+                int value = std::stoi(argv[first + 1]);
+                if (value <= 0) {
+                    throw std::runtime_error(option + " must be positive");
+                }
+                if (option == "--jobs") {
+                    jobs = value;
+                } else {
+                    max_io = value;
+                }
+                first += 2;
+            } else {
+                printUsage();
+                return 1;
+            }
         }
-        if (window_size <= 0) {
-            throw std::runtime_error("Window size must be positive");
+        argc -= first - 1;
+        argv += first - 1;
+        if (sample.tolerance > 0 && sample.every <= 1) {
+            throw std::runtime_error("--converge needs --sample with more than one round");
         }
-        if (!fileExists(slice_file)) {
-            throw std::runtime_error("Slice file not found: " + slice_file);
+        if (sharded && sample.every > 1) {
+            throw std::runtime_error("--sample cannot be combined with --shard");
         }
 
-        // Parse BEDPE sets
-        std::vector<BedpeSet> bedpe_sets;
-        for (int i = 6; i < argc; i += 3) {
-            BedpeSet set = {
-                argv[i],      // forward bed
-                argv[i + 1],  // reverse bed
-                argv[i + 2]   // output file
-            };
-            
-            if (!fileExists(set.forward_bed)) {
-                throw std::runtime_error("Forward BED file not found: " + set.forward_bed);
-            }
-            if (!fileExists(set.reverse_bed)) {
-                throw std::runtime_error("Reverse BED file not found: " + set.reverse_bed);
-            }
-            
-            bedpe_sets.push_back(set);
+        std::unique_ptr<RunStats> stats(stats_file.empty() ? nullptr : new RunStats());
+        auto writeStats = [&]() {
+            if (!stats) return;
+            std::ofstream out(stats_file);
+            stats->writeJson(out);
+            if (!out) {
+                throw std::runtime_error("Could not write stats file: " + stats_file);
+            }
+            std::cout << "Wrote stats to: " << stats_file << std::endl;
+        };
+
+        if (argc == 3 && std::string(argv[1]) == "batch") {
+            BatchOptions options = {jobs, num_threads, max_io > 0 ? max_io : jobs, memory_budget, bin_merges,
+                                    cache_dir, stats.get(), output_format, sample};
+            size_t failed = runBatch(argv[2], options);
+            writeStats();
+            return failed == 0 ? 0 : 1;
+        }
+
+        RunSpec spec;
+        if (!parseRunSpec(std::vector<std::string>(argv + 1, argv + argc), spec)) {
+            printUsage();
+            return 1;
+        }
+        const bool isInter = spec.isInter;
+        const long min_dist = spec.min_dist;
+        const long max_dist = spec.max_dist;
+        const std::string& slice_file = spec.slice_file;
+        const std::vector<BedpeSet>& bedpe_sets = spec.bedpe_sets;
+        const std::vector<ApaConfig> configs = runConfigs(spec.window_sizes, bin_merges);
+
+        // Sets whose indices are all cached need no BEDPE entries; the slice
+        // header gives the resolution and chromosomes the cache keys need
+        std::unique_ptr<IndexCache> cache;
+        std::vector<bool> set_cached(bedpe_sets.size(), false);
+        if (!cache_dir.empty()) {
+            std::vector<uint64_t> set_hashes;
+            for (const auto& set : bedpe_sets) {
+                set_hashes.push_back(
+                    IndexCache::hashLoopInputs(set.forward_bed, set.reverse_bed, min_dist, max_dist, isInter));
+            }
+            cache.reset(new IndexCache(cache_dir, set_hashes));
+            const SliceHeader header = SliceReader::open(slice_file)->header();
+            for (size_t i = 0; i < bedpe_sets.size(); i++) {
+                set_cached[i] = true;
+                for (const auto& config : configs) {
+                    uint64_t key = cache->key(i, config, header.resolution, header.chromosomes);
+                    set_cached[i] = set_cached[i] && cache->contains(key);
+                }
+            }
         }
 
-        // Process each BEDPE set to generate entries
+        // Process each BEDPE set to generate entries. Inter sets, the full
+        // product of their anchors, are only ever kept as the anchors.
         std::cout << "Processing " << bedpe_sets.size() << " BEDPE sets..." << std::endl;
-        std::vector<std::vector<BedpeEntry>> all_bedpe_entries(bedpe_sets.size());
+        std::vector<BedpeTable> all_bedpe_entries(bedpe_sets.size());
+        std::vector<InterAnchors> all_anchors(isInter ? bedpe_sets.size() : 0);
         
         for (size_t i = 0; i < bedpe_sets.size(); i++) {
             const auto& set = bedpe_sets[i];
+            if (set_cached[i]) {
+                std::cout << "Loop indices of " << set.forward_bed << " and " << set.reverse_bed
+                          << " are cached" << std::endl;
+                continue;
+            }
             std::cout << "Loading BED files: " << set.forward_bed << " and " << set.reverse_bed << std::endl;
-            BedpeBuilder builder(set.forward_bed, set.reverse_bed, min_dist, max_dist, isInter);
-            all_bedpe_entries[i] = builder.buildBedpe();
+            BedpeBuilder builder(set.forward_bed, set.reverse_bed, min_dist, max_dist, isInter, num_threads,
+                                 stats.get());
+            if (isInter) {
+                all_anchors[i] = builder.buildInterAnchors();
+            } else {
+                all_bedpe_entries[i] = builder.buildBedpe();
+            }
         }
 
-        // After loading all BEDPE entries but before processing
-        try {
-            detail::checkMemoryRequirements(all_bedpe_entries, window_size);
-        } catch (const std::runtime_error& e) {
-            std::cerr << "Memory check failed: " << e.what() << std::endl;
-            return 1;
+        std::cout << "Processing slice file: " << slice_file << std::endl;
+        if (sharded) {
+            auto partials = isInter
+                ? processSliceShard(slice_file, all_anchors, configs, shard, num_threads, memory_budget,
+                                    cache.get(), stats.get())
+                : processSliceShard(slice_file, all_bedpe_entries, configs, isInter, min_dist, max_dist, shard,
+                                    num_threads, memory_budget, cache.get(), stats.get());
+            {
+                StageTimer timer(stats.get(), "save");
+                const SliceHeader header = SliceReader::open(slice_file)->header();
+                for (size_t i = 0; i < partials.size(); i++) {
+                    const BedpeSet& set = bedpe_sets[i / configs.size()];
+                    const uint64_t fingerprint = IndexCache::runFingerprint(
+                        IndexCache::indexKey(IndexCache::hashLoopInputs(set.forward_bed, set.reverse_bed, min_dist,
+                                                                        max_dist, isInter),
+                                             configs[i % configs.size()], header.resolution, header.chromosomes),
+                        slice_file);
+                    const std::string& output_file = set.output_file;
+                    std::string path = configs.size() == 1
+                        ? output_file
+                        : configOutputName(output_file, configs[i % configs.size()]);
+                    std::cout << "Saving partial result to: " << path << std::endl;
+                    partials[i].save(path, shard, fingerprint);
+                }
+            }
+            writeStats();
+            return 0;
         }
 
-        std::cout << "Processing slice file: " << slice_file << std::endl;
-        auto matrices = processSliceFile(slice_file, all_bedpe_entries, 
-                                       window_size, isInter, min_dist, max_dist);
+        auto matrices = isInter
+            ? processSliceFile(slice_file, all_anchors, configs, num_threads, memory_budget, cache.get(), nullptr,
+                               stats.get(), sample)
+            : processSliceFile(slice_file, all_bedpe_entries, configs, isInter, min_dist, max_dist,
+                               num_threads, memory_budget, cache.get(), nullptr, stats.get(), sample);
 
         // Save all matrices
-        for (size_t i = 0; i < matrices.size(); i++) {
-            std::cout << "Saving matrix to: " << bedpe_sets[i].output_file << std::endl;
-            matrices[i].save(bedpe_sets[i].output_file);
+        {
+            StageTimer timer(stats.get(), "save");
+            std::vector<std::string> paths;
+            for (size_t i = 0; i < matrices.size(); i++) {
+                const std::string& output_file = bedpe_sets[i / configs.size()].output_file;
+                paths.push_back(configs.size() == 1
+                    ? output_file
+                    : configOutputName(output_file, configs[i % configs.size()]));
+                std::cout << "Saving matrix to: " << paths.back() << std::endl;
+            }
+            writeMatrices(matrices, paths, output_format, num_threads);
         }
-        
+        writeStats();
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
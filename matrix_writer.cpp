@@ -0,0 +1,173 @@
+#include "matrix_writer.h"
+#include "apa.h"
+#include "record_layout.h"
+#include "scheduler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <zlib.h>
+
+OutputFormat parseOutputFormat(const std::string& name) {
+    OutputFormat format;
+    std::string base = name;
+    if (base.size() > 3 && base.compare(base.size() - 3, 3, ".gz") == 0) {
+        format.gzip = true;
+        base.resize(base.size() - 3);
+    }
+    if (base == "text") {
+        format.matrix = MatrixFormat::Text;
+    } else if (base == "f32") {
+        format.matrix = MatrixFormat::Float32;
+    } else if (base == "npy") {
+        format.matrix = MatrixFormat::Npy;
+    } else {
+        throw std::runtime_error("Unknown output format: " + name);
+    }
+    return format;
+}
+
+// A float is m * 2^e with m below 2^24, so value * 10^6 is an integer
+// times a power of two and can be rounded exactly in 64 bits, half to even
+// as printf rounds. Values too large for that (and inf and NaN) go to
+// snprintf.
+size_t formatFixed6(float value, char* out) {
+    if (!std::isfinite(value)) {
+        return static_cast<size_t>(std::snprintf(out, 64, "%.6f", value));
+    }
+    int exp;
+    const float frac = std::frexp(std::fabs(value), &exp);
+    const uint64_t scaled = static_cast<uint64_t>(std::ldexp(frac, 24)) * 1000000;  // Below 2^44
+    const int e = exp - 24;
+    uint64_t units;
+    if (e >= 0) {
+        if (e > 19) {
+            return static_cast<size_t>(std::snprintf(out, 64, "%.6f", value));
+        }
+        units = scaled << e;
+    } else if (e <= -64) {
+        units = 0;  // Below half a unit
+    } else {
+        const uint64_t half = uint64_t(1) << (-e - 1);
+        const uint64_t rest = scaled & ((half << 1) - 1);
+        units = scaled >> -e;
+        if (rest > half || (rest == half && (units & 1))) units++;
+    }
+
+    char* p = out;
+    if (std::signbit(value)) *p++ = '-';
+    uint64_t whole = units / 1000000;
+    uint32_t fraction = static_cast<uint32_t>(units % 1000000);
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + whole % 10);
+        whole /= 10;
+    } while (whole > 0);
+    while (n > 0) *p++ = digits[--n];
+    *p++ = '.';
+    for (int i = 5; i >= 0; i--) {
+        p[i] = static_cast<char>('0' + fraction % 10);
+        fraction /= 10;
+    }
+    return static_cast<size_t>(p + 6 - out);
+}
+
+namespace {
+
+void appendFloats(const APAMatrix& matrix, std::vector<char>& bytes) {
+    size_t offset = bytes.size();
+    bytes.resize(offset + 4 * static_cast<size_t>(matrix.width) * matrix.width);
+    char* p = &bytes[offset];
+    for (int r = 0; r < matrix.width; r++) {
+        for (int c = 0; c < matrix.width; c++, p += 4) storeLEFloat(p, matrix.at(r, c));
+    }
+}
+
+void appendText(const APAMatrix& matrix, std::vector<char>& bytes) {
+    // Most values are short; reserve for those and grow row by row
+    bytes.reserve(static_cast<size_t>(matrix.width) * matrix.width * 10);
+    std::vector<char> row(static_cast<size_t>(matrix.width) * 65);
+    for (int r = 0; r < matrix.width; r++) {
+        char* p = row.data();
+        for (int c = 0; c < matrix.width; c++) {
+            if (c > 0) *p++ = ' ';
+            p += formatFixed6(matrix.at(r, c), p);
+        }
+        *p++ = '\n';
+        bytes.insert(bytes.end(), row.data(), p);
+    }
+}
+
+// Version 1.0: magic, version, header length, then the header dict padded
+// with spaces and a newline to a multiple of 64 bytes
+void appendNpyHeader(int width, std::vector<char>& bytes) {
+    std::string dict = "{'descr': '<f4', 'fortran_order': False, 'shape': (" + std::to_string(width) + ", " +
+                       std::to_string(width) + "), }";
+    const size_t prefix = 10;
+    size_t total = (prefix + dict.size() + 1 + 63) / 64 * 64;
+    dict.append(total - prefix - dict.size() - 1, ' ');
+    dict.push_back('\n');
+    const char magic[8] = {'\x93', 'N', 'U', 'M', 'P', 'Y', 1, 0};
+    bytes.insert(bytes.end(), magic, magic + 8);
+    bytes.push_back(static_cast<char>(dict.size() & 0xff));
+    bytes.push_back(static_cast<char>(dict.size() >> 8));
+    bytes.insert(bytes.end(), dict.begin(), dict.end());
+}
+
+} // namespace
+
+std::vector<char> encodeMatrix(const APAMatrix& matrix, MatrixFormat format) {
+    std::vector<char> bytes;
+    switch (format) {
+    case MatrixFormat::Text:
+        appendText(matrix, bytes);
+        break;
+    case MatrixFormat::Float32:
+        bytes.resize(12);
+        std::memcpy(bytes.data(), "APAMF32", 8);
+        storeLE32(&bytes[8], static_cast<uint32_t>(matrix.width));
+        appendFloats(matrix, bytes);
+        break;
+    case MatrixFormat::Npy:
+        appendNpyHeader(matrix.width, bytes);
+        appendFloats(matrix, bytes);
+        break;
+    }
+    return bytes;
+}
+
+void writeMatrix(const APAMatrix& matrix, const std::string& filename, const OutputFormat& format) {
+    const std::vector<char> bytes = encodeMatrix(matrix, format.matrix);
+    if (format.gzip) {
+        gzFile out = gzopen(filename.c_str(), "wb");
+        if (!out) {
+            throw std::runtime_error("Cannot open output file: " + filename);
+        }
+        bool ok = true;
+        for (size_t done = 0; ok && done < bytes.size();) {
+            unsigned n = static_cast<unsigned>(std::min<size_t>(bytes.size() - done, 1 << 30));
+            ok = gzwrite(out, &bytes[done], n) == static_cast<int>(n);
+            done += n;
+        }
+        if (gzclose(out) != Z_OK || !ok) {
+            throw std::runtime_error("Could not write output file: " + filename);
+        }
+        return;
+    }
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Cannot open output file: " + filename);
+    }
+    if (!out.write(bytes.data(), bytes.size()) || !out.flush()) {
+        throw std::runtime_error("Could not write output file: " + filename);
+    }
+}
+
+void writeMatrices(const std::vector<APAMatrix>& matrices, const std::vector<std::string>& filenames,
+                   const OutputFormat& format, int num_threads) {
+    parallelFor(matrices.size(), num_threads,
+                [&](size_t i) { writeMatrix(matrices[i], filenames[i], format); });
+}
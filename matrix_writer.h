@@ -0,0 +1,40 @@
+#ifndef MATRIX_WRITER_H
+#define MATRIX_WRITER_H
+
+#include <string>
+#include <vector>
+
+struct APAMatrix;
+
+// How APA matrices are written:
+//   text: rows of space-separated values with 6 decimals
+//   f32:  magic "APAMF32\0", width as little-endian int32, then the rows as
+//         little-endian float32
+//   npy:  a NumPy .npy file holding a width x width '<f4' array
+// With gzip the whole file is gzip-compressed.
+enum class MatrixFormat { Text, Float32, Npy };
+
+struct OutputFormat {
+    MatrixFormat matrix;
+    bool gzip;
+
+    OutputFormat() : matrix(MatrixFormat::Text), gzip(false) {}
+};
+
+// text, f32 or npy, optionally followed by .gz
+OutputFormat parseOutputFormat(const std::string& name);
+
+// Write value as printf("%.6f") would, without locale or stream overhead;
+// returns the number of characters written to out (at most 64)
+size_t formatFixed6(float value, char* out);
+
+// The file contents of matrix in a format, before any compression
+std::vector<char> encodeMatrix(const APAMatrix& matrix, MatrixFormat format);
+
+void writeMatrix(const APAMatrix& matrix, const std::string& filename, const OutputFormat& format);
+
+// Write matrices[i] to filenames[i] on up to num_threads threads
+void writeMatrices(const std::vector<APAMatrix>& matrices, const std::vector<std::string>& filenames,
+                   const OutputFormat& format, int num_threads);
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef RECORD_LAYOUT_H
+#define RECORD_LAYOUT_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+// One contact as stored in the .hicslice record section
+struct ContactRecord {
+    int16_t chr1Key;
+    int32_t binX;
+    int16_t chr2Key;
+    int32_t binY;
+    float value;
+};
+
+// Slice files are little-endian whatever the host is
+inline uint16_t loadLE16(const char* p) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint16_t v;
+    std::memcpy(&v, p, 2);
+    return v;
+#else
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint16_t>(b[0] | (b[1] << 8));
+#endif
+}
+
+inline uint32_t loadLE32(const char* p) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+#else
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint32_t>(b[0]) | (static_cast<uint32_t>(b[1]) << 8) |
+           (static_cast<uint32_t>(b[2]) << 16) | (static_cast<uint32_t>(b[3]) << 24);
+#endif
+}
+
+inline uint64_t loadLE64(const char* p) {
+    return loadLE32(p) | (static_cast<uint64_t>(loadLE32(p + 4)) << 32);
+}
+
+inline void storeLE16(char* p, uint16_t v) {
+    p[0] = static_cast<char>(v);
+    p[1] = static_cast<char>(v >> 8);
+}
+
+inline void storeLE32(char* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = static_cast<char>(v >> (8 * i));
+}
+
+inline void storeLE64(char* p, uint64_t v) {
+    storeLE32(p, static_cast<uint32_t>(v));
+    storeLE32(p + 4, static_cast<uint32_t>(v >> 32));
+}
+
+inline float loadLEFloat(const char* p) {
+    uint32_t bits = loadLE32(p);
+    float v;
+    std::memcpy(&v, &bits, 4);
+    return v;
+}
+
+inline void storeLEFloat(char* p, float v) {
+    uint32_t bits;
+    std::memcpy(&bits, &v, 4);
+    storeLE32(p, bits);
+}
+
+// How records are laid out in the record section, recorded in the header
+enum class RecordLayout : int32_t {
+    Padded20 = 0,     // The original layout: ContactRecord with its compiler padding
+    Packed16 = 1,     // The same fields without padding
+    DeltaVarint = 2,  // Zigzag varint deltas from the previous record, see DeltaVarintCodec
+    Columnar = 3      // Compressed blocks of delta-encoded columns, see ColumnarBlock
+};
+
+// Fixed-size layouts: decode/encode one record at p
+template <RecordLayout Layout>
+struct RecordCodec;
+
+template <>
+struct RecordCodec<RecordLayout::Padded20> {
+    static const size_t BYTES = 20;
+
+    static ContactRecord decode(const char* p) {
+        ContactRecord record;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        static_assert(sizeof(ContactRecord) == BYTES, "ContactRecord must match the padded layout");
+        std::memcpy(&record, p, BYTES);
+#else
+        record.chr1Key = static_cast<int16_t>(loadLE16(p));
+        record.binX = static_cast<int32_t>(loadLE32(p + 4));
+        record.chr2Key = static_cast<int16_t>(loadLE16(p + 8));
+        record.binY = static_cast<int32_t>(loadLE32(p + 12));
+        record.value = loadLEFloat(p + 16);
+#endif
+        return record;
+    }
+
+    static void encode(const ContactRecord& record, char* p) {
+        std::memset(p, 0, BYTES);
+        storeLE16(p, static_cast<uint16_t>(record.chr1Key));
+        storeLE32(p + 4, static_cast<uint32_t>(record.binX));
+        storeLE16(p + 8, static_cast<uint16_t>(record.chr2Key));
+        storeLE32(p + 12, static_cast<uint32_t>(record.binY));
+        storeLEFloat(p + 16, record.value);
+    }
+};
+
+template <>
+struct RecordCodec<RecordLayout::Packed16> {
+    static const size_t BYTES = 16;
+
+    static ContactRecord decode(const char* p) {
+        ContactRecord record;
+        record.chr1Key = static_cast<int16_t>(loadLE16(p));
+        record.binX = static_cast<int32_t>(loadLE32(p + 2));
+        record.chr2Key = static_cast<int16_t>(loadLE16(p + 6));
+        record.binY = static_cast<int32_t>(loadLE32(p + 8));
+        record.value = loadLEFloat(p + 12);
+        return record;
+    }
+
+    static void encode(const ContactRecord& record, char* p) {
+        storeLE16(p, static_cast<uint16_t>(record.chr1Key));
+        storeLE32(p + 2, static_cast<uint32_t>(record.binX));
+        storeLE16(p + 6, static_cast<uint16_t>(record.chr2Key));
+        storeLE32(p + 8, static_cast<uint32_t>(record.binY));
+        storeLEFloat(p + 12, record.value);
+    }
+};
+
+// Record size of a fixed-size layout, 0 for the others
+inline size_t recordBytes(RecordLayout layout) {
+    switch (layout) {
+        case RecordLayout::Padded20: return RecordCodec<RecordLayout::Padded20>::BYTES;
+        case RecordLayout::Packed16: return RecordCodec<RecordLayout::Packed16>::BYTES;
+        default: return 0;
+    }
+}
+
+// Decode one record of a fixed-size layout; for code off the hot path
+inline ContactRecord decodeRecord(const char* data, RecordLayout layout) {
+    return layout == RecordLayout::Packed16 ? RecordCodec<RecordLayout::Packed16>::decode(data)
+                                            : RecordCodec<RecordLayout::Padded20>::decode(data);
+}
+
+// Decode one record from (possibly unaligned) bytes in the original layout
+inline ContactRecord decodeRecord(const char* data) {
+    return RecordCodec<RecordLayout::Padded20>::decode(data);
+}
+
+// Zigzag and LEB128 varint coding shared by the compressed layouts
+inline uint64_t zigzag(int64_t v) {
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t v) {
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+inline bool readVarint(const char*& p, const char* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char byte = static_cast<unsigned char>(*p++);
+        v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+inline void writeVarint(char*& p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = static_cast<char>(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = static_cast<char>(v);
+}
+
+// Each record is four zigzag varints, the deltas of chr1Key, chr2Key and
+// binX from the previous record and binY - binX, followed by the 4-byte
+// value. The first record is relative to all zeros. Sorted intra slices
+// shrink to about 7 bytes per record.
+class DeltaVarintCodec {
+public:
+    static const size_t MAX_BYTES = 3 + 3 + 5 + 5 + 4;
+
+    DeltaVarintCodec() : chr1Key(0), chr2Key(0), binX(0) {}
+
+    // Decode one record from [p, end); returns its size, or 0 if the bytes
+    // end inside the record (nothing is consumed then)
+    size_t decode(const char* p, const char* end, ContactRecord& record) {
+        const char* q = p;
+        uint64_t d1, d2, dx, dy;
+        if (!readVarint(q, end, d1) || !readVarint(q, end, d2) || !readVarint(q, end, dx) ||
+            !readVarint(q, end, dy) || end - q < 4) {
+            return 0;
+        }
+        chr1Key = static_cast<int16_t>(chr1Key + unzigzag(d1));
+        chr2Key = static_cast<int16_t>(chr2Key + unzigzag(d2));
+        binX = static_cast<int32_t>(binX + unzigzag(dx));
+        record.chr1Key = chr1Key;
+        record.chr2Key = chr2Key;
+        record.binX = binX;
+        record.binY = static_cast<int32_t>(binX + unzigzag(dy));
+        record.value = loadLEFloat(q);
+        return static_cast<size_t>(q + 4 - p);
+    }
+
+    // Encode one record at p, which needs MAX_BYTES; returns its size
+    size_t encode(const ContactRecord& record, char* p) {
+        char* q = p;
+        writeVarint(q, zigzag(static_cast<int64_t>(record.chr1Key) - chr1Key));
+        writeVarint(q, zigzag(static_cast<int64_t>(record.chr2Key) - chr2Key));
+        writeVarint(q, zigzag(static_cast<int64_t>(record.binX) - binX));
+        writeVarint(q, zigzag(static_cast<int64_t>(record.binY) - record.binX));
+        storeLEFloat(q, record.value);
+        chr1Key = record.chr1Key;
+        chr2Key = record.chr2Key;
+        binX = record.binX;
+        return static_cast<size_t>(q + 4 - p);
+    }
+
+private:
+    int16_t chr1Key;
+    int16_t chr2Key;
+    int32_t binX;
+};
+
+#endif
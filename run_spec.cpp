@@ -0,0 +1,93 @@
+#include "run_spec.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+std::vector<int> parseIntList(const std::string& text, const std::string& what) {
+    std::vector<int> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        int value = std::stoi(item);
+        if (value <= 0) {
+            throw std::runtime_error(what + " must be positive");
+        }
+        values.push_back(value);
+    }
+    if (values.empty()) {
+        throw std::runtime_error("No " + what + " given");
+    }
+    return values;
+}
+
+bool parseRunSpec(const std::vector<std::string>& args, RunSpec& spec) {
+    // 5 base arguments + 3 per BEDPE set, at least one
+    if (args.size() < 8 || (args.size() - 5) % 3 != 0) return false;
+
+    const std::string& mode = args[0];
+    if (mode == "inter") {
+        spec.isInter = true;
+    } else if (mode == "intra") {
+        spec.isInter = false;
+    } else {
+        throw std::runtime_error("First argument must be either 'inter' or 'intra'");
+    }
+
+    spec.min_dist = std::stol(args[1]);
+    spec.max_dist = std::stol(args[2]);
+    spec.window_sizes = parseIntList(args[3], "Window size");
+    spec.slice_file = args[4];
+
+    // Validate parameters
+    if (spec.min_dist < 0 || spec.max_dist < spec.min_dist) {
+        throw std::runtime_error("Invalid distance parameters");
+    }
+    if (!fileExists(spec.slice_file)) {
+        throw std::runtime_error("Slice file not found: " + spec.slice_file);
+    }
+
+    // Parse BEDPE sets
+    spec.bedpe_sets.clear();
+    for (size_t i = 5; i < args.size(); i += 3) {
+        BedpeSet set = {
+            args[i],      // forward bed
+            args[i + 1],  // reverse bed
+            args[i + 2]   // output file
+        };
+
+        if (!fileExists(set.forward_bed)) {
+            throw std::runtime_error("Forward BED file not found: " + set.forward_bed);
+        }
+        if (!fileExists(set.reverse_bed)) {
+            throw std::runtime_error("Reverse BED file not found: " + set.reverse_bed);
+        }
+
+        spec.bedpe_sets.push_back(set);
+    }
+    return true;
+}
+
+std::vector<ApaConfig> runConfigs(const std::vector<int>& window_sizes, const std::vector<int>& bin_merges) {
+    std::vector<ApaConfig> configs;
+    for (int window_size : window_sizes) {
+        for (int bin_merge : bin_merges) {
+            configs.push_back(ApaConfig{window_size, bin_merge});
+        }
+    }
+    return configs;
+}
+
+std::string configOutputName(const std::string& output_file, const ApaConfig& config) {
+    std::string suffix = "_w" + std::to_string(config.window_size) + "_b" + std::to_string(config.bin_merge);
+    size_t slash = output_file.find_last_of('/');
+    size_t dot = output_file.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return output_file + suffix;
+    }
+    return output_file.substr(0, dot) + suffix + output_file.substr(dot);
+}
+
+bool fileExists(const std::string& filename) {
+    std::ifstream f(filename);
+    return f.good();
+}
@@ -0,0 +1,41 @@
+#ifndef RUN_SPEC_H
+#define RUN_SPEC_H
+
+#include "apa.h"
+#include <string>
+#include <vector>
+
+struct BedpeSet {
+    std::string forward_bed;
+    std::string reverse_bed;
+    std::string output_file;
+};
+
+// The positional arguments of one APA run:
+// <inter|intra> <min_genome_dist> <max_genome_dist> <window_size[,...]>
+// <hic_slice_file> [<forward.bed> <reverse.bed> <output.txt>]...
+struct RunSpec {
+    bool isInter;
+    long min_dist;
+    long max_dist;
+    std::vector<int> window_sizes;
+    std::string slice_file;
+    std::vector<BedpeSet> bedpe_sets;
+};
+
+// Comma-separated positive integers
+std::vector<int> parseIntList(const std::string& text, const std::string& what);
+
+// False if the number of arguments is wrong; throws for invalid values and
+// missing files
+bool parseRunSpec(const std::vector<std::string>& args, RunSpec& spec);
+
+// Every window size with every merge factor
+std::vector<ApaConfig> runConfigs(const std::vector<int>& window_sizes, const std::vector<int>& bin_merges);
+
+// output.txt -> output_w10_b2.txt
+std::string configOutputName(const std::string& output_file, const ApaConfig& config);
+
+bool fileExists(const std::string& filename);
+
+#endif
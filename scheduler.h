@@ -0,0 +1,126 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <thread>
+
+// Counts free slots of a shared resource; acquire() blocks while none are left
+class CountingSemaphore {
+public:
+    explicit CountingSemaphore(size_t slots) : slots(slots) {}
+
+    void acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+        available.wait(lock, [this] { return slots > 0; });
+        slots--;
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock(mutex);
+        slots++;
+        available.notify_one();
+    }
+
+private:
+    size_t slots;
+    std::mutex mutex;
+    std::condition_variable available;
+};
+
+// Holds one slot of a semaphore (if any) for its lifetime
+class SemaphoreSlot {
+public:
+    explicit SemaphoreSlot(CountingSemaphore* semaphore) : semaphore(semaphore) {
+        if (semaphore) semaphore->acquire();
+    }
+
+    ~SemaphoreSlot() {
+        if (semaphore) semaphore->release();
+    }
+
+    SemaphoreSlot(const SemaphoreSlot&) = delete;
+    SemaphoreSlot& operator=(const SemaphoreSlot&) = delete;
+
+private:
+    CountingSemaphore* semaphore;
+};
+
+// A fixed set of tasks dealt to per-worker deques. Workers take from the
+// front of their own and, once it is empty, steal from the back of the
+// others', so long tasks dealt to one worker do not hold up the rest.
+template <typename T>
+class WorkStealingQueues {
+public:
+    explicit WorkStealingQueues(size_t workers) {
+        for (size_t i = 0; i < workers; i++) queues.emplace_back(new Queue());
+    }
+
+    void push(size_t worker, T item) {
+        Queue& queue = *queues[worker % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.items.push_back(std::move(item));
+    }
+
+    // Returns false once every queue is empty
+    bool pop(size_t worker, T& item) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            Queue& queue = *queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.items.empty()) continue;
+            if (i == 0) {
+                item = std::move(queue.items.front());
+                queue.items.pop_front();
+            } else {
+                item = std::move(queue.items.back());
+                queue.items.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<T> items;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+};
+
+// Run task(i) for every i in [0, count) on up to num_threads threads,
+// rethrowing the first exception
+inline void parallelFor(size_t count, int num_threads, const std::function<void(size_t)>& task) {
+    size_t workers = std::min<size_t>(std::max(1, num_threads), count);
+    if (workers <= 1) {
+        for (size_t i = 0; i < count; i++) task(i);
+        return;
+    }
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < workers; t++) {
+        threads.emplace_back([&] {
+            try {
+                for (size_t i = next++; i < count; i = next++) task(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) error = std::current_exception();
+                next = count;
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    if (error) std::rethrow_exception(error);
+}
+
+#endif
@@ -0,0 +1,1220 @@
+#include "slice_reader.h"
+#include "blocking_queue.h"
+#include <zlib.h>
+#include <stdexcept>
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+// Value in the resolution position that marks a version 2 header
+const int32_t EXTENDED_HEADER_MARKER = -1;
+
+// Parse the header through readExact(void* dst, size_t n), which must return
+// false if fewer than n bytes are available
+template <typename ReadExact>
+SliceHeader parseHeader(ReadExact readExact) {
+    SliceHeader header;
+    auto readInt32 = [&](int32_t& value) {
+        char bytes[4];
+        if (!readExact(bytes, 4)) return false;
+        value = static_cast<int32_t>(loadLE32(bytes));
+        return true;
+    };
+
+    // Read and verify magic string
+    char magic[8];
+    if (!readExact(magic, 8) || strncmp(magic, "HICSLICE", 8) != 0) {
+        throw std::runtime_error("Invalid file format: missing magic string");
+    }
+
+    // Read resolution, or the version 2 fields in front of it
+    if (!readInt32(header.resolution)) {
+        throw std::runtime_error("Failed to read resolution");
+    }
+    if (header.resolution == EXTENDED_HEADER_MARKER) {
+        int32_t layout, flags;
+        if (!readInt32(header.version) || !readInt32(layout) || !readInt32(flags) ||
+            !readInt32(header.resolution)) {
+            throw std::runtime_error("Failed to read slice file header");
+        }
+        if (header.version != 2) {
+            throw std::runtime_error("Unsupported slice file version " + std::to_string(header.version));
+        }
+        if (layout < 0 || layout > static_cast<int32_t>(RecordLayout::Columnar)) {
+            throw std::runtime_error("Unknown record layout " + std::to_string(layout) + " in slice file");
+        }
+        header.layout = static_cast<RecordLayout>(layout);
+        header.flags = static_cast<uint32_t>(flags);
+    }
+    if (header.resolution <= 0) {
+        throw std::runtime_error("Invalid resolution in slice file");
+    }
+
+    // Read chromosome mapping
+    int32_t numChromosomes;
+    if (!readInt32(numChromosomes)) {
+        throw std::runtime_error("Failed to read chromosome count");
+    }
+    if (numChromosomes <= 0) {
+        throw std::runtime_error("Invalid number of chromosomes in slice file");
+    }
+
+    for (int i = 0; i < numChromosomes; i++) {
+        int32_t nameLength;
+        if (!readInt32(nameLength)) {
+            throw std::runtime_error("Failed to read chromosome name length");
+        }
+        if (nameLength < 0) {
+            throw std::runtime_error("Invalid chromosome name length in slice file");
+        }
+
+        std::vector<char> nameBuffer(nameLength + 1, 0);
+        if (!readExact(nameBuffer.data(), nameLength)) {
+            throw std::runtime_error("Failed to read chromosome name");
+        }
+
+        char keyBytes[2];
+        if (!readExact(keyBytes, 2)) {
+            throw std::runtime_error("Failed to read chromosome key");
+        }
+        header.chromosomeKeyToName[static_cast<int16_t>(loadLE16(keyBytes))] = std::string(nameBuffer.data());
+    }
+    header.chromosomes = ChromosomeTable(header.chromosomeKeyToName);
+    return header;
+}
+
+// Decode up to max_records DeltaVarint records from [data, end) into
+// Padded20 storage; returns the count and advances data past them
+size_t decodeVarintRecords(const char*& data, const char* end, size_t max_records,
+                           DeltaVarintCodec& codec, std::vector<char>& storage) {
+    const size_t bytes = RecordCodec<RecordLayout::Padded20>::BYTES;
+    storage.resize(max_records * bytes);
+    size_t count = 0;
+    ContactRecord record;
+    while (count < max_records) {
+        size_t used = codec.decode(data, end, record);
+        if (used == 0) break;
+        data += used;
+        RecordCodec<RecordLayout::Padded20>::encode(record, storage.data() + count * bytes);
+        count++;
+    }
+    storage.resize(count * bytes);
+    return count;
+}
+
+// The block index ends the file with this trailer:
+// int64 index offset, int64 block count, 8-byte magic
+const char INDEX_MAGIC[8] = {'H', 'I', 'C', 'S', 'I', 'D', 'X', '1'};
+const size_t INDEX_TRAILER_BYTES = 24;
+
+// Serialized sizes of a SliceBlock (before its extents) and a BlockExtent
+const size_t INDEX_BLOCK_BYTES = 2 * sizeof(uint64_t) + sizeof(uint32_t);
+const size_t INDEX_EXTENT_BYTES = 2 * sizeof(int16_t) + 4 * sizeof(int32_t);
+
+// Number of records described by each index block
+const uint64_t INDEX_BLOCK_RECORDS = 1 << 14;
+
+void encodeBlock(const SliceBlock& block, std::vector<char>& out) {
+    size_t pos = out.size();
+    uint32_t num_extents = static_cast<uint32_t>(block.extents.size());
+    out.resize(pos + INDEX_BLOCK_BYTES + num_extents * INDEX_EXTENT_BYTES);
+    char* p = out.data() + pos;
+    storeLE64(p, block.offset);
+    storeLE64(p + 8, block.numRecords);
+    storeLE32(p + 16, num_extents);
+    p += INDEX_BLOCK_BYTES;
+    for (const auto& extent : block.extents) {
+        storeLE16(p, static_cast<uint16_t>(extent.chr1Key));
+        storeLE16(p + 2, static_cast<uint16_t>(extent.chr2Key));
+        storeLE32(p + 4, static_cast<uint32_t>(extent.minBinX));
+        storeLE32(p + 8, static_cast<uint32_t>(extent.maxBinX));
+        storeLE32(p + 12, static_cast<uint32_t>(extent.minBinY));
+        storeLE32(p + 16, static_cast<uint32_t>(extent.maxBinY));
+        p += INDEX_EXTENT_BYTES;
+    }
+}
+
+// Decode the block at in, which has `available` bytes; returns its size or 0 if truncated
+size_t decodeBlock(const char* in, size_t available, SliceBlock& block) {
+    if (available < INDEX_BLOCK_BYTES) return 0;
+    block.offset = loadLE64(in);
+    block.numRecords = loadLE64(in + 8);
+    uint32_t num_extents = loadLE32(in + 16);
+    size_t size = INDEX_BLOCK_BYTES + static_cast<size_t>(num_extents) * INDEX_EXTENT_BYTES;
+    if (available < size) return 0;
+    block.extents.resize(num_extents);
+    const char* p = in + INDEX_BLOCK_BYTES;
+    for (auto& extent : block.extents) {
+        extent.chr1Key = static_cast<int16_t>(loadLE16(p));
+        extent.chr2Key = static_cast<int16_t>(loadLE16(p + 2));
+        extent.minBinX = static_cast<int32_t>(loadLE32(p + 4));
+        extent.maxBinX = static_cast<int32_t>(loadLE32(p + 8));
+        extent.minBinY = static_cast<int32_t>(loadLE32(p + 12));
+        extent.maxBinY = static_cast<int32_t>(loadLE32(p + 16));
+        p += INDEX_EXTENT_BYTES;
+    }
+    return size;
+}
+
+// Uncompressed slice: the whole file is mapped and records are handed out in place
+class MappedSliceReader : public SliceReader {
+public:
+    MappedSliceReader(const char* map_base, size_t map_length)
+        : base(map_base), length(map_length), offset(0), next_range(0) {
+        slice_header = parseHeader([this](void* dst, size_t n) {
+            if (length - offset < n) return false;
+            std::memcpy(dst, base + offset, n);
+            offset += n;
+            return true;
+        });
+        records_begin = offset;
+        record_bytes = ::recordBytes(slice_header.layout);
+        records_end = record_bytes > 0 ? readIndex() : 0;
+        if (records_end == 0) {
+            // Ignore a trailing partial record
+            records_end = record_bytes > 0 ? offset + (length - offset) / record_bytes * record_bytes : length;
+        }
+        ranges.push_back(std::make_pair(records_begin, records_end));
+    }
+
+    ~MappedSliceReader() {
+        munmap(const_cast<char*>(base), length);
+    }
+
+    bool nextBatch(RecordBatch& batch, size_t max_records) {
+        while (next_range < ranges.size() && offset >= ranges[next_range].second) {
+            if (++next_range < ranges.size()) offset = ranges[next_range].first;
+        }
+        if (next_range == ranges.size()) return false;
+
+        if (record_bytes == 0) {
+            // Variable-size records are decoded into the batch
+            const char* data = base + offset;
+            batch.count = decodeVarintRecords(data, base + records_end, max_records, varint, batch.storage);
+            if (batch.count == 0) {  // A trailing partial record
+                offset = records_end;
+                return false;
+            }
+            batch.data = batch.storage.data();
+            batch.layout = RecordLayout::Padded20;
+            offset = data - base;
+            return true;
+        }
+
+        size_t available = (ranges[next_range].second - offset) / record_bytes;
+        batch.data = base + offset;
+        batch.count = std::min(available, max_records);
+        batch.layout = slice_header.layout;
+        offset += batch.count * record_bytes;
+        return true;
+    }
+
+    bool batchesAreStable() const { return true; }
+
+    void selectBlocks(const std::vector<bool>& wanted) {
+        if (slice_blocks.empty() || wanted.size() != slice_blocks.size()) {
+            throw std::logic_error("Block selection does not match the slice index");
+        }
+        std::vector<std::pair<size_t, size_t>> selected;
+        for (size_t i = 0; i < slice_blocks.size(); i++) {
+            if (!wanted[i]) continue;
+            size_t begin = slice_blocks[i].offset;
+            selected.push_back(std::make_pair(begin, begin + slice_blocks[i].numRecords * record_bytes));
+        }
+        selectRanges(selected);
+    }
+
+    uint64_t selectableRecords() const {
+        return record_bytes > 0 ? (records_end - records_begin) / record_bytes : 0;
+    }
+
+    void selectRecords(const std::vector<std::pair<uint64_t, uint64_t>>& records) {
+        const uint64_t count = selectableRecords();
+        std::vector<std::pair<size_t, size_t>> selected;
+        for (const auto& range : records) {
+            if (count == 0 || range.first > range.second || range.second > count ||
+                (!selected.empty() && records_begin + range.first * record_bytes < selected.back().second)) {
+                throw std::logic_error("Record selection does not match the slice");
+            }
+            selected.push_back(std::make_pair(records_begin + range.first * record_bytes,
+                                              records_begin + range.second * record_bytes));
+        }
+        selectRanges(selected);
+    }
+
+    size_t recordBytes() const { return record_bytes; }
+    size_t recordsBegin() const { return records_begin; }
+    size_t recordsEnd() const { return records_end; }
+    const char* data() const { return base; }
+
+private:
+    // Read only the given byte ranges, in order, merging adjacent ones
+    void selectRanges(const std::vector<std::pair<size_t, size_t>>& selected) {
+        ranges.clear();
+        for (const auto& range : selected) {
+            if (range.first == range.second) continue;
+            if (!ranges.empty() && ranges.back().second == range.first) {
+                ranges.back().second = range.second;
+            } else {
+                ranges.push_back(range);
+            }
+        }
+        next_range = 0;
+        offset = ranges.empty() ? records_end : ranges[0].first;
+        // Skipped records should not be read ahead
+        madvise(const_cast<char*>(base), length, MADV_NORMAL);
+    }
+
+    // Load the block index if the file ends with one; returns the offset
+    // where the records stop, or 0 if there is no index
+    size_t readIndex() {
+        if (length - records_begin < INDEX_TRAILER_BYTES ||
+            std::memcmp(base + length - 8, INDEX_MAGIC, 8) != 0) {
+            return 0;
+        }
+        uint64_t index_offset = loadLE64(base + length - INDEX_TRAILER_BYTES);
+        uint64_t count = loadLE64(base + length - INDEX_TRAILER_BYTES + 8);
+        const size_t index_end = length - INDEX_TRAILER_BYTES;
+        if (index_offset < records_begin || index_offset > index_end ||
+            (index_offset - records_begin) % record_bytes != 0 ||
+            count > (index_end - index_offset) / INDEX_BLOCK_BYTES) {
+            throw std::runtime_error("Corrupt block index in slice file");
+        }
+        slice_blocks.resize(count);
+        size_t pos = index_offset;
+        for (auto& block : slice_blocks) {
+            size_t size = decodeBlock(base + pos, index_end - pos, block);
+            if (size == 0 || block.offset < records_begin ||
+                block.offset + block.numRecords * record_bytes > index_offset) {
+                throw std::runtime_error("Corrupt block index in slice file");
+            }
+            pos += size;
+        }
+        if (pos != index_end) {
+            throw std::runtime_error("Corrupt block index in slice file");
+        }
+        return index_offset;
+    }
+
+    const char* base;
+    size_t length;
+    size_t offset;
+    size_t records_begin;
+    size_t records_end;
+    size_t record_bytes;  // 0 for DeltaVarint
+    DeltaVarintCodec varint;
+    std::vector<std::pair<size_t, size_t>> ranges;  // Byte ranges still to read
+    size_t next_range;
+};
+
+// Map a regular file that starts with the plain magic string; nullptr for
+// anything else (gzip data, pipes), which must be streamed
+std::unique_ptr<MappedSliceReader> mapSliceFile(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open file: " + filename);
+    }
+
+    struct stat st;
+    void* base = MAP_FAILED;
+    size_t length = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= 8) {
+        length = static_cast<size_t>(st.st_size);
+        base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (base == MAP_FAILED) return nullptr;
+    if (std::memcmp(base, "HICSLICE", 8) != 0) {
+        munmap(base, length);
+        return nullptr;
+    }
+    madvise(base, length, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(base, length, MADV_HUGEPAGE);  // Only a hint; ignored where unsupported
+#endif
+    try {
+        return std::unique_ptr<MappedSliceReader>(new MappedSliceReader(static_cast<const char*>(base), length));
+    } catch (...) {
+        munmap(base, length);
+        throw;
+    }
+}
+
+// A Columnar record section is a sequence of independently compressed
+// blocks, each a 16-byte header (stored bytes, raw bytes, record count,
+// codec, 3 zero bytes) and the payload. The raw payload holds
+//   - the number of runs, then per run of records on one chromosome pair
+//     its two int16 keys and uint32 record count
+//   - the byte lengths of the binX and binY columns
+//   - binX as zigzag varint deltas from the previous record (from 0)
+//   - binY as zigzag varints of binY - binX
+//   - the float values
+// zstd and LZ4 are not available everywhere apa4 builds, so blocks are
+// deflated; the codec byte leaves room for others.
+const size_t COLUMNAR_HEADER_BYTES = 16;
+const size_t COLUMNAR_BLOCK_RECORDS = 1 << 16;
+const uint8_t COLUMNAR_CODEC_NONE = 0;
+const uint8_t COLUMNAR_CODEC_DEFLATE = 1;
+
+// Append one block holding records to out
+void encodeColumnarBlock(const std::vector<ContactRecord>& records, std::vector<char>& out) {
+    std::vector<char> runs;
+    std::vector<char> xs(records.size() * 5);
+    std::vector<char> ys(records.size() * 5);
+    char* x = xs.data();
+    char* y = ys.data();
+    int32_t lastBinX = 0;
+    uint32_t numRuns = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        const ContactRecord& record = records[i];
+        if (i == 0 || record.chr1Key != records[i - 1].chr1Key || record.chr2Key != records[i - 1].chr2Key) {
+            runs.resize(runs.size() + 8, 0);
+            storeLE16(&runs[runs.size() - 8], static_cast<uint16_t>(record.chr1Key));
+            storeLE16(&runs[runs.size() - 6], static_cast<uint16_t>(record.chr2Key));
+            numRuns++;
+        }
+        storeLE32(&runs[runs.size() - 4], loadLE32(&runs[runs.size() - 4]) + 1);
+        writeVarint(x, zigzag(static_cast<int64_t>(record.binX) - lastBinX));
+        writeVarint(y, zigzag(static_cast<int64_t>(record.binY) - record.binX));
+        lastBinX = record.binX;
+    }
+    xs.resize(x - xs.data());
+    ys.resize(y - ys.data());
+
+    std::vector<char> raw(4 + runs.size() + 8 + xs.size() + ys.size() + 4 * records.size());
+    char* p = raw.data();
+    storeLE32(p, numRuns);
+    std::copy(runs.begin(), runs.end(), p + 4);
+    p += 4 + runs.size();
+    storeLE32(p, static_cast<uint32_t>(xs.size()));
+    storeLE32(p + 4, static_cast<uint32_t>(ys.size()));
+    p += 8;
+    p = std::copy(xs.begin(), xs.end(), p);
+    p = std::copy(ys.begin(), ys.end(), p);
+    for (const auto& record : records) {
+        storeLEFloat(p, record.value);
+        p += 4;
+    }
+
+    uLongf stored = compressBound(raw.size());
+    std::vector<char> payload(stored);
+    uint8_t codec = COLUMNAR_CODEC_DEFLATE;
+    if (compress2(reinterpret_cast<Bytef*>(payload.data()), &stored,
+                  reinterpret_cast<const Bytef*>(raw.data()), raw.size(), Z_DEFAULT_COMPRESSION) != Z_OK ||
+        stored >= raw.size()) {
+        payload.swap(raw);
+        stored = payload.size();
+        codec = COLUMNAR_CODEC_NONE;
+    }
+
+    size_t pos = out.size();
+    out.resize(pos + COLUMNAR_HEADER_BYTES + stored, 0);
+    storeLE32(&out[pos], static_cast<uint32_t>(stored));
+    storeLE32(&out[pos + 4], static_cast<uint32_t>(codec == COLUMNAR_CODEC_NONE ? stored : raw.size()));
+    storeLE32(&out[pos + 8], static_cast<uint32_t>(records.size()));
+    out[pos + 12] = static_cast<char>(codec);
+    std::copy(payload.begin(), payload.begin() + stored, out.begin() + pos + COLUMNAR_HEADER_BYTES);
+}
+
+// Decode the block at data (its header included) into Padded20 records
+void decodeColumnarBlock(const char* data, std::vector<char>& raw, std::vector<char>& records) {
+    const uint32_t stored = loadLE32(data);
+    const uint32_t raw_bytes = loadLE32(data + 4);
+    const uint32_t count = loadLE32(data + 8);
+    const uint8_t codec = static_cast<uint8_t>(data[12]);
+    const char* payload = data + COLUMNAR_HEADER_BYTES;
+    if (codec == COLUMNAR_CODEC_DEFLATE) {
+        raw.resize(raw_bytes);
+        uLongf length = raw_bytes;
+        if (uncompress(reinterpret_cast<Bytef*>(raw.data()), &length,
+                       reinterpret_cast<const Bytef*>(payload), stored) != Z_OK || length != raw_bytes) {
+            throw std::runtime_error("Failed to decompress columnar block");
+        }
+        payload = raw.data();
+    } else if (codec != COLUMNAR_CODEC_NONE || raw_bytes != stored) {
+        throw std::runtime_error("Unknown codec in columnar block");
+    }
+
+    const char* end = payload + raw_bytes;
+    auto corrupt = [] { return std::runtime_error("Corrupt columnar block in slice file"); };
+    if (raw_bytes < 4) throw corrupt();
+    const uint32_t numRuns = loadLE32(payload);
+    const char* runs = payload + 4;
+    if (static_cast<size_t>(end - runs) < static_cast<size_t>(numRuns) * 8 + 8) throw corrupt();
+    const char* lengths = runs + static_cast<size_t>(numRuns) * 8;
+    const char* x = lengths + 8;
+    const char* xEnd = x + loadLE32(lengths);
+    const char* y = xEnd;
+    const char* yEnd = y + loadLE32(lengths + 4);
+    const char* values = yEnd;
+    if (xEnd > end || yEnd > end || static_cast<size_t>(end - values) != static_cast<size_t>(count) * 4) {
+        throw corrupt();
+    }
+
+    const size_t bytes = RecordCodec<RecordLayout::Padded20>::BYTES;
+    records.resize(static_cast<size_t>(count) * bytes);
+    char* out = records.data();
+    int32_t binX = 0;
+    uint32_t decoded = 0;
+    for (uint32_t run = 0; run < numRuns; run++) {
+        ContactRecord record;
+        record.chr1Key = static_cast<int16_t>(loadLE16(runs + 8 * run));
+        record.chr2Key = static_cast<int16_t>(loadLE16(runs + 8 * run + 2));
+        const uint32_t runLength = loadLE32(runs + 8 * run + 4);
+        if (runLength > count - decoded) throw corrupt();
+        for (uint32_t i = 0; i < runLength; i++) {
+            uint64_t dx, dy;
+            if (!readVarint(x, xEnd, dx) || !readVarint(y, yEnd, dy)) throw corrupt();
+            binX = static_cast<int32_t>(binX + unzigzag(dx));
+            record.binX = binX;
+            record.binY = static_cast<int32_t>(binX + unzigzag(dy));
+            record.value = loadLEFloat(values);
+            values += 4;
+            RecordCodec<RecordLayout::Padded20>::encode(record, out);
+            out += bytes;
+        }
+        decoded += runLength;
+    }
+    if (decoded != count) throw corrupt();
+}
+
+// Decompressed bytes are produced in chunks of this size
+const size_t CHUNK_BYTES = 4 << 20;
+
+// Compressed bytes read from disk at a time
+const size_t INPUT_BYTES = 1 << 20;
+
+// Minimum number of chunks decoded ahead of the consumer
+const size_t CHUNKS_IN_FLIGHT = 4;
+
+// BGZF blocks are grouped into jobs of roughly this many compressed bytes
+const size_t BGZF_JOB_BYTES = 1 << 20;
+
+bool isGzipMagic(const unsigned char* data, size_t length) {
+    return length >= 2 && data[0] == 0x1f && data[1] == 0x8b;
+}
+
+// Total size of the BGZF block starting at data, or 0 if the gzip header
+// carries no BC subfield. Needs the first 12 bytes plus the extra field.
+size_t bgzfBlockSize(const unsigned char* data, size_t length) {
+    if (length < 12 || !isGzipMagic(data, length) || data[2] != 8 || !(data[3] & 4)) return 0;
+    size_t xlen = data[10] | (data[11] << 8);
+    if (length < 12 + xlen) return 0;
+    for (size_t p = 12; p + 4 <= 12 + xlen;) {
+        size_t slen = data[p + 2] | (data[p + 3] << 8);
+        if (data[p] == 'B' && data[p + 1] == 'C' && slen == 2 && p + 6 <= 12 + xlen) {
+            return (data[p + 4] | (data[p + 5] << 8)) + 1;
+        }
+        p += 4 + slen;
+    }
+    return 0;
+}
+
+// Chunks handed from the decoding threads to the consumer in file order
+class OrderedChunks {
+public:
+    explicit OrderedChunks(size_t capacity)
+        : capacity(capacity), next(0), total(UINT64_MAX), cancelled(false) {}
+
+    // Blocks until chunk seq may be produced without exceeding the number
+    // of chunks in flight; false if the consumer went away
+    bool waitForSlot(uint64_t seq) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return cancelled || seq < next + capacity; });
+        return !cancelled;
+    }
+
+    void push(uint64_t seq, std::vector<char>&& chunk) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready[seq] = std::move(chunk);
+        changed.notify_all();
+    }
+
+    // Called by the producer once it knows how many chunks there are
+    void finish(uint64_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        total = count;
+        changed.notify_all();
+    }
+
+    void fail(std::exception_ptr e) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) error = e;
+        changed.notify_all();
+    }
+
+    void cancel() {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+        changed.notify_all();
+    }
+
+    // Next chunk in order; false at the end of the stream
+    bool pop(std::vector<char>& chunk) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return error || next >= total || ready.count(next); });
+        if (error) std::rethrow_exception(error);
+        if (next >= total) return false;
+        std::vector<char> spare = std::move(chunk);
+        chunk = std::move(ready[next]);
+        ready.erase(next++);
+        if (spare.capacity() > 0) pool.push_back(std::move(spare));
+        changed.notify_all();
+        return true;
+    }
+
+    // Reuse a buffer the consumer is done with
+    std::vector<char> acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pool.empty()) return std::vector<char>();
+        std::vector<char> buffer = std::move(pool.back());
+        pool.pop_back();
+        return buffer;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<uint64_t, std::vector<char>> ready;
+    std::vector<std::vector<char>> pool;
+    size_t capacity;
+    uint64_t next;
+    uint64_t total;
+    bool cancelled;
+    std::exception_ptr error;
+};
+
+// One group of consecutive BGZF blocks
+struct BgzfJob {
+    uint64_t seq;
+    std::vector<unsigned char> compressed;
+    std::vector<size_t> block_offsets;
+};
+
+// Compressed slice. A dedicated thread reads and inflates the file into a
+// ring of large chunks while the consumer parses records from the previous
+// one. BGZF input (independent gzip members that record their own size) is
+// additionally inflated in parallel by a pool of worker threads. Plain,
+// multi-member and uncompressed streams are decoded sequentially.
+class StreamingSliceReader : public SliceReader {
+public:
+    StreamingSliceReader(const std::string& filename, int num_threads)
+        : file(nullptr), input_length(0),
+          chunks(std::max<size_t>(CHUNKS_IN_FLIGHT, 2 * std::max(1, num_threads))),
+          jobs(2 * std::max(1, num_threads)), pos(0) {
+        file = fopen(filename.c_str(), "rb");
+        if (!file) {
+            throw std::runtime_error("Could not open file: " + filename);
+        }
+        try {
+            input.resize(INPUT_BYTES);
+            input_length = fread(input.data(), 1, input.size(), file);
+            if (bgzfBlockSize(input.data(), input_length) > 0) {
+                threads.emplace_back(&StreamingSliceReader::dispatchBgzf, this);
+                for (int t = 0; t < std::max(1, num_threads); t++) {
+                    threads.emplace_back(&StreamingSliceReader::inflateBgzfJobs, this);
+                }
+            } else {
+                threads.emplace_back(&StreamingSliceReader::inflateStream, this);
+            }
+            slice_header = parseHeader([this](void* dst, size_t n) {
+                return readBytes(static_cast<char*>(dst), n);
+            });
+            if (slice_header.layout == RecordLayout::Columnar) {
+                throw std::runtime_error("Columnar slice files are already compressed and must be read uncompressed");
+            }
+        } catch (...) {
+            shutdown();
+            throw;
+        }
+    }
+
+    ~StreamingSliceReader() {
+        shutdown();
+    }
+
+    bool nextBatch(RecordBatch& batch, size_t max_records) {
+        if (pos == current.size() && !advance()) return false;
+        const size_t record_bytes = recordBytes(slice_header.layout);
+        if (record_bytes == 0) return nextVarintBatch(batch, max_records);
+
+        size_t available = current.size() - pos;
+        batch.layout = slice_header.layout;
+        if (available < record_bytes) {
+            // Record straddles two chunks; assemble it on the side
+            if (!readBytes(straddling, record_bytes)) return false;
+            batch.data = straddling;
+            batch.count = 1;
+            return true;
+        }
+
+        batch.data = current.data() + pos;
+        batch.count = std::min(max_records, available / record_bytes);
+        pos += batch.count * record_bytes;
+        return true;
+    }
+
+    bool batchesAreStable() const { return false; }
+
+private:
+    FILE* file;
+    std::vector<unsigned char> input;  // First block of compressed input
+    size_t input_length;
+    std::vector<std::thread> threads;
+    OrderedChunks chunks;
+    BlockingQueue<BgzfJob> jobs;
+    std::vector<char> current;
+    size_t pos;
+    char straddling[DeltaVarintCodec::MAX_BYTES];  // Fits a record of any layout
+    DeltaVarintCodec varint;
+
+    void shutdown() {
+        chunks.cancel();
+        jobs.close();
+        for (auto& thread : threads) thread.join();
+        threads.clear();
+        if (file) fclose(file);
+        file = nullptr;
+    }
+
+    bool advance() {
+        do {
+            if (!chunks.pop(current)) return false;
+        } while (current.empty());
+        pos = 0;
+        return true;
+    }
+
+    bool nextVarintBatch(RecordBatch& batch, size_t max_records) {
+        const char* data = current.data() + pos;
+        batch.count = decodeVarintRecords(data, current.data() + current.size(), max_records,
+                                          varint, batch.storage);
+        pos = data - current.data();
+        if (batch.count == 0) {
+            // Record straddles two chunks; decode it from both halves
+            size_t head = current.size() - pos;
+            std::memcpy(straddling, current.data() + pos, head);
+            if (!advance()) return false;  // A trailing partial record
+            size_t tail = std::min(sizeof(straddling) - head, current.size());
+            std::memcpy(straddling + head, current.data(), tail);
+            data = straddling;
+            batch.count = decodeVarintRecords(data, straddling + head + tail, 1, varint, batch.storage);
+            if (batch.count == 0) return false;
+            pos = (data - straddling) - head;
+        }
+        batch.data = batch.storage.data();
+        batch.layout = RecordLayout::Padded20;
+        return true;
+    }
+
+    // Copy n bytes from the decoded stream, crossing chunk boundaries
+    bool readBytes(char* dst, size_t n) {
+        while (n > 0) {
+            if (pos == current.size() && !advance()) return false;
+            size_t take = std::min(n, current.size() - pos);
+            std::memcpy(dst, current.data() + pos, take);
+            pos += take;
+            dst += take;
+            n -= take;
+        }
+        return true;
+    }
+
+    std::vector<char> newChunk(size_t size) {
+        std::vector<char> chunk = chunks.acquire();
+        chunk.resize(size);
+        return chunk;
+    }
+
+    // Sequential producer for everything except BGZF
+    void inflateStream() {
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        bool compressed = isGzipMagic(input.data(), input_length);
+        if (compressed && inflateInit2(&zs, 15 + 32) != Z_OK) {  // Accept gzip or zlib headers
+            chunks.fail(std::make_exception_ptr(std::runtime_error("Failed to initialize decompression")));
+            return;
+        }
+        zs.next_in = input.data();
+        zs.avail_in = static_cast<uInt>(input_length);
+        try {
+            uint64_t seq = 0;
+            bool at_eof = false;
+            bool in_member = compressed;
+            while (!at_eof && chunks.waitForSlot(seq)) {
+                std::vector<char> chunk = newChunk(CHUNK_BYTES);
+                size_t filled = 0;
+                while (filled < chunk.size()) {
+                    if (zs.avail_in == 0) {
+                        zs.next_in = input.data();
+                        zs.avail_in = static_cast<uInt>(fread(input.data(), 1, input.size(), file));
+                        if (zs.avail_in == 0) {
+                            if (in_member) {
+                                throw std::runtime_error("Unexpected end of compressed slice file");
+                            }
+                            at_eof = true;
+                            break;
+                        }
+                    }
+
+                    if (!compressed) {
+                        size_t take = std::min<size_t>(zs.avail_in, chunk.size() - filled);
+                        std::memcpy(chunk.data() + filled, zs.next_in, take);
+                        zs.next_in += take;
+                        zs.avail_in -= static_cast<uInt>(take);
+                        filled += take;
+                        continue;
+                    }
+
+                    zs.next_out = reinterpret_cast<Bytef*>(chunk.data() + filled);
+                    zs.avail_out = static_cast<uInt>(chunk.size() - filled);
+                    int ret = inflate(&zs, Z_NO_FLUSH);
+                    filled = chunk.size() - zs.avail_out;
+                    if (ret == Z_STREAM_END) {
+                        in_member = false;
+                        // Continue with the next gzip member, if any
+                        if (zs.avail_in < 2) {
+                            size_t kept = zs.avail_in;
+                            std::memmove(input.data(), zs.next_in, kept);
+                            zs.next_in = input.data();
+                            zs.avail_in = static_cast<uInt>(
+                                kept + fread(input.data() + kept, 1, input.size() - kept, file));
+                        }
+                        if (!isGzipMagic(zs.next_in, zs.avail_in)) {
+                            at_eof = true;  // Trailing garbage is ignored, as gzread does
+                            break;
+                        }
+                        inflateReset(&zs);
+                        in_member = true;
+                    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                        throw std::runtime_error("Failed to decompress slice file");
+                    }
+                }
+                chunk.resize(filled);
+                chunks.push(seq++, std::move(chunk));
+            }
+            chunks.finish(seq);
+        } catch (...) {
+            chunks.fail(std::current_exception());
+        }
+        if (compressed) inflateEnd(&zs);
+    }
+
+    // Read exactly n bytes of compressed input, starting with what is
+    // left of the initial read
+    bool readInput(unsigned char* dst, size_t n, size_t& consumed) {
+        size_t take = std::min(n, input_length - consumed);
+        std::memcpy(dst, input.data() + consumed, take);
+        consumed += take;
+        return take == n || fread(dst + take, 1, n - take, file) == n - take;
+    }
+
+    // Split a BGZF file into jobs of whole blocks
+    void dispatchBgzf() {
+        try {
+            size_t consumed = 0;
+            uint64_t seq = 0;
+            BgzfJob job;
+            job.seq = seq;
+            unsigned char head[12];
+            bool more = true;
+            while (more) {
+                more = readInput(head, 12, consumed);
+                size_t block_size = 0;
+                if (more) {
+                    size_t xlen = head[10] | (head[11] << 8);
+                    std::vector<unsigned char> block(12 + xlen);
+                    std::memcpy(block.data(), head, 12);
+                    if (!readInput(block.data() + 12, xlen, consumed) ||
+                        (block_size = bgzfBlockSize(block.data(), block.size())) < block.size() + 8) {
+                        throw std::runtime_error("Malformed BGZF block in slice file");
+                    }
+                    size_t offset = job.compressed.size();
+                    job.block_offsets.push_back(offset);
+                    job.compressed.resize(offset + block_size);
+                    std::memcpy(job.compressed.data() + offset, block.data(), block.size());
+                    if (!readInput(job.compressed.data() + offset + block.size(),
+                                   block_size - block.size(), consumed)) {
+                        throw std::runtime_error("Truncated BGZF block in slice file");
+                    }
+                }
+                if (!job.block_offsets.empty() && (!more || job.compressed.size() >= BGZF_JOB_BYTES)) {
+                    if (!chunks.waitForSlot(seq)) return;
+                    if (!jobs.push(std::move(job))) return;
+                    job = BgzfJob();
+                    job.seq = ++seq;
+                }
+            }
+            chunks.finish(seq);
+        } catch (...) {
+            chunks.fail(std::current_exception());
+        }
+        jobs.close();
+    }
+
+    void inflateBgzfJobs() {
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+            chunks.fail(std::make_exception_ptr(std::runtime_error("Failed to initialize decompression")));
+            return;
+        }
+        BgzfJob job;
+        try {
+            while (jobs.pop(job)) {
+                // ISIZE in each block trailer gives the exact output size
+                size_t total = 0;
+                for (size_t b = 0; b < job.block_offsets.size(); b++) {
+                    size_t end = b + 1 < job.block_offsets.size() ? job.block_offsets[b + 1] : job.compressed.size();
+                    const unsigned char* isize = job.compressed.data() + end - 4;
+                    total += isize[0] | (isize[1] << 8) | (isize[2] << 16) | (static_cast<uint32_t>(isize[3]) << 24);
+                }
+                std::vector<char> chunk = newChunk(total);
+                size_t filled = 0;
+                for (size_t b = 0; b < job.block_offsets.size(); b++) {
+                    size_t begin = job.block_offsets[b];
+                    size_t end = b + 1 < job.block_offsets.size() ? job.block_offsets[b + 1] : job.compressed.size();
+                    inflateReset(&zs);
+                    zs.next_in = job.compressed.data() + begin;
+                    zs.avail_in = static_cast<uInt>(end - begin);
+                    zs.next_out = reinterpret_cast<Bytef*>(chunk.data() + filled);
+                    zs.avail_out = static_cast<uInt>(chunk.size() - filled);
+                    if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
+                        throw std::runtime_error("Failed to decompress slice file");
+                    }
+                    filled = chunk.size() - zs.avail_out;
+                }
+                chunk.resize(filled);
+                chunks.push(job.seq, std::move(chunk));
+            }
+        } catch (...) {
+            chunks.fail(std::current_exception());
+            jobs.close();
+        }
+        inflateEnd(&zs);
+    }
+};
+
+// Columnar slice: blocks of the mapped file are decoded on background
+// threads and handed out in file order
+class ColumnarSliceReader : public SliceReader {
+public:
+    ColumnarSliceReader(std::unique_ptr<MappedSliceReader> mapped_file, int num_threads)
+        : mapped(std::move(mapped_file)), next_block(0),
+          chunks(std::max<size_t>(CHUNKS_IN_FLIGHT, 2 * std::max(1, num_threads))), pos(0) {
+        slice_header = mapped->header();
+
+        // Only the block headers are read here
+        const char* data = mapped->data();
+        size_t offset = mapped->recordsBegin();
+        const size_t end = mapped->recordsEnd();
+        while (offset < end) {
+            if (end - offset < COLUMNAR_HEADER_BYTES ||
+                end - offset - COLUMNAR_HEADER_BYTES < loadLE32(data + offset)) {
+                throw std::runtime_error("Truncated columnar block in slice file");
+            }
+            block_offsets.push_back(offset);
+            offset += COLUMNAR_HEADER_BYTES + loadLE32(data + offset);
+        }
+        chunks.finish(block_offsets.size());
+
+        for (int t = 0; t < std::max(1, num_threads); t++) {
+            threads.emplace_back(&ColumnarSliceReader::decodeBlocks, this);
+        }
+    }
+
+    ~ColumnarSliceReader() {
+        chunks.cancel();
+        for (auto& thread : threads) thread.join();
+    }
+
+    bool nextBatch(RecordBatch& batch, size_t max_records) {
+        const size_t bytes = RecordCodec<RecordLayout::Padded20>::BYTES;
+        while (pos == current.size()) {
+            if (!chunks.pop(current)) return false;
+            pos = 0;
+        }
+        batch.data = current.data() + pos;
+        batch.count = std::min(max_records, (current.size() - pos) / bytes);
+        batch.layout = RecordLayout::Padded20;
+        pos += batch.count * bytes;
+        return true;
+    }
+
+    bool batchesAreStable() const { return false; }
+
+private:
+    std::unique_ptr<MappedSliceReader> mapped;
+    std::vector<size_t> block_offsets;
+    std::atomic<size_t> next_block;
+    std::vector<std::thread> threads;
+    OrderedChunks chunks;
+    std::vector<char> current;
+    size_t pos;
+
+    // Each thread claims the next block, decodes it and queues it in order
+    void decodeBlocks() {
+        std::vector<char> raw;
+        try {
+            for (;;) {
+                size_t block = next_block++;
+                if (block >= block_offsets.size() || !chunks.waitForSlot(block)) return;
+                std::vector<char> records = chunks.acquire();
+                decodeColumnarBlock(mapped->data() + block_offsets[block], raw, records);
+                chunks.push(block, std::move(records));
+            }
+        } catch (...) {
+            chunks.fail(std::current_exception());
+        }
+    }
+};
+
+} // namespace
+
+std::unique_ptr<SliceReader> SliceReader::open(const std::string& filename, int num_threads) {
+    std::unique_ptr<MappedSliceReader> mapped = mapSliceFile(filename);
+    if (mapped && mapped->header().layout == RecordLayout::Columnar) {
+        return std::unique_ptr<SliceReader>(new ColumnarSliceReader(std::move(mapped), num_threads));
+    }
+    if (mapped) return std::unique_ptr<SliceReader>(std::move(mapped));
+    return std::unique_ptr<SliceReader>(new StreamingSliceReader(filename, num_threads));
+}
+
+size_t writeSliceIndex(const std::string& filename) {
+    std::vector<char> footer;
+    uint64_t count = 0;
+    size_t records_end;
+    size_t shift;  // Bytes the records move by when the header grows
+    std::string temp;
+    FILE* file = nullptr;
+    {
+        std::unique_ptr<MappedSliceReader> reader = mapSliceFile(filename);
+        if (!reader) {
+            throw std::runtime_error("Only uncompressed slice files can be indexed: " + filename);
+        }
+        const size_t record_bytes = reader->recordBytes();
+        if (record_bytes == 0) {
+            throw std::runtime_error("Only slices with fixed-size records can be indexed: " + filename);
+        }
+        const RecordLayout layout = reader->header().layout;
+
+        // Readers of version 1 files read records up to the end of the file,
+        // so they would take the index for records; version 1 files get a
+        // version 2 header, which those readers reject
+        const bool upgrade = reader->header().version == 1;
+        shift = upgrade ? 16 : 0;
+
+        // Extents of the current block, found by chromosome key pair
+        SliceBlock block = SliceBlock();
+        std::unordered_map<uint32_t, size_t> extent_of;
+        bool sorted = true;
+        ContactRecord last = ContactRecord();
+        records_end = reader->recordsEnd();
+        for (size_t offset = reader->recordsBegin(); offset < records_end; offset += record_bytes) {
+            if (block.numRecords == 0) block.offset = offset + shift;
+            ContactRecord record = decodeRecord(reader->data() + offset, layout);
+            if (offset > reader->recordsBegin() && sorted) {
+                sorted = last.chr1Key < record.chr1Key ||
+                         (last.chr1Key == record.chr1Key &&
+                          (last.chr2Key < record.chr2Key ||
+                           (last.chr2Key == record.chr2Key && last.binX <= record.binX)));
+            }
+            last = record;
+            uint32_t pair = (static_cast<uint32_t>(static_cast<uint16_t>(record.chr1Key)) << 16) |
+                            static_cast<uint16_t>(record.chr2Key);
+            auto found = extent_of.find(pair);
+            if (found == extent_of.end()) {
+                BlockExtent extent = {record.chr1Key, record.chr2Key, record.binX, record.binX,
+                                      record.binY, record.binY};
+                extent_of[pair] = block.extents.size();
+                block.extents.push_back(extent);
+            } else {
+                BlockExtent& extent = block.extents[found->second];
+                extent.minBinX = std::min(extent.minBinX, record.binX);
+                extent.maxBinX = std::max(extent.maxBinX, record.binX);
+                extent.minBinY = std::min(extent.minBinY, record.binY);
+                extent.maxBinY = std::max(extent.maxBinY, record.binY);
+            }
+            if (++block.numRecords == INDEX_BLOCK_RECORDS || offset + record_bytes >= records_end) {
+                encodeBlock(block, footer);
+                count++;
+                block = SliceBlock();
+                extent_of.clear();
+            }
+        }
+
+        if (upgrade) {
+            // A copy with the version 2 fields in front of the version 1
+            // header, renamed over the file once the index is written too
+            temp = filename + ".tmp" + std::to_string(getpid());
+            file = fopen(temp.c_str(), "wb");
+            if (!file) {
+                throw std::runtime_error("Could not open file for writing: " + temp);
+            }
+            char fields[16];
+            storeLE32(fields, static_cast<uint32_t>(EXTENDED_HEADER_MARKER));
+            storeLE32(fields + 4, 2);
+            storeLE32(fields + 8, static_cast<uint32_t>(layout));
+            storeLE32(fields + 12, sorted ? SLICE_FLAG_SORTED : 0);
+            const bool ok = fwrite(reader->data(), 1, 8, file) == 8 &&
+                            fwrite(fields, 1, sizeof(fields), file) == sizeof(fields) &&
+                            fwrite(reader->data() + 8, 1, records_end - 8, file) == records_end - 8;
+            if (!ok) {
+                fclose(file);
+                std::remove(temp.c_str());
+                throw std::runtime_error("Failed to write block index: " + filename);
+            }
+        }
+    }
+
+    if (!file) {
+        // Drop any previous index (and a trailing partial record) before appending
+        if (truncate(filename.c_str(), static_cast<off_t>(records_end)) != 0) {
+            throw std::runtime_error("Could not truncate slice file: " + filename);
+        }
+        file = fopen(filename.c_str(), "ab");
+        if (!file) {
+            throw std::runtime_error("Could not open file for writing: " + filename);
+        }
+    }
+    uint64_t index_offset = records_end + shift;
+    char trailer[INDEX_TRAILER_BYTES];
+    storeLE64(trailer, index_offset);
+    storeLE64(trailer + 8, count);
+    std::memcpy(trailer + 16, INDEX_MAGIC, 8);
+    bool ok = fwrite(footer.data(), 1, footer.size(), file) == footer.size() &&
+              fwrite(trailer, 1, sizeof(trailer), file) == sizeof(trailer);
+    ok = fclose(file) == 0 && ok;
+    if (ok && !temp.empty()) ok = std::rename(temp.c_str(), filename.c_str()) == 0;
+    if (!ok) {
+        if (!temp.empty()) std::remove(temp.c_str());
+        throw std::runtime_error("Failed to write block index: " + filename);
+    }
+    return count;
+}
+
+SliceWriter::SliceWriter(const std::string& filename, int32_t resolution,
+                         const std::map<int16_t, std::string>& chromosomeKeyToName, RecordLayout layout)
+    : filename(filename), file(nullptr), layout(layout), flags_offset(-1) {
+    file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        throw std::runtime_error("Could not open file for writing: " + filename);
+    }
+
+    auto putInt32 = [this](int32_t value) {
+        char bytes[4];
+        storeLE32(bytes, static_cast<uint32_t>(value));
+        buffer.insert(buffer.end(), bytes, bytes + 4);
+    };
+    buffer.insert(buffer.end(), "HICSLICE", "HICSLICE" + 8);
+    if (layout != RecordLayout::Padded20) {
+        putInt32(EXTENDED_HEADER_MARKER);
+        putInt32(2);
+        putInt32(static_cast<int32_t>(layout));
+        flags_offset = static_cast<long>(buffer.size());
+        putInt32(0);
+    }
+    putInt32(resolution);
+    putInt32(static_cast<int32_t>(chromosomeKeyToName.size()));
+    for (const auto& chrom : chromosomeKeyToName) {
+        putInt32(static_cast<int32_t>(chrom.second.size()));
+        buffer.insert(buffer.end(), chrom.second.begin(), chrom.second.end());
+        char key[2];
+        storeLE16(key, static_cast<uint16_t>(chrom.first));
+        buffer.insert(buffer.end(), key, key + 2);
+    }
+}
+
+SliceWriter::~SliceWriter() {
+    if (file) fclose(file);
+}
+
+void SliceWriter::write(const ContactRecord& record) {
+    size_t pos = buffer.size();
+    switch (layout) {
+        case RecordLayout::Padded20:
+            buffer.resize(pos + RecordCodec<RecordLayout::Padded20>::BYTES);
+            RecordCodec<RecordLayout::Padded20>::encode(record, buffer.data() + pos);
+            break;
+        case RecordLayout::Packed16:
+            buffer.resize(pos + RecordCodec<RecordLayout::Packed16>::BYTES);
+            RecordCodec<RecordLayout::Packed16>::encode(record, buffer.data() + pos);
+            break;
+        case RecordLayout::DeltaVarint:
+            buffer.resize(pos + DeltaVarintCodec::MAX_BYTES);
+            buffer.resize(pos + varint.encode(record, buffer.data() + pos));
+            break;
+        case RecordLayout::Columnar:
+            block_records.push_back(record);
+            if (block_records.size() == COLUMNAR_BLOCK_RECORDS) {
+                encodeColumnarBlock(block_records, buffer);
+                block_records.clear();
+            }
+            break;
+    }
+    if (buffer.size() >= INPUT_BYTES) flush();
+}
+
+void SliceWriter::flush() {
+    if (fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) {
+        throw std::runtime_error("Failed to write slice file: " + filename);
+    }
+    buffer.clear();
+}
+
+void SliceWriter::finish(uint32_t flags) {
+    if (!block_records.empty()) {
+        encodeColumnarBlock(block_records, buffer);
+        block_records.clear();
+    }
+    flush();
+    if (flags_offset >= 0) {
+        char bytes[4];
+        storeLE32(bytes, flags);
+        if (fseek(file, flags_offset, SEEK_SET) != 0 || fwrite(bytes, 1, 4, file) != 4) {
+            throw std::runtime_error("Failed to write slice file: " + filename);
+        }
+    }
+    int result = fclose(file);
+    file = nullptr;
+    if (result != 0) {
+        throw std::runtime_error("Failed to write slice file: " + filename);
+    }
+}
+
+uint64_t convertSlice(const std::string& input, const std::string& output, RecordLayout layout) {
+    std::unique_ptr<SliceReader> reader = SliceReader::open(input);
+    const SliceHeader& header = reader->header();
+    SliceWriter writer(output, header.resolution, header.chromosomeKeyToName, layout);
+
+    uint64_t count = 0;
+    bool sorted = true;
+    ContactRecord last = ContactRecord();
+    RecordBatch batch;
+    while (reader->nextBatch(batch, 1 << 16)) {
+        for (size_t i = 0; i < batch.count; i++) {
+            ContactRecord record = decodeRecord(batch.record(i), batch.layout);
+            if (count > 0 && sorted) {
+                sorted = last.chr1Key < record.chr1Key ||
+                         (last.chr1Key == record.chr1Key &&
+                          (last.chr2Key < record.chr2Key ||
+                           (last.chr2Key == record.chr2Key && last.binX <= record.binX)));
+            }
+            writer.write(record);
+            last = record;
+            count++;
+        }
+    }
+    writer.finish(sorted ? SLICE_FLAG_SORTED : 0);
+    return count;
+}
@@ -0,0 +1,200 @@
+#ifndef SLICE_READER_H
+#define SLICE_READER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <set>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <stdexcept>
+#include <cstdio>
+#include <utility>
+#include "record_layout.h"
+
+// Dense integer IDs for the chromosomes of a slice. IDs are assigned in
+// name order so that iterating by ID visits chromosomes alphabetically.
+struct ChromosomeTable {
+    std::vector<std::string> names;  // id -> name
+    std::vector<int32_t> keyToId;    // uint16_t(key) -> id, -1 if not in the header
+    std::unordered_map<std::string, int32_t> nameToId;
+
+    ChromosomeTable() : keyToId(1 << 16, -1) {}
+
+    // Build from the header's key -> name mapping
+    explicit ChromosomeTable(const std::map<int16_t, std::string>& keyToName) : keyToId(1 << 16, -1) {
+        std::set<std::string> sorted;
+        for (const auto& entry : keyToName) sorted.insert(entry.second);
+        for (const auto& name : sorted) {
+            nameToId[name] = static_cast<int32_t>(names.size());
+            names.push_back(name);
+        }
+        for (const auto& entry : keyToName) {
+            keyToId[static_cast<uint16_t>(entry.first)] = nameToId[entry.second];
+        }
+    }
+
+    int32_t size() const { return static_cast<int32_t>(names.size()); }
+
+    int32_t idForKey(int16_t key) const {
+        return keyToId[static_cast<uint16_t>(key)];
+    }
+
+    // -1 if the slice has no chromosome of that name
+    int32_t idForName(const std::string& name) const {
+        auto it = nameToId.find(name);
+        return it != nameToId.end() ? it->second : -1;
+    }
+};
+
+// Header flags of version 2 slices
+const uint32_t SLICE_FLAG_SORTED = 1;  // Records are ordered by (chr1Key, chr2Key, binX)
+
+// Everything in a .hicslice file before the first contact record.
+// Version 1 headers are "HICSLICE", resolution, chromosomes. Version 2
+// headers put -1 where the resolution was (so older readers reject them),
+// then version, record layout and flags, then the version 1 fields.
+struct SliceHeader {
+    int32_t version;
+    RecordLayout layout;
+    uint32_t flags;
+    int32_t resolution;
+    std::map<int16_t, std::string> chromosomeKeyToName;
+    ChromosomeTable chromosomes;
+
+    SliceHeader() : version(1), layout(RecordLayout::Padded20), flags(0), resolution(0) {}
+
+    bool sorted() const { return (flags & SLICE_FLAG_SORTED) != 0; }
+};
+
+// Bins covered by the records of one chromosome pair within a SliceBlock
+struct BlockExtent {
+    int16_t chr1Key;
+    int16_t chr2Key;
+    int32_t minBinX;
+    int32_t maxBinX;
+    int32_t minBinY;
+    int32_t maxBinY;
+};
+
+// One entry of the optional block index stored after the records: a run of
+// consecutive records and the bins it spans on each chromosome pair
+struct SliceBlock {
+    uint64_t offset;      // Byte offset of the first record in the file
+    uint64_t numRecords;
+    std::vector<BlockExtent> extents;
+};
+
+// A run of whole contact records in a fixed-size layout. Readers hand out
+// file bytes as they are where they can and decode DeltaVarint records
+// into Padded20 storage.
+struct RecordBatch {
+    const char* data;
+    size_t count;
+    RecordLayout layout;
+    std::vector<char> storage;  // Backing bytes when data is not owned by the reader
+
+    RecordBatch() : data(nullptr), count(0), layout(RecordLayout::Padded20) {}
+
+    const char* record(size_t i) const {
+        return data + i * recordBytes(layout);
+    }
+
+    // Make the batch independent of the reader's internal buffers
+    void detach() {
+        if (!storage.empty() && data == storage.data()) return;
+        storage.assign(data, data + count * recordBytes(layout));
+        data = storage.data();
+    }
+};
+
+// Sequential reader for the contact records of a .hicslice file.
+// Uncompressed files are memory-mapped and walked in place; gzip-compressed
+// files are inflated ahead of the consumer on background threads.
+class SliceReader {
+public:
+    // Open a slice file, detecting compression from its leading bytes.
+    // num_threads bounds the parallel inflaters used for BGZF input.
+    static std::unique_ptr<SliceReader> open(const std::string& filename, int num_threads = 1);
+
+    virtual ~SliceReader() {}
+
+    const SliceHeader& header() const { return slice_header; }
+
+    // Fetch the next run of up to max_records records. Returns false at the
+    // end of the file. Unless batchesAreStable(), the batch only stays valid
+    // until the next call.
+    virtual bool nextBatch(RecordBatch& batch, size_t max_records) = 0;
+
+    // True if batches point into memory that outlives subsequent calls
+    virtual bool batchesAreStable() const = 0;
+
+    // The block index of the file, empty if it has none
+    const std::vector<SliceBlock>& blocks() const { return slice_blocks; }
+
+    // Restrict reading to the blocks with wanted[i] set. Must be called
+    // before the first nextBatch(); only valid if blocks() is not empty.
+    virtual void selectBlocks(const std::vector<bool>& wanted) {
+        (void)wanted;
+        throw std::logic_error("Slice reader has no block index");
+    }
+
+    // The number of records if they can be read by position, which needs an
+    // uncompressed file with a fixed-size layout; else 0
+    virtual uint64_t selectableRecords() const { return 0; }
+
+    // Restrict reading to the records at positions [first, second) of each
+    // range, given in file order. Must be called before the first
+    // nextBatch(); only valid if selectableRecords() is not 0.
+    virtual void selectRecords(const std::vector<std::pair<uint64_t, uint64_t>>& records) {
+        (void)records;
+        throw std::logic_error("Slice reader cannot select records by position");
+    }
+
+protected:
+    SliceHeader slice_header;
+    std::vector<SliceBlock> slice_blocks;
+};
+
+// Write a block index after the records of an uncompressed slice file with
+// a fixed-size layout, replacing any index it already has. A version 1 file
+// is rewritten with a version 2 header (sorted flag set if its records are),
+// so that readers without index support reject it rather than read the
+// index as records. Returns the number of blocks.
+size_t writeSliceIndex(const std::string& filename);
+
+// Copy the records of any slice file into a new uncompressed one with the
+// given layout, marking it sorted if its records are. Returns the number of
+// records written.
+uint64_t convertSlice(const std::string& input, const std::string& output, RecordLayout layout);
+
+// Writes an uncompressed slice file. Padded20 files get a version 1 header
+// so that older readers can still open them; other layouts need version 2.
+class SliceWriter {
+public:
+    SliceWriter(const std::string& filename, int32_t resolution,
+                const std::map<int16_t, std::string>& chromosomeKeyToName, RecordLayout layout);
+    ~SliceWriter();
+
+    void write(const ContactRecord& record);
+
+    // Flush everything and set the header flags (ignored for version 1
+    // headers). The file is incomplete until this returns.
+    void finish(uint32_t flags);
+
+private:
+    std::string filename;
+    FILE* file;
+    RecordLayout layout;
+    DeltaVarintCodec varint;
+    std::vector<ContactRecord> block_records;  // Columnar records not yet in a block
+    std::vector<char> buffer;
+    long flags_offset;  // Where the flags are in the file, -1 for version 1 headers
+
+    void flush();
+};
+
+#endif
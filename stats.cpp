@@ -0,0 +1,106 @@
+#include "stats.h"
+#include <iomanip>
+#include <sys/resource.h>
+#include <time.h>
+
+namespace {
+
+double clockSeconds(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// 0 rather than a NaN or infinity, which JSON cannot hold
+double ratio(double numerator, double denominator) {
+    return denominator > 0 ? numerator / denominator : 0.0;
+}
+
+void writeFilter(std::ostream& out, const char* name, uint64_t rejected, uint64_t entered, bool last) {
+    out << "      \"" << name << "\": {\"rejected\": " << rejected
+        << ", \"rejection_rate\": " << ratio(rejected, entered) << "}" << (last ? "\n" : ",\n");
+}
+
+} // namespace
+
+void RunStats::addStage(const std::string& name, double wall_seconds, double cpu_seconds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& stage : stages) {
+        if (stage.name == name) {
+            stage.wall += wall_seconds;
+            stage.cpu += cpu_seconds;
+            stage.count++;
+            return;
+        }
+    }
+    stages.push_back(Stage{name, wall_seconds, cpu_seconds, 1});
+}
+
+void RunStats::addScan(const ScanCounters& counters, uint64_t bytes, uint64_t file_size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    scan.add(counters);
+    record_bytes += bytes;
+    file_bytes += file_size;
+}
+
+void RunStats::writeJson(std::ostream& out) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    struct rusage usage;
+    const uint64_t peak_rss = getrusage(RUSAGE_SELF, &usage) == 0 ? static_cast<uint64_t>(usage.ru_maxrss) * 1024 : 0;
+
+    double scan_wall = 0;
+    for (const auto& stage : stages) {
+        if (stage.name == "scan") scan_wall = stage.wall;
+    }
+
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << std::setprecision(9);
+    out << "{\n  \"stages\": {\n";
+    for (size_t i = 0; i < stages.size(); i++) {
+        const Stage& stage = stages[i];
+        out << "    \"" << stage.name << "\": {\"wall_seconds\": " << stage.wall << ", \"cpu_seconds\": "
+            << stage.cpu << ", \"count\": " << stage.count << "}" << (i + 1 < stages.size() ? ",\n" : "\n");
+    }
+    out << "  },\n";
+
+    // Each filter sees the records the ones before it let through
+    const uint64_t after_value = scan.records - scan.value_rejected;
+    const uint64_t after_mode = after_value - scan.mode_rejected;
+    const uint64_t after_band = after_mode - scan.band_rejected;
+    out << "  \"scan\": {\n"
+        << "    \"records\": " << scan.records << ",\n"
+        << "    \"record_bytes\": " << record_bytes << ",\n"
+        << "    \"file_bytes\": " << file_bytes << ",\n"
+        << "    \"records_per_second\": " << ratio(scan.records, scan_wall) << ",\n"
+        << "    \"record_bytes_per_second\": " << ratio(record_bytes, scan_wall) << ",\n"
+        << "    \"filters\": {\n";
+    writeFilter(out, "value", scan.value_rejected, scan.records, false);
+    writeFilter(out, "inter_intra", scan.mode_rejected, after_value, false);
+    writeFilter(out, "distance_band", scan.band_rejected, after_mode, false);
+    writeFilter(out, "regions_of_interest", scan.roi_rejected, after_band, true);
+    out << "    },\n"
+        << "    \"matched_contacts\": " << scan.matched << ",\n"
+        << "    \"loop_hits\": " << scan.loop_hits << ",\n"
+        << "    \"loop_hits_per_matched_contact\": " << ratio(scan.loop_hits, scan.matched) << "\n"
+        << "  },\n"
+        << "  \"peak_rss_bytes\": " << peak_rss << "\n"
+        << "}\n";
+    out.flags(flags);
+    out.precision(precision);
+}
+
+StageTimer::StageTimer(RunStats* stats, const char* name)
+    : stats(stats), name(name), wall_start(0), cpu_start(0) {
+    if (stats) {
+        wall_start = clockSeconds(CLOCK_MONOTONIC);
+        cpu_start = clockSeconds(CLOCK_PROCESS_CPUTIME_ID);
+    }
+}
+
+StageTimer::~StageTimer() {
+    if (stats) {
+        stats->addStage(name, clockSeconds(CLOCK_MONOTONIC) - wall_start,
+                        clockSeconds(CLOCK_PROCESS_CPUTIME_ID) - cpu_start);
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// What the scan did with the records it read. Each record is rejected by
+// the first filter it fails, in this order.
+struct ScanCounters {
+    uint64_t records;
+    uint64_t value_rejected;   // Zero, negative, infinite or NaN value
+    uint64_t mode_rejected;    // Unknown chromosome, inter/intra mismatch, another shard's pair or unsampled
+    uint64_t band_rejected;    // Intra: outside every index's distance band
+    uint64_t roi_rejected;     // Outside the windows of every set
+    uint64_t matched;          // Inside the windows of some set
+    uint64_t loop_hits;        // Loop windows the matched contacts were added to
+
+    ScanCounters()
+        : records(0), value_rejected(0), mode_rejected(0), band_rejected(0), roi_rejected(0), matched(0),
+          loop_hits(0) {}
+
+    void add(const ScanCounters& other) {
+        records += other.records;
+        value_rejected += other.value_rejected;
+        mode_rejected += other.mode_rejected;
+        band_rejected += other.band_rejected;
+        roi_rejected += other.roi_rejected;
+        matched += other.matched;
+        loop_hits += other.loop_hits;
+    }
+};
+
+// Per-stage wall and CPU time of a run and what its scans read, for
+// --stats. Thread-safe, so the jobs of a batch can add to one; their CPU
+// time is the process's, so stages of jobs that overlap count it twice.
+class RunStats {
+public:
+    RunStats() : record_bytes(0), file_bytes(0) {}
+
+    // Stages are reported in the order they are first added
+    void addStage(const std::string& name, double wall_seconds, double cpu_seconds);
+
+    // One scan of a slice: the records' counters, their bytes as handed to
+    // the scan (decompressed and decoded) and the bytes of the file
+    void addScan(const ScanCounters& counters, uint64_t record_bytes, uint64_t file_bytes);
+
+    // Stages, rates, filter rejections and peak RSS as a JSON object
+    void writeJson(std::ostream& out) const;
+
+private:
+    struct Stage {
+        std::string name;
+        double wall;
+        double cpu;
+        uint64_t count;
+    };
+
+    mutable std::mutex mutex;
+    std::vector<Stage> stages;
+    ScanCounters scan;
+    uint64_t record_bytes;
+    uint64_t file_bytes;
+};
+
+// Adds the time from construction to destruction to a stage of stats;
+// does nothing for null stats
+class StageTimer {
+public:
+    StageTimer(RunStats* stats, const char* name);
+    ~StageTimer();
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    RunStats* stats;
+    const char* name;
+    double wall_start;
+    double cpu_start;
+};
+
+#endif
@@ -0,0 +1,192 @@
+#include "test_util.h"
+#include "bedpe_builder.h"
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <set>
+
+// buildBedpe matches pairing every forward anchor with every reverse anchor
+// and sorting the unique loops with std::sort
+
+namespace {
+
+struct Anchor {
+    std::string chrom;
+    long start;
+    long end;
+};
+
+void writeBed(const std::string& filename, const std::vector<Anchor>& anchors) {
+    std::ofstream out(filename);
+    for (const auto& anchor : anchors) out << anchor.chrom << "\t" << anchor.start << "\t" << anchor.end << "\n";
+}
+
+std::vector<Anchor> randomAnchors(std::mt19937_64& rng, const std::vector<std::string>& chroms, size_t count,
+                                  long span, long max_width) {
+    std::uniform_int_distribution<size_t> pick_chrom(0, chroms.size() - 1);
+    std::uniform_int_distribution<long> pick_start(0, span);
+    std::uniform_int_distribution<long> pick_width(0, max_width);
+    std::vector<Anchor> anchors;
+    for (size_t i = 0; i < count; i++) {
+        Anchor anchor;
+        anchor.chrom = chroms[pick_chrom(rng)];
+        anchor.start = pick_start(rng);
+        anchor.end = anchor.start + pick_width(rng);
+        anchors.push_back(anchor);
+    }
+    return anchors;
+}
+
+// The loops buildBedpe should return, by the definition rather than the
+// windowed scan: every (forward, reverse) pair on one chromosome with the
+// midpoint distance in (min, max] and the forward anchor ending first
+std::vector<BedpeEntry> bruteForceIntra(const std::vector<Anchor>& forwards, const std::vector<Anchor>& reverses,
+                                        long min_dist, long max_dist, const std::vector<std::string>& names) {
+    std::vector<BedpeEntry> entries;
+    for (const auto& f : forwards) {
+        for (const auto& r : reverses) {
+            const long distance = (r.start + r.end) / 2 - (f.start + f.end) / 2;
+            if (f.chrom != r.chrom || distance <= min_dist || distance > max_dist || f.end >= r.start) continue;
+            BedpeEntry entry;
+            entry.chrom1 = entry.chrom2 = static_cast<int32_t>(
+                std::lower_bound(names.begin(), names.end(), f.chrom) - names.begin());
+            entry.start1 = f.start;
+            entry.end1 = f.end;
+            entry.start2 = r.start;
+            entry.end2 = r.end;
+            entries.push_back(entry);
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+    entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+    return entries;
+}
+
+std::vector<std::string> chromNames(const std::vector<Anchor>& forwards, const std::vector<Anchor>& reverses) {
+    std::set<std::string> names;
+    for (const auto& a : forwards) names.insert(a.chrom);
+    for (const auto& a : reverses) names.insert(a.chrom);
+    return std::vector<std::string>(names.begin(), names.end());
+}
+
+std::vector<BedpeEntry> bruteForceInter(const std::vector<Anchor>& forwards, const std::vector<Anchor>& reverses,
+                                        const std::vector<std::string>& names) {
+    std::vector<BedpeEntry> entries;
+    for (const auto& f : forwards) {
+        for (const auto& r : reverses) {
+            if (!BedpeBuilder::isInterPair(f.chrom, r.chrom)) continue;
+            BedpeEntry entry;
+            entry.chrom1 = static_cast<int32_t>(std::lower_bound(names.begin(), names.end(), f.chrom) - names.begin());
+            entry.chrom2 = static_cast<int32_t>(std::lower_bound(names.begin(), names.end(), r.chrom) - names.begin());
+            entry.start1 = f.start;
+            entry.end1 = f.end;
+            entry.start2 = r.start;
+            entry.end2 = r.end;
+            entries.push_back(entry);
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+    entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+    return entries;
+}
+
+bool sameEntries(const std::vector<BedpeEntry>& a, const std::vector<BedpeEntry>& b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (!(a[i] == b[i]) || a[i].end1 != b[i].end1 || a[i].end2 != b[i].end2) return false;
+    }
+    return true;
+}
+
+void testIntra(const test::TempDir& dir, const std::vector<Anchor>& forwards, const std::vector<Anchor>& reverses,
+               long min_dist, long max_dist, int threads) {
+    const std::string forward_bed = dir.path("forward.bed");
+    const std::string reverse_bed = dir.path("reverse.bed");
+    writeBed(forward_bed, forwards);
+    writeBed(reverse_bed, reverses);
+    const BedpeTable table = BedpeBuilder(forward_bed, reverse_bed, min_dist, max_dist, false, threads).buildBedpe();
+    const std::vector<std::string> names = chromNames(forwards, reverses);
+    CHECK(table.chromNames == names);
+    CHECK(sameEntries(table.entries, bruteForceIntra(forwards, reverses, min_dist, max_dist, names)));
+}
+
+void testRandomIntra(const test::TempDir& dir) {
+    std::mt19937_64 rng(7);
+    const std::vector<std::string> chroms = {"chr1", "chr2", "chr10", "chrX"};
+    // Dense anchors so that windows hold many reverses, wide anchors that
+    // overlap, and distances from zero to beyond the chromosome
+    const long limits[][2] = {{0, 50000}, {10000, 200000}, {-1, 1000000}, {0, 0}, {100000, 100001}};
+    for (const auto& limit : limits) {
+        for (int threads = 1; threads <= 4; threads += 3) {
+            testIntra(dir, randomAnchors(rng, chroms, 600, 1000000, 20000),
+                      randomAnchors(rng, chroms, 600, 1000000, 20000), limit[0], limit[1], threads);
+        }
+    }
+}
+
+void testInter(const test::TempDir& dir, const std::vector<Anchor>& forwards, const std::vector<Anchor>& reverses) {
+    const std::string forward_bed = dir.path("forward.bed");
+    const std::string reverse_bed = dir.path("reverse.bed");
+    writeBed(forward_bed, forwards);
+    writeBed(reverse_bed, reverses);
+    const BedpeTable table = BedpeBuilder(forward_bed, reverse_bed, 0, 0, true, 3).buildBedpe();
+    const std::vector<std::string> names = chromNames(forwards, reverses);
+    CHECK(table.chromNames == names);
+    CHECK(sameEntries(table.entries, bruteForceInter(forwards, reverses, names)));
+}
+
+// Anchors from a few starts with many ends, each listed twice, so that the
+// radix sort's keys tie and the tie runs need their own sort
+std::vector<Anchor> tiedAnchors(std::mt19937_64& rng, const std::vector<std::string>& chroms, long base) {
+    std::vector<Anchor> anchors = randomAnchors(rng, chroms, 200, 50, 3000);
+    for (auto& anchor : anchors) {
+        anchor.start = base + anchor.start * 1000;
+        anchor.end += base + anchor.start % 7;
+        anchor.end = std::max(anchor.end, anchor.start);
+    }
+    std::vector<Anchor> doubled = anchors;
+    doubled.insert(doubled.end(), anchors.rbegin(), anchors.rend());
+    return doubled;
+}
+
+// Anchors sharing a start whose ends 2j and 2j + 1 give the same truncated
+// midpoint, listed larger end first, so that only the anchor order within
+// equal midpoints keeps runs of equal starts sorted by their ends
+std::vector<Anchor> equalMidAnchors(const std::vector<std::string>& chroms, long base) {
+    std::vector<Anchor> anchors;
+    for (const auto& chrom : chroms) {
+        for (long k = 0; k < 40; k++) {
+            for (long end = 2 * (k % 5) + 601; end >= 600; end--) {
+                Anchor anchor = {chrom, base + k * 2000, base + k * 2000 + end};
+                anchors.push_back(anchor);
+            }
+        }
+    }
+    return anchors;
+}
+
+void testSortTies(const test::TempDir& dir) {
+    std::mt19937_64 rng(11);
+    const std::vector<std::string> chroms = {"chr1", "chr2", "chr3"};
+    // Starts beyond 32 bits take std::sort rather than the radix sort; both
+    // must give the same order
+    const long bases[] = {0, 5000000000L};
+    for (long base : bases) {
+        testIntra(dir, tiedAnchors(rng, chroms, base), tiedAnchors(rng, chroms, base + 20000), 0, 100000, 2);
+        testInter(dir, tiedAnchors(rng, chroms, base), tiedAnchors(rng, chroms, base));
+    }
+    testIntra(dir, equalMidAnchors(chroms, 0), equalMidAnchors(chroms, 30000), 0, 100000, 2);
+    testInter(dir, equalMidAnchors(chroms, 0), equalMidAnchors(chroms, 0));
+    testInter(dir, randomAnchors(rng, {"chr1", "chr2", "chr10", "chrX", "chrY"}, 300, 1000000, 5000),
+              randomAnchors(rng, {"chr1", "chr2", "chr10", "chrX", "chrM"}, 300, 1000000, 5000));
+}
+
+} // namespace
+
+int main() {
+    return test::runTests([] {
+        test::TempDir dir;
+        testRandomIntra(dir);
+        testSortTies(dir);
+    });
+}
@@ -0,0 +1,148 @@
+#include "test_util.h"
+#include "slice_reader.h"
+
+// The block index footer describes the records exactly, selected blocks read
+// back exactly their records, and indexing leaves the records unchanged
+// (moving them behind a version 2 header in version 1 files)
+
+namespace {
+
+// Each record lies within its pair's extent, and each extent bound is met
+// by some record
+bool extentsAreTight(const SliceBlock& block, const std::vector<ContactRecord>& records) {
+    std::vector<BlockExtent> seen;
+    for (const auto& record : records) {
+        const BlockExtent* extent = nullptr;
+        for (const auto& e : block.extents) {
+            if (e.chr1Key == record.chr1Key && e.chr2Key == record.chr2Key) extent = &e;
+        }
+        if (!extent || record.binX < extent->minBinX || record.binX > extent->maxBinX ||
+            record.binY < extent->minBinY || record.binY > extent->maxBinY) {
+            return false;
+        }
+        bool found = false;
+        for (auto& s : seen) {
+            if (s.chr1Key != record.chr1Key || s.chr2Key != record.chr2Key) continue;
+            s.minBinX = std::min(s.minBinX, record.binX);
+            s.maxBinX = std::max(s.maxBinX, record.binX);
+            s.minBinY = std::min(s.minBinY, record.binY);
+            s.maxBinY = std::max(s.maxBinY, record.binY);
+            found = true;
+        }
+        if (!found) {
+            BlockExtent e = {record.chr1Key, record.chr2Key, record.binX, record.binX, record.binY, record.binY};
+            seen.push_back(e);
+        }
+    }
+    if (seen.size() != block.extents.size()) return false;
+    for (const auto& s : seen) {
+        for (const auto& e : block.extents) {
+            if (e.chr1Key == s.chr1Key && e.chr2Key == s.chr2Key &&
+                (e.minBinX != s.minBinX || e.maxBinX != s.maxBinX || e.minBinY != s.minBinY ||
+                 e.maxBinY != s.maxBinY)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+std::vector<ContactRecord> readSelected(const std::string& filename, const std::vector<bool>& wanted) {
+    std::unique_ptr<SliceReader> reader = SliceReader::open(filename);
+    reader->selectBlocks(wanted);
+    return test::readAll(*reader);
+}
+
+void testIndex(const test::TempDir& dir, RecordLayout layout, bool sorted) {
+    // Several blocks, the last one partial
+    const std::vector<ContactRecord> records = test::randomContacts(100003, 3, 4000, true, sorted, 5);
+    const std::string file = dir.path("indexed.hicslice");
+    test::writeSlice(file, 5000, test::chromNames(3), records, layout, sorted ? SLICE_FLAG_SORTED : 0);
+    const std::string unindexed = test::fileBytes(file);
+
+    const size_t count = writeSliceIndex(file);
+    const std::string indexed = test::fileBytes(file);
+    CHECK(indexed.size() > unindexed.size());
+
+    // A version 1 file gets the version 2 fields after the magic, with -1
+    // where old readers look for the resolution; other bytes stay in place
+    const bool version1 = layout == RecordLayout::Padded20;
+    const size_t shift = version1 ? 16 : 0;
+    CHECK(indexed.compare(0, 8, unindexed, 0, 8) == 0);
+    CHECK(indexed.compare(8 + shift, unindexed.size() - 8, unindexed, 8, std::string::npos) == 0);
+    const SliceHeader header = SliceReader::open(file)->header();
+    CHECK(header.version == 2);
+    CHECK(header.layout == layout);
+    CHECK(header.sorted() == sorted);
+    if (version1) CHECK(static_cast<int32_t>(loadLE32(&indexed[8])) == -1);
+
+    // Indexing again replaces the footer rather than appending another
+    CHECK(writeSliceIndex(file) == count);
+    CHECK(test::fileBytes(file) == indexed);
+
+    std::unique_ptr<SliceReader> reader = SliceReader::open(file);
+    const std::vector<SliceBlock> blocks = reader->blocks();
+    CHECK(blocks.size() == count);
+    CHECK(count > 2);
+    CHECK(test::sameRecords(test::readAll(*reader), records));
+
+    const size_t record_bytes = recordBytes(layout);
+    uint64_t total = 0;
+    std::vector<size_t> first_record;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        first_record.push_back(total);
+        total += blocks[i].numRecords;
+        CHECK(blocks[i].numRecords > 0);
+        if (i > 0) CHECK(blocks[i].offset == blocks[i - 1].offset + blocks[i - 1].numRecords * record_bytes);
+    }
+    CHECK(total == records.size());
+    CHECK(blocks.back().offset + blocks.back().numRecords * record_bytes == unindexed.size() + shift);
+
+    std::vector<bool> alternate(blocks.size());
+    std::vector<ContactRecord> expected_alternate;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        const std::vector<ContactRecord> block_records(records.begin() + first_record[i],
+                                                       records.begin() + first_record[i] + blocks[i].numRecords);
+        CHECK(extentsAreTight(blocks[i], block_records));
+        std::vector<bool> only(blocks.size());
+        only[i] = true;
+        CHECK(test::sameRecords(readSelected(file, only), block_records));
+        if (i % 2 == 0) {
+            alternate[i] = true;
+            expected_alternate.insert(expected_alternate.end(), block_records.begin(), block_records.end());
+        }
+    }
+    CHECK(test::sameRecords(readSelected(file, alternate), expected_alternate));
+    CHECK(readSelected(file, std::vector<bool>(blocks.size())).empty());
+    CHECK(test::sameRecords(readSelected(file, std::vector<bool>(blocks.size(), true)), records));
+}
+
+// Compressed slices and variable-size records cannot be indexed
+void testRejected(const test::TempDir& dir) {
+    const std::vector<ContactRecord> records = test::randomContacts(1000, 2, 100, false, true, 1);
+    const std::string file = dir.path("plain.hicslice");
+    const std::string compressed = dir.path("compressed.hicslice");
+    test::writeSlice(file, 5000, test::chromNames(2), records, RecordLayout::Packed16);
+    test::gzipFile(file, compressed);
+    CHECK(test::throws([&] { writeSliceIndex(compressed); }));
+
+    const RecordLayout variable[] = {RecordLayout::DeltaVarint, RecordLayout::Columnar};
+    for (RecordLayout layout : variable) {
+        const std::string variable_file = dir.path("variable.hicslice");
+        test::writeSlice(variable_file, 5000, test::chromNames(2), records, layout);
+        CHECK(test::throws([&] { writeSliceIndex(variable_file); }));
+    }
+}
+
+} // namespace
+
+int main() {
+    return test::runTests([] {
+        test::TempDir dir;
+        testIndex(dir, RecordLayout::Padded20, true);
+        testIndex(dir, RecordLayout::Padded20, false);
+        testIndex(dir, RecordLayout::Packed16, true);
+        testIndex(dir, RecordLayout::Packed16, false);
+        testRejected(dir);
+    });
+}
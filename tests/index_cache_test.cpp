@@ -0,0 +1,117 @@
+#include "test_util.h"
+#include "apa.h"
+#include "bedpe_builder.h"
+#include "index_cache.h"
+#include <cstdio>
+#include <fstream>
+
+// A cold run stores its loop indices, a warm run loads them and needs no
+// BEDPE entries, and a damaged cache file is removed and rebuilt rather
+// than failing the run. A checked index is kept, not read again.
+
+namespace {
+
+const long MIN_DIST = 20000;
+const long MAX_DIST = 2000000;
+
+std::string cacheFile(const std::string& directory, uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.apaidx", static_cast<unsigned long long>(key));
+    return directory + "/" + name;
+}
+
+bool exists(const std::string& filename) {
+    return static_cast<bool>(std::ifstream(filename));
+}
+
+} // namespace
+
+int main() {
+    return test::runTests([] {
+        test::TempDir dir;
+        const int num_chroms = 3;
+        const int32_t resolution = 5000;
+        const int32_t bins = 4000;
+        const std::string slice = dir.path("cache.hicslice");
+        test::writeSlice(slice, resolution, test::chromNames(num_chroms),
+                         test::randomContacts(200000, num_chroms, bins, false, true, 5), RecordLayout::Packed16,
+                         SLICE_FLAG_SORTED);
+        const std::string forward_bed = dir.path("forward.bed");
+        const std::string reverse_bed = dir.path("reverse.bed");
+        test::writeBeds(forward_bed, reverse_bed, num_chroms, static_cast<long>(bins) * resolution, 3);
+        const std::vector<BedpeTable> tables = {
+            BedpeBuilder(forward_bed, reverse_bed, MIN_DIST, MAX_DIST, false).buildBedpe()};
+        const std::vector<BedpeTable> no_tables(1);
+
+        const std::vector<ApaConfig> configs = {{10, 1}, {5, 2}};
+        const std::vector<APAMatrix> exact =
+            processSliceFile(slice, tables, configs, false, MIN_DIST, MAX_DIST, 2);
+
+        const std::string directory = dir.path("cache");
+        const std::vector<uint64_t> set_hashes = {
+            IndexCache::hashLoopInputs(forward_bed, reverse_bed, MIN_DIST, MAX_DIST, false)};
+        const SliceHeader header = SliceReader::open(slice)->header();
+        std::vector<uint64_t> keys;
+        {
+            const IndexCache cache(directory, set_hashes);
+            for (const auto& config : configs) {
+                keys.push_back(cache.key(0, config, header.resolution, header.chromosomes));
+            }
+        }
+
+        auto run = [&](const std::vector<BedpeTable>& sets) {
+            const IndexCache cache(directory, set_hashes);
+            return processSliceFile(slice, sets, configs, false, MIN_DIST, MAX_DIST, 2, 0, &cache);
+        };
+        auto matchesExact = [&](const std::vector<APAMatrix>& matrices) {
+            bool same = matrices.size() == exact.size();
+            for (size_t i = 0; same && i < matrices.size(); i++) same = test::sameMatrix(matrices[i], exact[i], 0);
+            return same;
+        };
+        auto allCached = [&] {
+            const IndexCache cache(directory, set_hashes);
+            bool cached = true;
+            for (uint64_t key : keys) cached = cached && cache.contains(key);
+            return cached;
+        };
+
+        // Cold: nothing cached; the run builds and stores every index
+        CHECK(!allCached());
+        CHECK(matchesExact(run(tables)));
+        CHECK(allCached());
+
+        // Warm: the indices load, and the run needs no tables
+        CHECK(matchesExact(run(no_tables)));
+
+        // Truncated: contains() reads the whole file, says no and removes it
+        const std::string damaged = cacheFile(directory, keys[0]);
+        std::string bytes = test::fileBytes(damaged);
+        std::ofstream(damaged, std::ios::binary | std::ios::trunc) << bytes.substr(0, bytes.size() - 100);
+        CHECK(!allCached());
+        CHECK(!exists(damaged));
+        CHECK(matchesExact(run(tables)));
+        CHECK(allCached());
+
+        // Truncated without asking first: the run rebuilds the index from
+        // its table and stores it again
+        bytes = test::fileBytes(damaged);
+        std::ofstream(damaged, std::ios::binary | std::ios::trunc) << bytes.substr(0, bytes.size() - 100);
+        CHECK(matchesExact(run(tables)));
+        CHECK(allCached());
+        CHECK(matchesExact(run(no_tables)));
+
+        // Checked once: contains() keeps what it loaded, so cachedBytes()
+        // and find() do not read the file again, and find() hands it over
+        {
+            const IndexCache cache(directory, set_hashes);
+            CHECK(cache.contains(keys[0]) && cache.contains(keys[1]));
+            std::remove(cacheFile(directory, keys[0]).c_str());
+            std::remove(cacheFile(directory, keys[1]).c_str());
+            CHECK(cache.cachedBytes(keys[0]) > 0);
+            CHECK(cache.find(keys[0]) != nullptr);
+            CHECK(cache.find(keys[0]) == nullptr);
+            cache.release(keys[1]);
+            CHECK(cache.cachedBytes(keys[1]) == 0);
+        }
+    });
+}
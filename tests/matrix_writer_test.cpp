@@ -0,0 +1,186 @@
+#include "test_util.h"
+#include "apa.h"
+#include "matrix_writer.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <zlib.h>
+
+// formatFixed6 prints what printf does, text output is what the stream
+// writer it replaced printed, and the binary formats hold the exact floats
+
+namespace {
+
+void testFormatFixed6() {
+    std::vector<float> values = {0.0f, -0.0f, 1.0f, -1.0f, 0.5f, 0.0000005f, 0.0000015f, 0.0000025f, 1e-7f,
+                                 -1e-7f, 123456.789f, 16777216.0f, 1e10f, 1e19f, 1e20f, 3.4e38f, -3.4e38f,
+                                 std::numeric_limits<float>::denorm_min(), std::numeric_limits<float>::min(),
+                                 std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(),
+                                 std::numeric_limits<float>::quiet_NaN()};
+    // Random bit patterns, then values at and next to rounding ties
+    std::mt19937 rng(3);
+    for (int i = 0; i < 200000; i++) {
+        uint32_t bits = rng();
+        float value;
+        std::memcpy(&value, &bits, 4);
+        values.push_back(value);
+    }
+    for (int i = 0; i < 200000; i++) {
+        const float tie = (static_cast<float>(rng() % 20000000) + 0.5f) / 1e6f;
+        values.push_back(tie);
+        values.push_back(std::nextafter(tie, 0.0f));
+        values.push_back(std::nextafter(tie, 100.0f));
+    }
+
+    int mismatches = 0;
+    for (float value : values) {
+        char expected[512], actual[512];
+        std::snprintf(expected, sizeof(expected), "%.6f", value);
+        const size_t length = formatFixed6(value, actual);
+        if (length != std::strlen(expected) || std::memcmp(actual, expected, length) != 0) {
+            if (mismatches++ < 5) {
+                std::cerr << "formatFixed6(" << std::hexfloat << value << ") gave " << std::string(actual, length)
+                          << ", expected " << expected << std::endl;
+            }
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+APAMatrix randomMatrix(int width, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::exponential_distribution<float> value(0.01f);
+    APAMatrix matrix(width);
+    for (int r = 0; r < width; r++) {
+        for (int c = 0; c < width; c++) matrix.add(r, c, (r + c) % 5 == 0 ? 0.0f : value(rng));
+    }
+    return matrix;
+}
+
+std::string asString(const std::vector<char>& bytes) {
+    return std::string(bytes.begin(), bytes.end());
+}
+
+// The text writer before binary output existed
+std::string streamText(const APAMatrix& matrix) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(6);
+    for (int i = 0; i < matrix.width; i++) {
+        for (int j = 0; j < matrix.width; j++) {
+            if (j > 0) out << " ";
+            out << matrix.at(i, j);
+        }
+        out << "\n";
+    }
+    return out.str();
+}
+
+bool holdsFloats(const std::vector<char>& bytes, size_t offset, const APAMatrix& matrix) {
+    if (bytes.size() != offset + 4 * static_cast<size_t>(matrix.width) * matrix.width) return false;
+    for (int r = 0; r < matrix.width; r++) {
+        for (int c = 0; c < matrix.width; c++, offset += 4) {
+            const float value = loadLEFloat(&bytes[offset]);
+            if (std::memcmp(&value, &matrix.data[static_cast<size_t>(r) * matrix.stride + c], 4) != 0) return false;
+        }
+    }
+    return true;
+}
+
+void testEncodings() {
+    const int widths[] = {1, 21, 16, 17};
+    for (int width : widths) {
+        const APAMatrix matrix = randomMatrix(width, static_cast<uint64_t>(width));
+        CHECK(asString(encodeMatrix(matrix, MatrixFormat::Text)) == streamText(matrix));
+
+        const std::vector<char> f32 = encodeMatrix(matrix, MatrixFormat::Float32);
+        CHECK(f32.size() >= 12 && std::memcmp(f32.data(), "APAMF32\0", 8) == 0);
+        CHECK(f32.size() >= 12 && loadLE32(&f32[8]) == static_cast<uint32_t>(width));
+        CHECK(holdsFloats(f32, 12, matrix));
+
+        const std::vector<char> npy = encodeMatrix(matrix, MatrixFormat::Npy);
+        CHECK(npy.size() >= 10 && std::memcmp(npy.data(), "\x93NUMPY\x01\x00", 8) == 0);
+        const size_t header_length =
+            npy.size() >= 10 ? static_cast<uint8_t>(npy[8]) | (static_cast<uint8_t>(npy[9]) << 8) : 0;
+        const size_t data_offset = 10 + header_length;
+        CHECK(data_offset % 64 == 0 && npy.size() >= data_offset);
+        const std::string header = asString(npy).substr(10, header_length);
+        const std::string shape = "(" + std::to_string(width) + ", " + std::to_string(width) + ")";
+        CHECK(header.compare(0, 1, "{") == 0 && header[header.size() - 1] == '\n');
+        CHECK(header.find("'descr': '<f4'") != std::string::npos);
+        CHECK(header.find("'fortran_order': False") != std::string::npos);
+        CHECK(header.find("'shape': " + shape) != std::string::npos);
+        CHECK(holdsFloats(npy, data_offset, matrix));
+    }
+}
+
+std::string readPlain(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+std::string readGzip(const std::string& filename) {
+    gzFile in = gzopen(filename.c_str(), "rb");
+    std::string contents;
+    if (!in) return contents;
+    char buffer[1 << 16];
+    int n;
+    while ((n = gzread(in, buffer, sizeof(buffer))) > 0) contents.append(buffer, n);
+    gzclose(in);
+    return contents;
+}
+
+// Written files hold the encoding, gzip-compressed as asked
+void testFiles(const test::TempDir& dir) {
+    const APAMatrix matrix = randomMatrix(21, 99);
+    const char* formats[] = {"text", "f32", "npy", "text.gz", "f32.gz", "npy.gz"};
+    for (const char* name : formats) {
+        const OutputFormat format = parseOutputFormat(name);
+        const std::string file = dir.path(std::string("matrix.") + name);
+        writeMatrix(matrix, file, format);
+        const std::string expected = asString(encodeMatrix(matrix, format.matrix));
+        const std::string plain = readPlain(file);
+        if (format.gzip) {
+            CHECK(plain.size() > 2 && static_cast<uint8_t>(plain[0]) == 0x1f &&
+                  static_cast<uint8_t>(plain[1]) == 0x8b);
+            CHECK(readGzip(file) == expected);
+        } else {
+            CHECK(plain == expected);
+        }
+    }
+
+    std::vector<APAMatrix> matrices;
+    std::vector<std::string> files;
+    for (int i = 0; i < 8; i++) {
+        matrices.push_back(randomMatrix(5 + i, static_cast<uint64_t>(i)));
+        files.push_back(dir.path("parallel" + std::to_string(i) + ".npy"));
+    }
+    writeMatrices(matrices, files, parseOutputFormat("npy"), 4);
+    for (size_t i = 0; i < files.size(); i++) {
+        CHECK(readPlain(files[i]) == asString(encodeMatrix(matrices[i], MatrixFormat::Npy)));
+    }
+
+    bool threw = false;
+    try {
+        parseOutputFormat("csv");
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+} // namespace
+
+int main() {
+    return test::runTests([] {
+        test::TempDir dir;
+        testFormatFixed6();
+        testEncodings();
+        testFiles(dir);
+    });
+}
@@ -0,0 +1,167 @@
+#include "test_util.h"
+#include "apa.h"
+#include "bedpe_builder.h"
+#include "stats.h"
+#include <sstream>
+
+// A scan gives the same matrices however its work is split, across
+// threads, passes or sample rounds: integer counts exactly, float values
+// up to reassociation of their sums
+
+namespace {
+
+const long MIN_DIST = 20000;
+const long MAX_DIST = 2000000;
+const int NUM_CHROMS = 3;
+const int NUM_SETS = 2;
+
+struct Inputs {
+    std::string slice;
+    std::vector<BedpeTable> tables;
+};
+
+// Unsorted, or sorted with a block index
+Inputs makeInputs(const test::TempDir& dir, const std::string& name, bool float_values, bool indexed = false) {
+    const int num_chroms = NUM_CHROMS;
+    const int32_t resolution = 5000;
+    const int32_t bins = 4000;
+    Inputs inputs;
+    inputs.slice = dir.path(name + ".hicslice");
+    test::writeSlice(inputs.slice, resolution, test::chromNames(num_chroms),
+                     test::randomContacts(400000, num_chroms, bins, float_values, indexed, 11), RecordLayout::Packed16,
+                     indexed ? SLICE_FLAG_SORTED : 0);
+    if (indexed) writeSliceIndex(inputs.slice);
+    for (int set = 0; set < NUM_SETS; set++) {
+        const std::string forward_bed = dir.path(name + "_forward" + std::to_string(set) + ".bed");
+        const std::string reverse_bed = dir.path(name + "_reverse" + std::to_string(set) + ".bed");
+        test::writeBeds(forward_bed, reverse_bed, num_chroms, static_cast<long>(bins) * resolution, 4 + set);
+        inputs.tables.push_back(BedpeBuilder(forward_bed, reverse_bed, MIN_DIST, MAX_DIST, false).buildBedpe());
+    }
+    return inputs;
+}
+
+bool sameMatrices(const std::vector<APAMatrix>& a, const std::vector<APAMatrix>& b, double max_relative) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (!test::sameMatrix(a[i], b[i], max_relative)) return false;
+    }
+    return true;
+}
+
+// Worker threads each sum the batches dealt to them, and the sums are
+// added at the end
+void testThreads(const Inputs& inputs, double max_relative) {
+    const std::vector<ApaConfig> configs = {{10, 1}, {5, 2}};
+    const std::vector<APAMatrix> single =
+        processSliceFile(inputs.slice, inputs.tables, configs, false, MIN_DIST, MAX_DIST, 1);
+    const std::vector<APAMatrix> threaded =
+        processSliceFile(inputs.slice, inputs.tables, configs, false, MIN_DIST, MAX_DIST, 4);
+    CHECK(sameMatrices(threaded, single, max_relative));
+}
+
+// The slice reads of a run, from the count of its "scan" stage
+int scans(const RunStats& stats) {
+    std::ostringstream json;
+    stats.writeJson(json);
+    const std::string text = json.str();
+    return std::stoi(text.substr(text.find("\"count\": ", text.find("\"scan\": {")) + 9));
+}
+
+// The records the scans of a run read
+uint64_t recordsRead(const RunStats& stats) {
+    std::ostringstream json;
+    stats.writeJson(json);
+    const std::string text = json.str();
+    return std::stoull(text.substr(text.find("\"records\": ") + 11));
+}
+
+// A budget of one byte gives every chromosome of every (set, config) job a
+// pass of its own; a few hundred KB fits whole jobs, a few to a pass. The
+// passes' sums are added before normalizing.
+void testPasses(const Inputs& inputs, double max_relative) {
+    const std::vector<ApaConfig> configs = {{10, 1}, {5, 2}};
+    const int max_passes = NUM_SETS * static_cast<int>(configs.size()) * NUM_CHROMS;
+    RunStats single_stats;
+    const std::vector<APAMatrix> single = processSliceFile(inputs.slice, inputs.tables, configs, false, MIN_DIST,
+                                                           MAX_DIST, 2, UINT64_MAX, nullptr, nullptr, &single_stats);
+    CHECK(scans(single_stats) == 1);
+
+    RunStats split_stats;
+    const std::vector<APAMatrix> split = processSliceFile(inputs.slice, inputs.tables, configs, false, MIN_DIST,
+                                                          MAX_DIST, 1, 1, nullptr, nullptr, &split_stats);
+    CHECK(scans(split_stats) == max_passes);
+    CHECK(sameMatrices(split, single, max_relative));
+
+    RunStats grouped_stats;
+    const std::vector<APAMatrix> grouped = processSliceFile(inputs.slice, inputs.tables, configs, false, MIN_DIST,
+                                                            MAX_DIST, 1, 600000, nullptr, nullptr, &grouped_stats);
+    CHECK(scans(grouped_stats) > 1 && scans(grouped_stats) < max_passes);
+    CHECK(sameMatrices(grouped, single, max_relative));
+}
+
+// Sample rounds read disjoint parts of what the exact scan reads: indexed
+// blocks, or runs of records. The first round alone reads about 1/K of it,
+// and reading all K rounds gives the exact result.
+void testSample(const Inputs& inputs) {
+    const std::vector<ApaConfig> configs = {{10, 1}, {5, 2}};
+    RunStats exact_stats;
+    const std::vector<APAMatrix> exact = processSliceFile(inputs.slice, inputs.tables, configs, false, MIN_DIST,
+                                                          MAX_DIST, 2, 0, nullptr, nullptr, &exact_stats);
+    const uint64_t exact_records = recordsRead(exact_stats);
+
+    SampleOptions sample;
+    sample.every = 4;
+    RunStats first_stats;
+    processSliceFile(inputs.slice, inputs.tables, configs, false, MIN_DIST, MAX_DIST, 2, 0, nullptr, nullptr,
+                     &first_stats, sample);
+    CHECK(scans(first_stats) == 1);
+    CHECK(recordsRead(first_stats) * sample.every >= exact_records / 2 &&
+          recordsRead(first_stats) * sample.every <= exact_records * 2);
+
+    // A tolerance nothing meets reads every round
+    sample.tolerance = 1e-12;
+    RunStats all_stats;
+    const std::vector<APAMatrix> all_rounds = processSliceFile(
+        inputs.slice, inputs.tables, configs, false, MIN_DIST, MAX_DIST, 2, 0, nullptr, nullptr, &all_stats, sample);
+    CHECK(scans(all_stats) == sample.every);
+    CHECK(recordsRead(all_stats) == exact_records);
+    CHECK(sameMatrices(all_rounds, exact, 0));
+}
+
+// A compressed slice can only be sampled by reading it whole, so it gets
+// one round, and rounds until convergence are refused
+void testSampleCompressed(const test::TempDir& dir, const Inputs& inputs) {
+    const std::vector<ApaConfig> configs = {{10, 1}};
+    const std::string compressed = dir.path("compressed.hicslice.gz");
+    test::gzipFile(inputs.slice, compressed);
+    SampleOptions sample;
+    sample.every = 4;
+    RunStats stats;
+    processSliceFile(compressed, inputs.tables, configs, false, MIN_DIST, MAX_DIST, 2, 0, nullptr, nullptr, &stats,
+                     sample);
+    CHECK(scans(stats) == 1);
+    sample.tolerance = 0.01;
+    CHECK(test::throws([&] {
+        processSliceFile(compressed, inputs.tables, configs, false, MIN_DIST, MAX_DIST, 2, 0, nullptr, nullptr,
+                         nullptr, sample);
+    }));
+}
+
+} // namespace
+
+int main() {
+    return test::runTests([] {
+        test::TempDir dir;
+        const Inputs counts = makeInputs(dir, "counts", false);
+        const Inputs floats = makeInputs(dir, "floats", true);
+        // Float sums differ by about 1e-6 relative; a normalized cell carries
+        // the error of its count and of its row and column sums
+        testThreads(counts, 0);
+        testThreads(floats, 5e-6);
+        testPasses(counts, 0);
+        testPasses(floats, 5e-6);
+        testSample(counts);
+        testSample(makeInputs(dir, "indexed", false, true));
+        testSampleCompressed(dir, counts);
+    });
+}
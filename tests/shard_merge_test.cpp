@@ -0,0 +1,201 @@
+#include "test_util.h"
+#include "apa.h"
+#include "bedpe_builder.h"
+#include "stats.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+// The partials of every shard of a slice add up to the result of reading it
+// whole, and partials survive a save and load unchanged
+
+namespace {
+
+const long MIN_DIST = 20000;
+const long MAX_DIST = 2000000;
+
+struct Inputs {
+    std::string slice;
+    std::vector<BedpeTable> tables;
+    std::vector<InterAnchors> anchors;
+};
+
+// Slices are indexed, or compressed (which cannot be read by position), or
+// neither; anchors_on_chr1 leaves the other chromosomes without loops
+Inputs makeInputs(const test::TempDir& dir, const std::string& name, bool float_values, bool indexed,
+                  bool compressed = false, bool anchors_on_chr1 = false) {
+    const int num_chroms = 3;
+    const int32_t resolution = 5000;
+    const int32_t bins = 4000;
+    Inputs inputs;
+    inputs.slice = dir.path(name + ".hicslice");
+    test::writeSlice(inputs.slice, resolution, test::chromNames(num_chroms),
+                     test::randomContacts(400000, num_chroms, bins, float_values, true, 9), RecordLayout::Packed16,
+                     SLICE_FLAG_SORTED);
+    if (indexed) writeSliceIndex(inputs.slice);
+    if (compressed) {
+        test::gzipFile(inputs.slice, inputs.slice + ".gz");
+        inputs.slice += ".gz";
+    }
+
+    const std::string forward_bed = dir.path(name + "_forward.bed");
+    const std::string reverse_bed = dir.path(name + "_reverse.bed");
+    test::writeBeds(forward_bed, reverse_bed, anchors_on_chr1 ? 1 : num_chroms, static_cast<long>(bins) * resolution, 2);
+    inputs.tables.push_back(BedpeBuilder(forward_bed, reverse_bed, MIN_DIST, MAX_DIST, false).buildBedpe());
+    inputs.anchors.push_back(BedpeBuilder(forward_bed, reverse_bed, 0, 0, true).buildInterAnchors());
+    return inputs;
+}
+
+double total(const APAMatrix& matrix) {
+    double sum = 0;
+    for (int r = 0; r < matrix.width; r++) {
+        for (int c = 0; c < matrix.width; c++) sum += matrix.at(r, c);
+    }
+    return sum;
+}
+
+// The records the scans of stats read, from its JSON
+uint64_t recordsRead(const RunStats& stats) {
+    std::ostringstream json;
+    stats.writeJson(json);
+    const std::string text = json.str();
+    return std::stoull(text.substr(text.find("\"records\": ") + 11));
+}
+
+// The sum of the partials of every shard; records_read gets the records
+// each shard read. Shard i runs under budgets[i % budgets.size()], or no
+// budget.
+std::vector<ApaPartial> mergeShards(const Inputs& inputs, const std::vector<ApaConfig>& configs, bool inter,
+                                    int count, std::vector<uint64_t>* records_read = nullptr,
+                                    const std::vector<uint64_t>& budgets = std::vector<uint64_t>()) {
+    std::vector<ApaPartial> merged;
+    for (int index = 0; index < count; index++) {
+        const SliceShard shard = {index, count};
+        const uint64_t budget = budgets.empty() ? 0 : budgets[index % budgets.size()];
+        RunStats stats;
+        const std::vector<ApaPartial> partials = inter
+            ? processSliceShard(inputs.slice, inputs.anchors, configs, shard, 2, budget, nullptr, &stats)
+            : processSliceShard(inputs.slice, inputs.tables, configs, false, MIN_DIST, MAX_DIST, shard, 2, budget,
+                                nullptr, &stats);
+        if (records_read) records_read->push_back(recordsRead(stats));
+        if (merged.empty()) {
+            merged = partials;
+        } else {
+            for (size_t i = 0; i < partials.size(); i++) merged[i].add(partials[i]);
+        }
+    }
+    return merged;
+}
+
+// Integer counts sum exactly in any order, so the merged result must match
+// bit for bit; float values only up to rounding
+void testMerge(const Inputs& inputs, bool inter, double max_relative) {
+    const std::vector<ApaConfig> configs = {{10, 1}, {5, 2}};
+    const std::vector<APAMatrix> whole =
+        inter ? processSliceFile(inputs.slice, inputs.anchors, configs, 2)
+              : processSliceFile(inputs.slice, inputs.tables, configs, false, MIN_DIST, MAX_DIST, 2);
+    CHECK(whole.size() == configs.size());
+    for (const auto& matrix : whole) CHECK(total(matrix) > 0);
+
+    const int counts[] = {1, 2, 3, 7};
+    for (int count : counts) {
+        const std::vector<ApaPartial> merged = mergeShards(inputs, configs, inter, count);
+        CHECK(merged.size() == whole.size());
+        for (size_t i = 0; i < merged.size() && i < whole.size(); i++) {
+            CHECK(test::sameMatrix(merged[i].normalized(), whole[i], max_relative));
+        }
+    }
+}
+
+// Shards split the records a run reads into about equal parts: shares of
+// the blocks it wants, at most a block apart, or equal record ranges
+void testBalance(const Inputs& inputs, uint64_t max_difference) {
+    const std::vector<ApaConfig> configs = {{10, 1}};
+    RunStats stats;
+    const std::vector<APAMatrix> whole = processSliceFile(inputs.slice, inputs.tables, configs, false, MIN_DIST,
+                                                          MAX_DIST, 2, 0, nullptr, nullptr, &stats);
+    const uint64_t whole_records = recordsRead(stats);
+    const int count = 4;
+    std::vector<uint64_t> records_read;
+    const std::vector<ApaPartial> merged = mergeShards(inputs, configs, false, count, &records_read);
+    CHECK(test::sameMatrix(merged[0].normalized(), whole[0], 0));
+    uint64_t sum = 0;
+    for (uint64_t records : records_read) {
+        sum += records;
+        CHECK(records + max_difference >= whole_records / count && records <= whole_records / count + max_difference);
+    }
+    CHECK(sum == whole_records);
+}
+
+// Nodes of one run may have different memory budgets, and so split the
+// loops into different passes. Which shard reads a block must not depend
+// on that: every block is still read exactly once.
+void testBudgets(const Inputs& inputs) {
+    const std::vector<ApaConfig> configs = {{10, 1}, {5, 2}};
+    RunStats stats;
+    const std::vector<APAMatrix> whole = processSliceFile(inputs.slice, inputs.tables, configs, false, MIN_DIST,
+                                                          MAX_DIST, 2, 0, nullptr, nullptr, &stats);
+    const std::vector<uint64_t> budgets = {UINT64_MAX, 1, 200000};
+    const int counts[] = {2, 3, 5};
+    for (int count : counts) {
+        std::vector<uint64_t> records_read;
+        const std::vector<ApaPartial> merged = mergeShards(inputs, configs, false, count, &records_read, budgets);
+        for (size_t i = 0; i < merged.size(); i++) CHECK(test::sameMatrix(merged[i].normalized(), whole[i], 0));
+        uint64_t sum = 0;
+        for (uint64_t records : records_read) sum += records;
+        CHECK(sum >= recordsRead(stats));
+    }
+}
+
+bool samePartial(const ApaPartial& a, const ApaPartial& b) {
+    return test::sameMatrix(a.matrix, b.matrix, 0) && a.rowSums == b.rowSums && a.colSums == b.colSums;
+}
+
+void testSaveLoad(const test::TempDir& dir, const Inputs& inputs) {
+    const std::vector<ApaConfig> configs = {{10, 1}};
+    const SliceShard shard = {1, 3};
+    const std::vector<ApaPartial> partials =
+        processSliceShard(inputs.slice, inputs.tables, configs, false, MIN_DIST, MAX_DIST, shard, 2);
+    const std::string file = dir.path("shard.partial");
+    const uint64_t fingerprint = 0x0123456789abcdefULL;
+    partials[0].save(file, shard, fingerprint);
+
+    SliceShard loaded_shard = {0, 0};
+    uint64_t loaded_fingerprint = 0;
+    const ApaPartial loaded = ApaPartial::load(file, loaded_shard, loaded_fingerprint);
+    CHECK(samePartial(loaded, partials[0]));
+    CHECK(loaded_shard.index == shard.index && loaded_shard.count == shard.count);
+    CHECK(loaded_fingerprint == fingerprint);
+
+    // A truncated file is refused
+    const std::string bytes = test::fileBytes(file);
+    std::ofstream(file, std::ios::binary) << bytes.substr(0, bytes.size() - 4);
+    CHECK(test::throws([&] { ApaPartial::load(file, loaded_shard, loaded_fingerprint); }));
+}
+
+} // namespace
+
+int main() {
+    return test::runTests([] {
+        test::TempDir dir;
+        // Shards split an indexed slice by blocks, an unindexed one by
+        // record ranges and a compressed one by chromosome pairs, some
+        // shards getting none
+        const Inputs counts = makeInputs(dir, "counts", false, true);
+        testMerge(counts, false, 0);
+        testMerge(counts, true, 0);
+        const Inputs unindexed = makeInputs(dir, "unindexed", false, false);
+        testMerge(unindexed, false, 0);
+        testMerge(unindexed, true, 0);
+        const Inputs compressed = makeInputs(dir, "compressed", false, false, true);
+        testMerge(compressed, false, 0);
+        testMerge(compressed, true, 0);
+        testMerge(makeInputs(dir, "floats", true, true), false, 1e-4);
+        testBalance(makeInputs(dir, "chr1", false, true, false, true), 1 << 14);
+        testBalance(unindexed, 1);
+        testBudgets(counts);
+        testBudgets(unindexed);
+        testSaveLoad(dir, counts);
+    });
+}
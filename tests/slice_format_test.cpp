@@ -0,0 +1,101 @@
+#include "test_util.h"
+#include "slice_reader.h"
+
+// Every layout, plain and gzip-compressed, reads back the records written,
+// and convertSlice between layouts changes nothing but the encoding
+
+namespace {
+
+const int32_t RESOLUTION = 5000;
+const int NUM_CHROMS = 3;
+
+std::vector<ContactRecord> readFile(const std::string& filename, SliceHeader* header = nullptr) {
+    std::unique_ptr<SliceReader> reader = SliceReader::open(filename, 2);
+    if (header) *header = reader->header();
+    return test::readAll(*reader);
+}
+
+void testRoundTrip(const test::TempDir& dir, RecordLayout layout, bool gzip, bool float_values, bool sorted) {
+    const std::vector<ContactRecord> records = test::randomContacts(50000, NUM_CHROMS, 4000, float_values, sorted, 3);
+    const std::string file = dir.path("roundtrip.hicslice");
+    const std::string compressed = dir.path("roundtrip.hicslice.gz");
+    test::writeSlice(file, RESOLUTION, test::chromNames(NUM_CHROMS), records, layout, sorted ? SLICE_FLAG_SORTED : 0);
+    if (gzip) test::gzipFile(file, compressed);
+
+    SliceHeader header;
+    CHECK(test::sameRecords(readFile(gzip ? compressed : file, &header), records));
+    CHECK(header.layout == layout);
+    CHECK(header.resolution == RESOLUTION);
+    CHECK(header.chromosomeKeyToName == test::chromNames(NUM_CHROMS));
+    CHECK(header.sorted() == (sorted && layout != RecordLayout::Padded20));
+    CHECK(header.version == (layout == RecordLayout::Padded20 ? 1 : 2));
+}
+
+void testConvert(const test::TempDir& dir, RecordLayout from, RecordLayout to) {
+    const std::vector<ContactRecord> records = test::randomContacts(50000, NUM_CHROMS, 4000, true, true, 4);
+    const std::string plain = dir.path("convert_plain.hicslice");
+    const std::string input = dir.path("convert_in.hicslice");
+    const std::string output = dir.path("convert_out.hicslice");
+    // Columnar blocks are compressed already and must not be gzipped
+    test::writeSlice(from == RecordLayout::Columnar ? input : plain, RESOLUTION, test::chromNames(NUM_CHROMS), records,
+                     from, SLICE_FLAG_SORTED);
+    if (from != RecordLayout::Columnar) test::gzipFile(plain, input);
+
+    CHECK(convertSlice(input, output, to) == records.size());
+    SliceHeader header;
+    CHECK(test::sameRecords(readFile(output, &header), records));
+    CHECK(header.layout == to);
+    CHECK(header.sorted() == (to != RecordLayout::Padded20));  // Detected from the records, not the input flag
+}
+
+// Enough records for several Columnar blocks, the last one partial, with
+// bins jumping back at each chromosome pair and values of every size
+void testColumnarBlocks(const test::TempDir& dir) {
+    const std::vector<ContactRecord> records = test::randomContacts(300001, 5, 4000, true, true, 6);
+    const std::string file = dir.path("columnar.hicslice");
+    test::writeSlice(file, RESOLUTION, test::chromNames(5), records, RecordLayout::Columnar, SLICE_FLAG_SORTED);
+    CHECK(test::sameRecords(readFile(file), records));
+
+    std::map<int16_t, std::string> names;
+    names[1] = "chr1";
+    names[-2] = "chrM";
+    std::vector<ContactRecord> edges;
+    const int32_t bins[] = {0, 1, 2147483647, 0, -5, 65535, 65536, 127, 128};
+    for (size_t i = 0; i < sizeof(bins) / sizeof(bins[0]); i++) {
+        ContactRecord record;
+        record.chr1Key = i % 2 ? -2 : 1;
+        record.chr2Key = i % 3 ? 1 : -2;
+        record.binX = bins[i];
+        record.binY = bins[(i * 5) % 9];
+        record.value = i % 2 ? -1e30f : 1.5e-38f * static_cast<float>(i);
+        edges.push_back(record);
+    }
+    const std::string edge_file = dir.path("columnar_edges.hicslice");
+    test::writeSlice(edge_file, 1000, names, edges, RecordLayout::Columnar);
+    CHECK(test::sameRecords(readFile(edge_file), edges));
+
+    // Gzipped Columnar files are refused rather than misread
+    const std::string compressed = dir.path("columnar.hicslice.gz");
+    test::gzipFile(file, compressed);
+    CHECK(test::throws([&] { readFile(compressed); }));
+}
+
+} // namespace
+
+int main() {
+    return test::runTests([] {
+        test::TempDir dir;
+        const RecordLayout layouts[] = {RecordLayout::Padded20, RecordLayout::Packed16, RecordLayout::DeltaVarint,
+                                        RecordLayout::Columnar};
+        for (RecordLayout layout : layouts) {
+            const int gzip_modes = layout == RecordLayout::Columnar ? 1 : 2;
+            for (int gzip = 0; gzip < gzip_modes; gzip++) {
+                testRoundTrip(dir, layout, gzip != 0, false, true);
+                testRoundTrip(dir, layout, gzip != 0, true, true);
+                testRoundTrip(dir, layout, gzip != 0, true, false);
+            }
+            for (RecordLayout to : layouts) testConvert(dir, layout, to);
+        }
+        testColumnarBlocks(dir);
+    });
+}
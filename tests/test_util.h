@@ -0,0 +1,199 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include "apa.h"
+#include "slice_reader.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+// Minimal checks for the ctest targets: a failed CHECK prints where and
+// counts, and runTests turns the count into the exit status
+namespace test {
+
+inline int& failures() {
+    static int count = 0;
+    return count;
+}
+
+inline void fail(const char* file, int line, const std::string& what) {
+    std::cerr << file << ":" << line << ": check failed: " << what << std::endl;
+    failures()++;
+}
+
+// A scratch directory removed with its files when the test ends
+class TempDir {
+public:
+    TempDir() {
+        char pattern[] = "/tmp/apa4_test_XXXXXX";
+        if (!mkdtemp(pattern)) {
+            std::cerr << "Could not create a temporary directory" << std::endl;
+            std::exit(1);
+        }
+        dir = pattern;
+    }
+    ~TempDir() { std::system(("rm -rf '" + dir + "'").c_str()); }
+
+    std::string path(const std::string& name) const { return dir + "/" + name; }
+
+private:
+    std::string dir;
+};
+
+// Chromosomes chr1..chrN keyed 1..N
+inline std::map<int16_t, std::string> chromNames(int num_chroms) {
+    std::map<int16_t, std::string> names;
+    for (int c = 1; c <= num_chroms; c++) names[static_cast<int16_t>(c)] = "chr" + std::to_string(c);
+    return names;
+}
+
+inline bool recordLess(const ContactRecord& a, const ContactRecord& b) {
+    if (a.chr1Key != b.chr1Key) return a.chr1Key < b.chr1Key;
+    if (a.chr2Key != b.chr2Key) return a.chr2Key < b.chr2Key;
+    if (a.binX != b.binX) return a.binX < b.binX;
+    return a.binY < b.binY;
+}
+
+// Contacts on chromosomes 1..num_chroms of `bins` bins each, mostly intra
+// and near the diagonal, with small counts or float values
+inline std::vector<ContactRecord> randomContacts(size_t count, int num_chroms, int32_t bins, bool float_values,
+                                                 bool sorted, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::uniform_int_distribution<int> pick_chrom(1, num_chroms);
+    std::uniform_int_distribution<int32_t> pick_bin(0, bins - 1);
+    std::geometric_distribution<int32_t> distance(0.01);
+    std::geometric_distribution<int> counts(0.5);
+    std::exponential_distribution<float> weight(1.0f);
+    std::vector<ContactRecord> records(count);
+    for (auto& record : records) {
+        int c1 = pick_chrom(rng);
+        int c2 = pick_chrom(rng);
+        if (c2 < c1) std::swap(c1, c2);
+        if (rng() % 10 < 7) c2 = c1;
+        record.chr1Key = static_cast<int16_t>(c1);
+        record.chr2Key = static_cast<int16_t>(c2);
+        record.binX = pick_bin(rng);
+        record.binY = c1 == c2 ? std::min(bins - 1, record.binX + distance(rng)) : pick_bin(rng);
+        record.value = float_values ? weight(rng) : static_cast<float>(1 + counts(rng));
+    }
+    if (sorted) std::sort(records.begin(), records.end(), recordLess);
+    return records;
+}
+
+// Padded20 slices get a version 1 header, other layouts version 2 with
+// the flags
+inline void writeSlice(const std::string& filename, int32_t resolution, const std::map<int16_t, std::string>& names,
+                       const std::vector<ContactRecord>& records, RecordLayout layout = RecordLayout::Padded20,
+                       uint32_t flags = 0) {
+    SliceWriter writer(filename, resolution, names, layout);
+    for (const auto& record : records) writer.write(record);
+    writer.finish(flags);
+}
+
+inline std::string fileBytes(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+inline void gzipFile(const std::string& input, const std::string& output) {
+    const std::string bytes = fileBytes(input);
+    gzFile out = gzopen(output.c_str(), "wb6");
+    if (!out || gzwrite(out, bytes.data(), static_cast<unsigned>(bytes.size())) != static_cast<int>(bytes.size()) ||
+        gzclose(out) != Z_OK) {
+        throw std::runtime_error("Could not compress " + input);
+    }
+}
+
+inline bool sameRecord(const ContactRecord& a, const ContactRecord& b) {
+    return a.chr1Key == b.chr1Key && a.chr2Key == b.chr2Key && a.binX == b.binX && a.binY == b.binY &&
+           a.value == b.value;
+}
+
+// Every record a reader hands out, decoded
+inline std::vector<ContactRecord> readAll(SliceReader& reader) {
+    std::vector<ContactRecord> records;
+    RecordBatch batch;
+    while (reader.nextBatch(batch, 1000)) {
+        for (size_t i = 0; i < batch.count; i++) records.push_back(decodeRecord(batch.record(i), batch.layout));
+    }
+    return records;
+}
+
+inline bool sameRecords(const std::vector<ContactRecord>& a, const std::vector<ContactRecord>& b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (!sameRecord(a[i], b[i])) return false;
+    }
+    return true;
+}
+
+// Forward and reverse anchors at uniform positions on chr1..chrN, or on
+// chr1 only
+inline void writeBeds(const std::string& forward_bed, const std::string& reverse_bed, int num_chroms, long length,
+                      uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::uniform_int_distribution<long> pick_start(0, length - 1000);
+    for (const std::string* filename : {&forward_bed, &reverse_bed}) {
+        std::ofstream out(*filename);
+        for (int c = 1; c <= std::abs(num_chroms); c++) {
+            for (int i = 0; i < 150; i++) {
+                const long start = pick_start(rng);
+                out << "chr" << c << "\t" << start << "\t" << start + 1000 << "\n";
+            }
+        }
+    }
+}
+
+// Exactly equal, or within max_relative of the larger magnitude
+inline bool sameMatrix(const APAMatrix& a, const APAMatrix& b, double max_relative) {
+    if (a.width != b.width) return false;
+    for (int r = 0; r < a.width; r++) {
+        for (int c = 0; c < a.width; c++) {
+            const double x = a.at(r, c), y = b.at(r, c);
+            if (x != y && std::fabs(x - y) > max_relative * std::max(std::fabs(x), std::fabs(y))) return false;
+        }
+    }
+    return true;
+}
+
+template <typename Body>
+bool throws(Body body) {
+    try {
+        body();
+    } catch (const std::exception&) {
+        return true;
+    }
+    return false;
+}
+
+template <typename Body>
+int runTests(Body body) {
+    try {
+        body();
+    } catch (const std::exception& e) {
+        std::cerr << "Unexpected exception: " << e.what() << std::endl;
+        return 1;
+    }
+    if (failures() > 0) {
+        std::cerr << failures() << " checks failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+} // namespace test
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) test::fail(__FILE__, __LINE__, #condition); \
+    } while (0)
+
+#endif